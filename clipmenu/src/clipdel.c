@@ -91,13 +91,16 @@ int main(int argc, char *argv[]) {
 
     die_on(optind >= argc, "%s\n", usage);
 
+    bool dry_run = state.mode == DELETE_DRY_RUN;
     _drop_(close) int content_dir_fd = open(get_cache_dir(&cfg), O_RDONLY);
-    _drop_(close) int snip_fd =
-        open(get_line_cache_path(&cfg), O_RDWR | O_CREAT, 0600);
+    _drop_(close) int snip_fd = open(get_line_cache_path(&cfg),
+                                     (dry_run ? O_RDONLY : O_RDWR) | O_CREAT,
+                                     0600);
     expect(content_dir_fd >= 0 && snip_fd >= 0);
 
     _drop_(cs_destroy) struct clip_store cs;
-    expect(cs_init(&cs, snip_fd, content_dir_fd) == 0);
+    expect((dry_run ? cs_init_readonly : cs_init)(&cs, snip_fd,
+                                                  content_dir_fd) == 0);
 
     if (!state.literal_match) {
         die_on(regcomp(&state.rgx, argv[optind], REG_EXTENDED | REG_NOSUB),
@@ -106,7 +109,18 @@ int main(int argc, char *argv[]) {
         state.needle = argv[optind];
     }
 
-    expect(cs_remove(&cs, CS_ITER_OLDEST_FIRST, remove_if_match, &state) == 0);
+    if (dry_run) {
+        // Nothing will be removed, so just walk the snips under the shared
+        // lock instead of going through cs_remove()
+        _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+        struct cs_snip *snip = NULL;
+        while (cs_snip_iter(&guard, CS_ITER_OLDEST_FIRST, &snip)) {
+            (void)remove_if_match(snip->hash, snip->line, &state);
+        }
+    } else {
+        expect(cs_remove(&cs, CS_ITER_OLDEST_FIRST, remove_if_match,
+                         &state) == 0);
+    }
 
     if (!state.literal_match) {
         regfree(&state.rgx);
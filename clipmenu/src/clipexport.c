@@ -0,0 +1,64 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "export.h"
+#include "store.h"
+#include "util.h"
+
+int main(int argc, char *argv[]) {
+    const char usage[] = "Usage: clipexport [-i]";
+
+    _drop_(config_free) struct config cfg = setup("clipexport");
+
+    bool import = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "ih")) != -1) {
+        switch (opt) {
+            case 'i':
+                import = true;
+                break;
+            case 'h':
+                exec_man();
+                break;
+            default:
+                die("%s\n", usage);
+        }
+    }
+
+    die_on(optind != argc, "%s\n", usage);
+    die_on(!import && isatty(STDOUT_FILENO),
+           "Refusing to write an export to a terminal\n");
+
+    _drop_(close) int content_dir_fd = open(get_cache_dir(&cfg), O_RDONLY);
+    _drop_(close) int snip_fd = open(get_line_cache_path(&cfg),
+                                     (import ? O_RDWR : O_RDONLY) | O_CREAT,
+                                     0600);
+    expect(content_dir_fd >= 0 && snip_fd >= 0);
+
+    _drop_(cs_destroy) struct clip_store cs;
+    expect((import ? cs_init : cs_init_readonly)(&cs, snip_fd,
+                                                 content_dir_fd) == 0);
+
+    size_t nr;
+    if (import) {
+        int ret = export_read(&cs, STDIN_FILENO,
+                              cfg.deduplicate ? CS_DUPE_KEEP_LAST
+                                              : CS_DUPE_KEEP_ALL,
+                              &nr);
+        die_on(ret == -EINVAL, "Input is not a valid clipexport stream\n");
+        die_on(ret == -ENODATA, "Input ended before the end of the export\n");
+        die_on(ret < 0, "Import failed: %s\n", strerror(-ret));
+        dbg("Imported %zu clips\n", nr);
+    } else {
+        int ret = export_write(&cs, STDOUT_FILENO, &nr);
+        die_on(ret < 0, "Export failed: %s\n", strerror(-ret));
+        dbg("Exported %zu clips\n", nr);
+    }
+
+    return 0;
+}
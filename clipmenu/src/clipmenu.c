@@ -4,29 +4,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include "config.h"
+#include "menu.h"
+#include "picker.h"
 #include "store.h"
 #include "util.h"
 
 #define MAX_ARGS 32
 
+/* The launcher to use when the builtin one has no terminal to run on */
+#define FALLBACK_LAUNCHER "dmenu"
+
 static int dmenu_user_argc;
 static char **dmenu_user_argv;
 
-/**
- * Calculate the base 10 padding length for a number.
- */
-static int get_padding_length(size_t num) {
-    int digits = 1;
-    while (num /= 10) {
-        digits++;
-    }
-    return digits;
-}
-
 /**
  * Execute the launcher. Called after fork() is already done in the new child.
  */
@@ -72,54 +67,90 @@ static void _noreturn_ _nonnull_ exec_launcher(struct config *cfg,
     die("Failed to exec %s: %s\n", cmd[0], strerror(errno));
 }
 
-static int dprintf_ellipsise_long_snip_line(int fd, const char *line) {
-    size_t line_len = strlen(line);
-    if (line_len == CS_SNIP_LINE_SIZE - 1) {
-        return dprintf(fd, "%.*s...", (int)(CS_SNIP_LINE_SIZE - 4), line);
-    } else {
-        return dprintf(fd, "%s", line);
+/**
+ * Send the menu text to the launcher. If the menu came from clipmenud's file,
+ * the kernel copies it straight from the page cache.
+ */
+static void _nonnull_ send_menu(int fd, const struct menu_view *menu) {
+    size_t remaining = menu->header.text_size;
+    if (menu->fd < 0) {
+        write_safe(fd, menu->text, remaining);
+        return;
+    }
+
+    off_t offset = menu->text_offset;
+    while (remaining > 0) {
+        ssize_t sent = sendfile(fd, menu->fd, &offset, remaining);
+        expect(sent > 0);
+        remaining -= (size_t)sent;
     }
 }
 
+/**
+ * The label of the entry which shows the next page in paged mode.
+ */
+#define MORE_LABEL "more"
+
+/**
+ * Get the menu to show. In paged mode, only the page starting at page_start is
+ * rendered. Otherwise, clipmenud's menu file is used if it's up to date.
+ * Returns the number of clips left after this page.
+ */
+static size_t _nonnull_ get_menu(struct config *cfg, struct ref_guard *guard,
+                                 size_t page_start, struct menu_buf *buf,
+                                 struct menu_view *menu) {
+    if (cfg->menu_page_size > 0) {
+        expect(menu_build_page(guard, page_start, (size_t)cfg->menu_page_size,
+                               buf) == 0);
+        menu_view_from_buf(buf, menu);
+        return menu->header.first_label - 1;
+    }
+
+    int ret = menu_open(get_menu_path(cfg), guard, menu);
+    if (ret < 0) {
+        // clipmenud isn't running, or something else changed the store since
+        // it last rendered the menu
+        dbg("Menu file unusable (%s), rendering it ourselves\n",
+            strerror(-ret));
+        expect(menu_build(guard, buf) == 0);
+        menu_view_from_buf(buf, menu);
+    }
+    return 0;
+}
+
 /**
  * Writes the available clips to the launcher and reads back the user's
- * selection.
+ * selection. If the user asks for more clips in paged mode, page_start is
+ * advanced and show_more is set.
  */
 static int _nonnull_ interact_with_dmenu(struct config *cfg, int *input_pipe,
-                                         int *output_pipe, uint64_t *out_hash) {
+                                         int *output_pipe, size_t *page_start,
+                                         bool *show_more, uint64_t *out_hash) {
     close(input_pipe[0]);
     close(output_pipe[1]);
 
     _drop_(close) int content_dir_fd = open(get_cache_dir(cfg), O_RDONLY);
     _drop_(close) int snip_fd =
-        open(get_line_cache_path(cfg), O_RDWR | O_CREAT, 0600);
+        open(get_line_cache_path(cfg), O_RDONLY | O_CREAT, 0600);
     expect(content_dir_fd >= 0 && snip_fd >= 0);
 
     _drop_(cs_destroy) struct clip_store cs;
-    expect(cs_init(&cs, snip_fd, content_dir_fd) == 0);
+    expect(cs_init_readonly(&cs, snip_fd, content_dir_fd) == 0);
 
     struct ref_guard guard = cs_ref(&cs);
-    size_t cur_clips;
-    expect(cs_len(&cs, &cur_clips) == 0);
-    _drop_(free) uint64_t *idx_to_hash = malloc(cur_clips * sizeof(uint64_t));
-    expect(idx_to_hash);
-    int pad = get_padding_length(cur_clips);
-    size_t clip_idx = cur_clips;
-
-    struct cs_snip *snip = NULL;
-    while (cs_snip_iter(&guard, CS_ITER_NEWEST_FIRST, &snip)) {
-        expect(dprintf(input_pipe[1], "[%*zu] ", pad, clip_idx--) > 0);
-        expect(dprintf_ellipsise_long_snip_line(input_pipe[1], snip->line) > 0);
-        if (snip->nr_lines > 1) {
-            expect(dprintf(input_pipe[1], " (%zu lines)", snip->nr_lines) > 0);
-        }
-        write_safe(input_pipe[1], "\n", 1);
-        idx_to_hash[clip_idx] = snip->hash;
-    }
+    _drop_(menu_close) struct menu_view menu;
+    struct menu_buf buf = {0};
+    size_t nr_older = get_menu(cfg, &guard, *page_start, &buf, &menu);
+    _drop_(free) char *built = buf.data;
 
-    // We've written everything and have our own map, no need to hold any more
+    // We have our own copy of the menu now, no need to hold any more
     cs_unref(guard.cs);
 
+    send_menu(input_pipe[1], &menu);
+    if (nr_older > 0) {
+        expect(dprintf(input_pipe[1], "[" MORE_LABEL "] (%zu older clips)\n",
+                       nr_older) > 0);
+    }
     close(input_pipe[1]);
 
     char sel_idx_str[UINT64_MAX_STRLEN + 1];
@@ -133,11 +164,12 @@ static int _nonnull_ interact_with_dmenu(struct config *cfg, int *input_pipe,
 
     uint64_t sel_idx;
     int forced_ret = 0;
-    if (str_to_uint64(sel_idx_str, &sel_idx) < 0 || sel_idx == 0 ||
-        sel_idx > cur_clips) {
+    *show_more = nr_older > 0 && streq(sel_idx_str, MORE_LABEL);
+    if (*show_more) {
+        *page_start += menu.header.nr_entries;
+    } else if (str_to_uint64(sel_idx_str, &sel_idx) < 0 ||
+               menu_lookup(&menu, sel_idx, out_hash) < 0) {
         forced_ret = EXIT_FAILURE;
-    } else {
-        *out_hash = idx_to_hash[sel_idx - 1];
     }
 
     int dmenu_status;
@@ -151,22 +183,73 @@ static int _nonnull_ interact_with_dmenu(struct config *cfg, int *input_pipe,
     return WEXITSTATUS(dmenu_status);
 }
 
+/**
+ * Prompts the user to select a clip with the built-in picker, without forking
+ * a launcher at all. Returns a negative errno if there is no terminal to show
+ * it on.
+ */
+static int _nonnull_ prompt_user_with_picker(struct config *cfg,
+                                             uint64_t *hash) {
+    _drop_(close) int content_dir_fd = open(get_cache_dir(cfg), O_RDONLY);
+    _drop_(close) int snip_fd =
+        open(get_line_cache_path(cfg), O_RDONLY | O_CREAT, 0600);
+    expect(content_dir_fd >= 0 && snip_fd >= 0);
+
+    _drop_(cs_destroy) struct clip_store cs;
+    expect(cs_init_readonly(&cs, snip_fd, content_dir_fd) == 0);
+
+    struct ref_guard guard = cs_ref(&cs);
+    _drop_(picker_free) struct picker picker;
+    int ret = picker_load(&picker, &guard);
+    cs_unref(guard.cs);
+    expect(ret == 0);
+
+    return picker_run(&picker, hash);
+}
+
 /**
  * Prompts the user to select a clip via their launcher, and returns the
- * selected content hash.
+ * selected content hash. In paged mode, the launcher is started again for each
+ * page the user asks for.
  */
 static int _nonnull_ prompt_user_for_hash(struct config *cfg, uint64_t *hash) {
-    int input_pipe[2], output_pipe[2];
-    expect(pipe(input_pipe) == 0 && pipe(output_pipe) == 0);
+    size_t page_start = 0;
+    bool show_more;
+    int ret;
+
+    if (cfg->launcher.ltype == LAUNCHER_BUILTIN) {
+        ret = prompt_user_with_picker(cfg, hash);
+        if (ret >= 0) {
+            return ret;
+        }
+        // Usually because we were started from a hotkey rather than a
+        // terminal, so use the default launcher instead
+        fprintf(stderr,
+                "Cannot use builtin launcher without a terminal (%s), "
+                "falling back to " FALLBACK_LAUNCHER "\n",
+                strerror(-ret));
+        free(cfg->launcher.custom);
+        cfg->launcher.custom = strdup(FALLBACK_LAUNCHER);
+        expect(cfg->launcher.custom);
+        cfg->launcher.ltype = LAUNCHER_CUSTOM;
+    }
 
-    pid_t pid = fork();
-    expect(pid >= 0);
+    do {
+        int input_pipe[2], output_pipe[2];
+        expect(pipe(input_pipe) == 0 && pipe(output_pipe) == 0);
 
-    if (pid == 0) {
-        exec_launcher(cfg, input_pipe, output_pipe);
-    }
+        pid_t pid = fork();
+        expect(pid >= 0);
+
+        if (pid == 0) {
+            exec_launcher(cfg, input_pipe, output_pipe);
+        }
+
+        ret = interact_with_dmenu(cfg, input_pipe, output_pipe, &page_start,
+                                  &show_more, hash);
+    } while (ret == EXIT_SUCCESS && show_more);
 
-    return interact_with_dmenu(cfg, input_pipe, output_pipe, hash);
+    return ret;
 }
 
 int main(int argc, char *argv[]) {
@@ -5,6 +5,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <regex.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -17,7 +18,10 @@
 #include <unistd.h>
 
 #include "config.h"
+#include "menu.h"
+#include "persist.h"
 #include "store.h"
+#include "trace.h"
 #include "util.h"
 #include "x.h"
 
@@ -28,11 +32,16 @@ static Window win;
 
 static int enabled = 1;
 static int sig_fd;
+static bool exiting;
 
 static Atom incr_atom;
-static struct incr_transfer *it_list;
+static struct it_table transfers;
 
 static struct cm_selections sels[CM_SEL_MAX];
+static struct clip_trace sel_traces[CM_SEL_MAX];
+static char latency_path[PATH_MAX];
+static char menu_path[PATH_MAX];
+static struct menu_live live_menu;
 
 enum clip_text_source {
     CLIP_TEXT_SOURCE_X,
@@ -60,6 +69,93 @@ static void free_clip_text(struct clip_text *ct) {
     ct->source = CLIP_TEXT_SOURCE_INVALID;
 }
 
+/**
+ * How many bytes from each end of a clip are kept for partial detection.
+ */
+#define PARTIAL_FINGERPRINT_SIZE 64
+
+/**
+ * The parts of a clip needed to check whether another clip is a possible
+ * partial of it, without having to keep the full (possibly multi-MB) text.
+ *
+ * @len: The length of the whole clip
+ * @window_len: How many bytes of prefix and suffix are valid, which is the
+ *              smaller of len and PARTIAL_FINGERPRINT_SIZE
+ * @prefix: The first window_len bytes of the clip
+ * @suffix: The last window_len bytes of the clip
+ */
+struct clip_fingerprint {
+    size_t len;
+    size_t window_len;
+    char prefix[PARTIAL_FINGERPRINT_SIZE];
+    char suffix[PARTIAL_FINGERPRINT_SIZE];
+};
+
+static void clip_fingerprint_init(struct clip_fingerprint *fp,
+                                  const char *text) {
+    fp->len = strlen(text);
+    fp->window_len = fp->len < PARTIAL_FINGERPRINT_SIZE
+                         ? fp->len
+                         : PARTIAL_FINGERPRINT_SIZE;
+    memcpy(fp->prefix, text, fp->window_len);
+    memcpy(fp->suffix, text + fp->len - fp->window_len, fp->window_len);
+}
+
+/**
+ * Get a pointer to bytes [off, off + n) of the fingerprinted clip, or NULL if
+ * those bytes fall outside of the prefix and suffix windows.
+ */
+static const char *clip_fingerprint_bytes(const struct clip_fingerprint *fp,
+                                          size_t off, size_t n) {
+    size_t suffix_start = fp->len - fp->window_len;
+    if (off + n <= fp->window_len) {
+        return fp->prefix + off;
+    }
+    if (off >= suffix_start && off + n <= fp->len) {
+        return fp->suffix + (off - suffix_start);
+    }
+    return NULL;
+}
+
+/**
+ * Check whether the shorter clip could appear at offset off in the longer one.
+ * The start and end of the shorter clip are compared against the longer
+ * clip's bytes at the same position wherever the longer fingerprint has them.
+ * This only rules clips out: if neither end can be compared, the caller has to
+ * look at the full text to find out.
+ */
+static bool clip_fingerprint_occurs_at(const struct clip_fingerprint *shorter,
+                                       const struct clip_fingerprint *longer,
+                                       size_t off) {
+    size_t n = shorter->window_len;
+    const char *head = clip_fingerprint_bytes(longer, off, n);
+    const char *tail =
+        clip_fingerprint_bytes(longer, off + shorter->len - n, n);
+
+    if (head && memcmp(shorter->prefix, head, n) != 0) {
+        return false;
+    }
+    if (tail && memcmp(shorter->suffix, tail, n) != 0) {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Check whether a clip with fingerprint fp1 may be a partial of fp2. This is a
+ * cheap filter before is_possible_partial(): false means it definitely is
+ * not, true means the full text must be compared.
+ */
+static bool clip_fingerprint_may_be_partial(const struct clip_fingerprint *fp1,
+                                            const struct clip_fingerprint *fp2) {
+    const struct clip_fingerprint *shorter = fp1->len < fp2->len ? fp1 : fp2;
+    const struct clip_fingerprint *longer = shorter == fp1 ? fp2 : fp1;
+
+    return clip_fingerprint_occurs_at(shorter, longer, 0) ||
+           clip_fingerprint_occurs_at(shorter, longer,
+                                      longer->len - shorter->len);
+}
+
 /**
  * Check if a text s1 is a possible partial of s2.
  *
@@ -71,43 +167,50 @@ static void free_clip_text(struct clip_text *ct) {
  * user first expands, and then retracts the selection, so we need to handle
  * that too.
  */
-static bool is_possible_partial(const char *s1, const char *s2) {
-    size_t len1 = strlen(s1), len2 = strlen(s2);
+static bool is_possible_partial(const char *s1, size_t len1, const char *s2,
+                                size_t len2) {
+    const char *shorter = len1 < len2 ? s1 : s2;
+    const char *longer = shorter == s1 ? s2 : s1;
+    size_t short_len = len1 < len2 ? len1 : len2;
+    size_t long_len = len1 < len2 ? len2 : len1;
 
     // Is one a prefix of the other?
-    if (strncmp(s1, s2, len1 < len2 ? len1 : len2) == 0) {
+    if (memcmp(shorter, longer, short_len) == 0) {
         return true;
     }
 
     // Is one a suffix of the other?
-    if (len1 < len2) {
-        return strcmp(s1, s2 + len2 - len1) == 0;
-    } else {
-        return strcmp(s2, s1 + len1 - len2) == 0;
-    }
+    return memcmp(shorter, longer + long_len - short_len, short_len) == 0;
 }
 
 /**
  * Retrieve the converted text put into our clip atom. In order for this to
  * happen a conversion must have been performed in an earlier iteration with
  * XConvertSelection.
+ *
+ * This is a single round trip whether or not the owner started an INCR
+ * transfer, since an INCR property is tiny anyway. If it did, *is_incr is set
+ * and no text is returned. The property is deleted once read, which doubles
+ * as the signal to start sending chunks for INCR.
  */
-static struct clip_text get_clipboard_text(Atom clip_atom) {
+static struct clip_text get_clipboard_text(Atom clip_atom, bool *is_incr) {
     struct clip_text ct = {NULL, CLIP_TEXT_SOURCE_X};
-    unsigned char *cur_text;
+    unsigned char *cur_text = NULL;
     Atom actual_type;
     int actual_format;
     unsigned long nitems, bytes_after;
 
-    int res = XGetWindowProperty(dpy, win, clip_atom, 0L, (~0L), False,
-                                 AnyPropertyType, &actual_type, &actual_format,
-                                 &nitems, &bytes_after, &cur_text);
+    *is_incr = false;
+
+    int res = X_ROUND_TRIP(XGetWindowProperty(
+        dpy, win, clip_atom, 0L, (~0L), True, AnyPropertyType, &actual_type,
+        &actual_format, &nitems, &bytes_after, &cur_text));
     if (res != Success) {
         return ct;
     }
 
     if (actual_type == incr_atom) {
-        dbg("Unexpected INCR transfer detected\n");
+        *is_incr = true;
         XFree(cur_text);
         return ct;
     }
@@ -165,7 +268,110 @@ static bool is_ignored_window(char *win_title) {
 }
 
 /**
- * Disable or enable clip collection based on received signals.
+ * What to do with clips from a given selection owner.
+ *
+ * @OWNER_ACCEPT: Store clips from this owner
+ * @OWNER_IGNORED: The owner matches ignore_window, drop its clips
+ * @OWNER_CLIPSERVE: The owner is our own clipserve, drop its clips
+ */
+enum owner_decision {
+    OWNER_ACCEPT,
+    OWNER_IGNORED,
+    OWNER_CLIPSERVE,
+};
+
+/**
+ * A cached owner decision.
+ *
+ * @window: The owner window, or None if this slot is empty
+ * @decision: What to do with clips from this window
+ */
+struct owner_cache_entry {
+    Window window;
+    enum owner_decision decision;
+};
+
+/**
+ * Number of slots in the direct-mapped owner cache. In practice there are only
+ * a handful of windows which ever own a selection, so collisions are rare, and
+ * when they happen the old entry is simply evicted.
+ */
+#define OWNER_CACHE_SIZE 64
+
+static struct owner_cache_entry owner_cache[OWNER_CACHE_SIZE];
+
+static struct owner_cache_entry *owner_cache_slot(Window window) {
+    return &owner_cache[(window ^ (window >> 7)) % OWNER_CACHE_SIZE];
+}
+
+/**
+ * Forget the cached decision for a window and stop watching it. Called when
+ * the window's title changes, or when the window is destroyed.
+ */
+static void owner_cache_evict(Window window) {
+    struct owner_cache_entry *entry = owner_cache_slot(window);
+    if (entry->window != window || window == None) {
+        return;
+    }
+    dbg("Evicting cached owner decision for 0x%lx\n", (unsigned long)window);
+    entry->window = None;
+}
+
+/**
+ * Work out what to do with clips from the given owner. The decision is cached
+ * until the window's title changes or the window is destroyed, so once warm,
+ * this costs no round trips to the X server.
+ */
+static enum owner_decision get_owner_decision(Window owner) {
+    struct owner_cache_entry *entry = owner_cache_slot(owner);
+    if (owner != None && entry->window == owner) {
+        return entry->decision;
+    }
+
+    _drop_(free) char *win_title = get_window_title(dpy, owner);
+    enum owner_decision decision = OWNER_ACCEPT;
+    if (is_clipserve(win_title)) {
+        decision = OWNER_CLIPSERVE;
+    } else if (is_ignored_window(win_title)) {
+        decision = OWNER_IGNORED;
+    }
+
+    dbg("Owner '%s' (0x%lx) gets decision %d\n", strnull(win_title),
+        (unsigned long)owner, (int)decision);
+
+    if (owner == None || owner == win) {
+        return decision;
+    }
+
+    if (entry->window != None) {
+        // Evicted by collision, we no longer care about its events
+        XSelectInput(dpy, entry->window, NoEventMask);
+    }
+    *entry = (struct owner_cache_entry){owner, decision};
+
+    // Watch for title changes and destruction so we can invalidate
+    XSelectInput(dpy, owner, PropertyChangeMask | StructureNotifyMask);
+
+    return decision;
+}
+
+/**
+ * Process events on selection owner windows, which we only receive in order to
+ * invalidate the owner cache.
+ */
+static void handle_owner_event(const XEvent *evt) {
+    if (evt->type == DestroyNotify) {
+        owner_cache_evict(evt->xdestroywindow.window);
+    } else if (evt->type == PropertyNotify &&
+               (evt->xproperty.atom == XA_WM_NAME ||
+                evt->xproperty.atom == get_atom(dpy, X_ATOM_NET_WM_NAME))) {
+        owner_cache_evict(evt->xproperty.window);
+    }
+}
+
+/**
+ * Disable or enable clip collection based on received signals, or start a
+ * clean exit on SIGTERM or SIGINT.
  */
 static void handle_signalfd_event(void) {
     struct signalfd_siginfo si;
@@ -182,6 +388,11 @@ static void handle_signalfd_event(void) {
             enabled = 1;
             dbg("Clipboard collection enabled by signal\n");
             break;
+        case SIGTERM:
+        case SIGINT:
+            exiting = true;
+            dbg("Exiting on signal\n");
+            return;
     }
     write_status();
 }
@@ -198,17 +409,25 @@ static void handle_xfixes_selection_notify(XFixesSelectionNotifyEvent *se) {
         return;
     }
 
-    _drop_(XFree) char *win_title = get_window_title(dpy, se->owner);
-    if (is_clipserve(win_title) || is_ignored_window(win_title)) {
-        dbg("Ignoring clip from window titled '%s'\n", win_title);
+    trace_start(&sel_traces[sel], sel);
+    trace_stamp(&sel_traces[sel], TRACE_NOTIFY);
+    // Turned into a delta when the clip is queued
+    sel_traces[sel].round_trips = nr_x_round_trips;
+
+    enum owner_decision decision = get_owner_decision(se->owner);
+    if (decision == OWNER_CLIPSERVE) {
+        trace_owned(sel);
+    }
+    if (decision != OWNER_ACCEPT) {
+        dbg("Ignoring clip from window 0x%lx\n", (unsigned long)se->owner);
         return;
     }
 
-    dbg("Notified about selection update. Selection: %s, Owner: '%s' (0x%lx)\n",
-        cfg.selections[sel].name, strnull(win_title), (unsigned long)se->owner);
-    XConvertSelection(dpy, se->selection,
-                      XInternAtom(dpy, "UTF8_STRING", False), sels[sel].storage,
-                      win, CurrentTime);
+    dbg("Notified about selection update. Selection: %s, Owner: 0x%lx\n",
+        cfg.selections[sel].name, (unsigned long)se->owner);
+    XConvertSelection(dpy, se->selection, get_atom(dpy, X_ATOM_UTF8_STRING),
+                      sels[sel].storage, win, CurrentTime);
+    trace_stamp(&sel_traces[sel], TRACE_CONVERT);
 
     return;
 }
@@ -246,26 +465,79 @@ static void maybe_trim(void) {
     }
 }
 
+/**
+ * Bring the launcher menu that clipmenu sends to rofi/dmenu up to date, see
+ * menu.c. Usually only the newly stored clip is rendered under the lock, and
+ * the file is written out after it is released. After startup this only runs
+ * on the storage worker, so the X thread never waits for it.
+ */
+static void update_menu(void) {
+    int ret;
+    {
+        _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+        ret = menu_live_update(&guard, &live_menu);
+    }
+    if (ret == 0) {
+        ret = menu_live_write(&live_menu, menu_path);
+    }
+    if (ret < 0) {
+        dbg("Failed to update menu file: %s\n", strerror(-ret));
+    }
+}
+
 /**
  * Clips more than this many seconds apart are not considered for partial merge
  */
 #define PARTIAL_MAX_SECS 2
 
+/**
+ * Check whether text, with fingerprint fp, is a partial of the last stored
+ * clip. The fingerprints rule out almost every unrelated pair, and anything
+ * that gets past them is compared in full against the last clip's content,
+ * which was only just written and is still in the page cache. If that content
+ * is gone, for example because it was trimmed, the clip is not a partial.
+ */
+static bool is_partial_of_last(const char *text,
+                               const struct clip_fingerprint *fp,
+                               const struct clip_fingerprint *last_fp,
+                               uint64_t last_hash) {
+    if (!clip_fingerprint_may_be_partial(fp, last_fp)) {
+        return false;
+    }
+
+    _drop_(cs_content_unmap) struct cs_content last;
+    if (cs_content_get(&cs, last_hash, &last) < 0 ||
+        (size_t)last.size != last_fp->len) {
+        return false;
+    }
+
+    return is_possible_partial(text, fp->len, last.data, last_fp->len);
+}
+
 /**
  * Store the clipboard text. If the text is a possible partial of the last clip
  * and it was received shortly afterwards, replace instead of adding.
+ *
+ * Only a fingerprint and the hash of the last clip are kept, so the text is
+ * freed as soon as it is in the store. The length of the text is returned in
+ * out_len.
  */
-static uint64_t store_clip(struct clip_text *ct) {
-    static struct clip_text last_text = {NULL, CLIP_TEXT_SOURCE_MALLOC};
+static uint64_t store_clip(struct clip_text *ct, size_t *out_len) {
+    static struct clip_fingerprint last_fp;
+    static uint64_t last_hash;
+    static bool have_last;
     static time_t last_text_time;
 
     dbg("Clipboard text is considered salient, storing\n");
     time_t current_time = time(NULL);
     uint64_t hash;
 
-    if (last_text.data &&
+    struct clip_fingerprint fp;
+    clip_fingerprint_init(&fp, ct->data);
+
+    if (have_last &&
         difftime(current_time, last_text_time) <= PARTIAL_MAX_SECS &&
-        is_possible_partial(last_text.data, ct->data)) {
+        is_partial_of_last(ct->data, &fp, &last_fp, last_hash)) {
         dbg("Possible partial of last clip, replacing\n");
         expect(cs_replace(&cs, CS_ITER_NEWEST_FIRST, 0, ct->data, &hash) == 0);
     } else {
@@ -274,15 +546,301 @@ static uint64_t store_clip(struct clip_text *ct) {
                0);
     }
 
-    free_clip_text(&last_text);
-    last_text = *ct;
+    free_clip_text(ct);
+    *out_len = fp.len;
+    last_fp = fp;
+    last_hash = hash;
+    have_last = true;
     last_text_time = current_time;
 
-    // The caller no longer owns this data.
+    return hash;
+}
+
+/**
+ * A clip waiting to be stored by the storage worker.
+ *
+ * @ct: The clip text, owned by the queue until it is committed
+ * @sel: The selection the clip came from
+ * @trace: Latency trace for this clip
+ */
+struct clip_job {
+    struct clip_text ct;
+    enum selection_type sel;
+    struct clip_trace trace;
+};
+
+/**
+ * Store a salient clip and take ownership of it if configured to do so. This
+ * runs on the storage worker thread, see clip_queue_push().
+ */
+static void commit_clip(struct clip_job *job) {
+    uint64_t hash = store_clip(&job->ct, &job->trace.size);
+    trace_stamp(&job->trace, TRACE_COMMITTED);
+    trace_record(&job->trace);
+    maybe_trim();
+    /* We only own CLIPBOARD because otherwise the behaviour is wonky:
+     *
+     *  1. When you select in a browser and press ^V, it repastes what
+     *     you have selected instead of the previous content
+     *  2. urxvt and some other terminal emulators will unhilight on
+     *     PRIMARY ownership being taken away from them
+     */
+    if (cfg.owned_selections[job->sel].active && cfg.own_clipboard) {
+        trace_await_owner(&job->trace);
+        run_clipserve(hash);
+    }
+    update_menu();
+}
+
+/**
+ * How many clips may be waiting for storage before the X thread blocks. This
+ * only needs to absorb bursts while a large clip is being written out.
+ */
+#define CLIP_QUEUE_SIZE 16
+
+/**
+ * Bounded FIFO between the X thread, which receives clips, and the storage
+ * worker, which hashes, writes and trims them. There is exactly one worker, so
+ * clips are committed in arrival order, which store_clip() relies on for
+ * partial detection.
+ *
+ * @jobs: Ring buffer of pending clips
+ * @head: Index of the oldest pending clip
+ * @len: Number of pending clips
+ * @closing: Set when no more clips will be pushed
+ */
+static struct clip_queue {
+    struct clip_job jobs[CLIP_QUEUE_SIZE];
+    size_t head;
+    size_t len;
+    bool closing;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} clip_queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_t storage_thread;
+
+/**
+ * Hand a clip over to the storage worker. The caller no longer owns the clip
+ * text after this returns. Blocks if the queue is full.
+ */
+static void clip_queue_push(struct clip_text *ct, enum selection_type sel) {
+    struct clip_queue *q = &clip_queue;
+
+    trace_stamp(&sel_traces[sel], TRACE_QUEUED);
+    sel_traces[sel].round_trips =
+        nr_x_round_trips - sel_traces[sel].round_trips;
+
+    expect(pthread_mutex_lock(&q->lock) == 0);
+    while (q->len == CLIP_QUEUE_SIZE) {
+        dbg("Clip queue full, waiting for storage\n");
+        expect(pthread_cond_wait(&q->not_full, &q->lock) == 0);
+    }
+    q->jobs[(q->head + q->len) % CLIP_QUEUE_SIZE] = (struct clip_job){
+        .ct = *ct,
+        .sel = sel,
+        .trace = sel_traces[sel],
+    };
+    q->len++;
+    expect(pthread_cond_signal(&q->not_empty) == 0);
+    expect(pthread_mutex_unlock(&q->lock) == 0);
+
     ct->data = NULL;
     ct->source = CLIP_TEXT_SOURCE_INVALID;
+}
 
-    return hash;
+/**
+ * How long after a clip is committed the latency histograms are exported, at
+ * the earliest. Exports only happen once the queue is empty, so they never
+ * delay storing a clip.
+ */
+#define TRACE_EXPORT_DELAY_MS 1000
+
+static void export_latency(void) {
+    int ret = trace_export(latency_path, &cfg);
+    if (ret < 0) {
+        dbg("Failed to export latency stats: %s\n", strerror(-ret));
+    }
+}
+
+/**
+ * The storage worker: commit queued clips in order until the queue is closed
+ * and drained. Latency histograms are exported when the worker has been idle
+ * since TRACE_EXPORT_DELAY_MS after the first unexported clip, and on exit.
+ */
+static void *storage_worker(void *arg _unused_) {
+    struct clip_queue *q = &clip_queue;
+    struct timespec export_at;
+    bool export_due = false;
+
+    expect(pthread_mutex_lock(&q->lock) == 0);
+    while (1) {
+        while (q->len == 0 && !q->closing) {
+            if (!export_due) {
+                expect(pthread_cond_wait(&q->not_empty, &q->lock) == 0);
+                continue;
+            }
+            int ret = pthread_cond_timedwait(&q->not_empty, &q->lock,
+                                             &export_at);
+            expect(ret == 0 || ret == ETIMEDOUT);
+            if (ret == ETIMEDOUT && q->len == 0) {
+                expect(pthread_mutex_unlock(&q->lock) == 0);
+                export_latency();
+                export_due = false;
+                expect(pthread_mutex_lock(&q->lock) == 0);
+            }
+        }
+        if (q->len == 0) {
+            break;
+        }
+
+        struct clip_job job = q->jobs[q->head];
+        q->head = (q->head + 1) % CLIP_QUEUE_SIZE;
+        q->len--;
+        expect(pthread_cond_signal(&q->not_full) == 0);
+        expect(pthread_mutex_unlock(&q->lock) == 0);
+
+        trace_stamp(&job.trace, TRACE_DEQUEUED);
+        commit_clip(&job);
+        dbg("Committed %zu byte clip %" PRIu64 "us after queueing, %" PRIu64
+            " X round trips\n",
+            job.trace.size,
+            (job.trace.ts_ns[TRACE_COMMITTED] - job.trace.ts_ns[TRACE_QUEUED]) /
+                1000,
+            job.trace.round_trips);
+
+        if (!export_due) {
+            // The queue's condition variables use CLOCK_REALTIME
+            expect(clock_gettime(CLOCK_REALTIME, &export_at) == 0);
+            export_at.tv_sec += TRACE_EXPORT_DELAY_MS / 1000;
+            export_at.tv_nsec += (long)(TRACE_EXPORT_DELAY_MS % 1000) * 1000000;
+            if (export_at.tv_nsec >= 1000000000) {
+                export_at.tv_sec++;
+                export_at.tv_nsec -= 1000000000;
+            }
+            export_due = true;
+        }
+
+        expect(pthread_mutex_lock(&q->lock) == 0);
+    }
+    expect(pthread_mutex_unlock(&q->lock) == 0);
+
+    if (export_due) {
+        export_latency();
+    }
+
+    return NULL;
+}
+
+/**
+ * Start the storage worker. Must be called after signals are blocked, so that
+ * they are only delivered through sig_fd.
+ */
+static void storage_worker_start(void) {
+    expect(pthread_create(&storage_thread, NULL, storage_worker, NULL) == 0);
+}
+
+/**
+ * Wait for all queued clips to be committed and stop the storage worker.
+ */
+static void storage_worker_stop(void) {
+    expect(pthread_mutex_lock(&clip_queue.lock) == 0);
+    clip_queue.closing = true;
+    expect(pthread_cond_signal(&clip_queue.not_empty) == 0);
+    expect(pthread_mutex_unlock(&clip_queue.lock) == 0);
+    expect(pthread_join(storage_thread, NULL) == 0);
+    menu_live_free(&live_menu);
+}
+
+/**
+ * How often the persist worker checks whether it should stop, when the clip
+ * store is idle.
+ */
+#define PERSIST_POLL_MS 1000
+
+static struct persist persist;
+static pthread_t persist_thread;
+static bool persist_stopping;
+
+/**
+ * The persist worker: mirror the clip store to persist_dir, see persist.c.
+ * After a change, it waits persist_interval milliseconds before committing, so
+ * that a burst of clips is written out as one group commit.
+ */
+static void *persist_worker(void *arg _unused_) {
+    while (!__atomic_load_n(&persist_stopping, __ATOMIC_ACQUIRE)) {
+        int ret = cs_wait(&persist.cs, persist.generation, PERSIST_POLL_MS);
+        if (ret == -ETIMEDOUT || ret == -EINTR) {
+            continue;
+        }
+        struct timespec delay = {
+            .tv_sec = cfg.persist_interval / 1000,
+            .tv_nsec = (long)(cfg.persist_interval % 1000) * 1000000,
+        };
+        nanosleep(&delay, NULL);
+
+        uint64_t start = monotonic_ns();
+        ret = persist_commit(&persist);
+        if (ret < 0) {
+            dbg("Failed to persist clip store: %s\n", strerror(-ret));
+        } else {
+            dbg("Persisted clip store in %" PRIu64 "us\n",
+                (monotonic_ns() - start) / 1000);
+        }
+    }
+
+    int ret = persist_commit(&persist);
+    if (ret < 0) {
+        dbg("Failed to persist clip store: %s\n", strerror(-ret));
+    }
+    return NULL;
+}
+
+/**
+ * Start mirroring the clip store, if persist_dir is set. The worker gets its
+ * own read-only handle on the clip store, so it never contends with the
+ * storage worker for anything but the file lock.
+ */
+static void persist_worker_start(void) {
+    if (!cfg.persist_dir) {
+        return;
+    }
+    int snip_fd = open(get_line_cache_path(&cfg), O_RDONLY | O_CLOEXEC);
+    int content_dir_fd = open(get_cache_dir(&cfg), O_RDONLY | O_CLOEXEC);
+    expect(snip_fd >= 0 && content_dir_fd >= 0);
+    int ret = persist_init(&persist, cfg.persist_dir, snip_fd, content_dir_fd);
+    if (ret < 0) {
+        fprintf(stderr, "Not persisting clips to %s: %s\n", cfg.persist_dir,
+                strerror(-ret));
+        close(snip_fd);
+        close(content_dir_fd);
+        free(cfg.persist_dir);
+        cfg.persist_dir = NULL;
+        return;
+    }
+    expect(pthread_create(&persist_thread, NULL, persist_worker, NULL) == 0);
+}
+
+/**
+ * Do a final commit and stop the persist worker. Must be called after the
+ * storage worker has stopped, so that no clips are missed.
+ */
+static void persist_worker_stop(void) {
+    if (!cfg.persist_dir) {
+        return;
+    }
+    __atomic_store_n(&persist_stopping, true, __ATOMIC_RELEASE);
+    expect(pthread_join(persist_thread, NULL) == 0);
+    int snip_fd = persist.cs.snip_fd;
+    int content_dir_fd = persist.cs.content_dir_fd;
+    persist_destroy(&persist);
+    close(snip_fd);
+    close(content_dir_fd);
 }
 
 /**
@@ -309,18 +867,14 @@ static void incr_receive_finish(struct incr_transfer *it) {
     it_dbg(it, "First line: %s\n", line);
 
     if (is_salient_text(ct.data)) {
-        uint64_t hash = store_clip(&ct);
-        maybe_trim();
-        if (cfg.owned_selections[sel].active && cfg.own_clipboard) {
-            run_clipserve(hash);
-        }
+        clip_queue_push(&ct, sel);
     } else {
         it_dbg(it, "Clipboard text is whitespace only, ignoring\n");
         free_clip_text(&ct);
     }
 
     free(it->data);
-    it_remove(&it_list, it);
+    it_remove(&transfers, it);
     free(it);
 }
 
@@ -342,10 +896,10 @@ static void incr_receive_start(const XPropertyEvent *pe) {
     expect(it->data);
 
     it_dbg(it, "Starting transfer\n");
-    it_add(&it_list, it);
+    it_add(&transfers, it);
 
-    // Signal readiness for chunks
-    XDeleteProperty(dpy, win, pe->atom);
+    // Readiness for chunks was already signalled by get_clipboard_text()
+    // deleting the INCR property.
 }
 
 /**
@@ -359,13 +913,16 @@ static void incr_receive_data(const XPropertyEvent *pe,
 
     it_dbg(it, "Receiving chunk (bytes buffered: %zu)\n", it->data_size);
 
+    // Deleting the property as we read it signals readiness for the next
+    // chunk without a separate XDeleteProperty() request.
     _drop_(XFree) unsigned char *chunk = NULL;
     Atom actual_type;
     int actual_format;
     unsigned long nitems, bytes_after;
-    XGetWindowProperty(dpy, win, pe->atom, 0, LONG_MAX, False, AnyPropertyType,
-                       &actual_type, &actual_format, &nitems, &bytes_after,
-                       &chunk);
+    X_ROUND_TRIP(XGetWindowProperty(dpy, win, pe->atom, 0, LONG_MAX, True,
+                                    AnyPropertyType, &actual_type,
+                                    &actual_format, &nitems, &bytes_after,
+                                    &chunk));
 
     size_t chunk_size = nitems * (actual_format / 8);
 
@@ -385,8 +942,11 @@ static void incr_receive_data(const XPropertyEvent *pe,
     memcpy(it->data + it->data_size, chunk, chunk_size);
     it->data_size += chunk_size;
 
-    // Signal readiness for next chunk
-    XDeleteProperty(dpy, win, pe->atom);
+    enum selection_type sel = storage_atom_to_selection_type(pe->atom, sels);
+    if (sel != CM_SEL_INVALID) {
+        sel_traces[sel].nr_chunks++;
+        trace_stamp(&sel_traces[sel], TRACE_INCR_CHUNK);
+    }
 }
 
 /**
@@ -405,38 +965,31 @@ static int handle_property_notify(const XPropertyEvent *pe) {
     }
 
     // Check if this property corresponds to an INCR transfer in progress
-    struct incr_transfer *it = it_list;
-    while (it) {
-        if (it->property == pe->atom && it->requestor == pe->window) {
-            break;
-        }
-        it = it->next;
-    }
+    struct incr_transfer *it = it_find(&transfers, pe->window, pe->atom);
 
     if (it) {
         incr_receive_data(pe, it);
         return 0;
     }
 
-    // Not an INCR transfer in progress. Check if this is an INCR transfer
-    // starting
-    Atom actual_type;
-    int actual_format;
-    unsigned long nitems, bytes_after;
-    _drop_(XFree) unsigned char *prop = NULL;
+    // Not an INCR transfer in progress, so this is either a whole clip or the
+    // start of an INCR transfer. Deletions are just the aftermath of us
+    // reading the property, there's nothing to fetch.
+    if (pe->state != PropertyNewValue) {
+        return -EINVAL;
+    }
 
-    XGetWindowProperty(dpy, win, pe->atom, 0, 0, False, AnyPropertyType,
-                       &actual_type, &actual_format, &nitems, &bytes_after,
-                       &prop);
+    trace_stamp(&sel_traces[sel], TRACE_PROPERTY);
 
-    if (actual_type == incr_atom) {
+    bool is_incr;
+    // The storage worker will take care of freeing this once stored.
+    struct clip_text ct = get_clipboard_text(pe->atom, &is_incr);
+
+    if (is_incr) {
         incr_receive_start(pe);
     } else {
         dbg("Received non-INCR PropertyNotify\n");
 
-        // store_clip will take care of freeing this later when it's gone from
-        // last_text.
-        struct clip_text ct = get_clipboard_text(pe->atom);
         if (!ct.data) {
             dbg("Failed to get clipboard text\n");
             return -EINVAL;
@@ -446,18 +999,7 @@ static int handle_property_notify(const XPropertyEvent *pe) {
         dbg("First line: %s\n", line);
 
         if (is_salient_text(ct.data)) {
-            uint64_t hash = store_clip(&ct);
-            maybe_trim();
-            /* We only own CLIPBOARD because otherwise the behaviour is wonky:
-             *
-             *  1. When you select in a browser and press ^V, it repastes what
-             *     you have selected instead of the previous content
-             *  2. urxvt and some other terminal emulators will unhilight on
-             *     PRIMARY ownership being taken away from them
-             */
-            if (cfg.owned_selections[sel].active && cfg.own_clipboard) {
-                run_clipserve(hash);
-            }
+            clip_queue_push(&ct, sel);
         } else {
             dbg("Clipboard text is whitespace only, ignoring\n");
             free_clip_text(&ct);
@@ -488,6 +1030,13 @@ static int handle_x11_event(int evt_base) {
         XEvent evt;
         XNextEvent(dpy, &evt);
 
+        // Keep the owner cache coherent even while collection is disabled
+        if ((evt.type == PropertyNotify && evt.xproperty.window != win) ||
+            evt.type == DestroyNotify) {
+            handle_owner_event(&evt);
+            continue;
+        }
+
         if (!enabled) {
             dbg("Got X event, but ignoring as collection is disabled\n");
             continue;
@@ -529,7 +1078,7 @@ static int handle_x11_event(int evt_base) {
  * clear that an explicit request has been nacked.
  */
 static int get_one_clip(int evt_base) {
-    while (1) {
+    while (!exiting) {
         // It's possible that we have more X events to process, but because of
         // the way the protocol works, we won't get told about them until we
         // next get an event if we wait for select(). Check for them first.
@@ -555,6 +1104,7 @@ static int get_one_clip(int evt_base) {
             return handle_x11_event(evt_base);
         }
     }
+    return -ECANCELED;
 }
 
 static int setup_watches(int evt_base) {
@@ -569,16 +1119,23 @@ static int setup_watches(int evt_base) {
         XFixesSelectSelectionInput(dpy, win, sel_atom,
                                    XFixesSetSelectionOwnerNotifyMask);
         dbg("Getting initial value for selection %s\n", sel.name);
-        XConvertSelection(dpy, sel_atom, XInternAtom(dpy, "UTF8_STRING", False),
+        XConvertSelection(dpy, sel_atom, get_atom(dpy, X_ATOM_UTF8_STRING),
                           sels[i].storage, win, CurrentTime);
+        trace_start(&sel_traces[i], (enum selection_type)i);
+        trace_stamp(&sel_traces[i], TRACE_CONVERT);
+        sel_traces[i].round_trips = nr_x_round_trips;
         get_one_clip(evt_base);
     }
 
     return 0;
 }
 
-static int _noreturn_ run(int evt_base) {
-    while (1) {
+/**
+ * Collect clips until asked to exit. Queued clips are then stored and the
+ * persistent mirror gets a final commit on the way out of main().
+ */
+static void run(int evt_base) {
+    while (!exiting) {
         get_one_clip(evt_base);
     }
 }
@@ -606,18 +1163,35 @@ int main(int argc, char *argv[]) {
         open(get_line_cache_path(&cfg), O_RDWR | O_CREAT, 0600);
     expect(content_dir_fd >= 0 && snip_fd >= 0);
 
+    if (cfg.persist_dir) {
+        uint64_t start = monotonic_ns();
+        int ret = persist_restore(cfg.persist_dir, snip_fd, content_dir_fd);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to restore clips from %s: %s\n",
+                    cfg.persist_dir, strerror(-ret));
+        }
+        dbg("Restored clip store in %" PRIu64 "us\n",
+            (monotonic_ns() - start) / 1000);
+    }
+
     expect(cs_init(&cs, snip_fd, content_dir_fd) == 0);
+    snprintf_safe(latency_path, sizeof(latency_path), "%s",
+                  get_latency_path(&cfg));
+    snprintf_safe(menu_path, sizeof(menu_path), "%s", get_menu_path(&cfg));
+    update_menu();
 
     die_on(!(dpy = XOpenDisplay(NULL)), "Cannot open display\n");
     win = DefaultRootWindow(dpy);
     setup_selections(dpy, sels);
 
-    incr_atom = XInternAtom(dpy, "INCR", False);
+    incr_atom = get_atom(dpy, X_ATOM_INCR);
 
     sigset_t mask;
     sigemptyset(&mask);
     sigaddset(&mask, SIGUSR1);
     sigaddset(&mask, SIGUSR2);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
     sigprocmask(SIG_BLOCK, &mask, NULL);
     sig_fd = signalfd(-1, &mask, 0);
     expect(sig_fd >= 0);
@@ -626,12 +1200,17 @@ int main(int argc, char *argv[]) {
     int unused;
     die_on(!XFixesQueryExtension(dpy, &evt_base, &unused), "XFixes missing\n");
 
+    storage_worker_start();
+    persist_worker_start();
+
     setup_watches(evt_base);
 
     if (!cfg.oneshot) {
         run(evt_base);
     }
 
+    storage_worker_stop();
+    persist_worker_stop();
     expect(cs_destroy(&cs) == 0);
     config_free(&cfg);
     XCloseDisplay(dpy);
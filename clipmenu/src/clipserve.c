@@ -1,4 +1,5 @@
 #include <X11/Xatom.h>
+#include <X11/Xlib-xcb.h>
 #include <X11/Xlib.h>
 #include <fcntl.h>
 #include <inttypes.h>
@@ -12,82 +13,363 @@
 #include "util.h"
 #include "x.h"
 
-static struct incr_transfer *it_list = NULL;
+/**
+ * An outgoing INCR transfer. The it_table only knows about the embedded
+ * incr_transfer, which must stay the first member so that lookups can be
+ * converted back with serve_transfer_of().
+ *
+ * @it: The transfer as tracked in the it_table
+ * @ready_next: Next transfer waiting for a chunk
+ * @ready: Whether this transfer is on the ready queue
+ * @chunk_size: Current chunk size
+ * @nr_chunks: Number of chunks sent so far
+ * @start_ns: When the transfer started
+ * @last_send_ns: When the last chunk was sent
+ */
+struct serve_transfer {
+    struct incr_transfer it;
+    struct serve_transfer *ready_next;
+    bool ready;
+    size_t chunk_size;
+    size_t nr_chunks;
+    uint64_t start_ns;
+    uint64_t last_send_ns;
+};
+
+static struct serve_transfer *serve_transfer_of(struct incr_transfer *it) {
+    return (struct serve_transfer *)it;
+}
+
+static struct it_table transfers;
 static Display *dpy;
-static Atom incr_atom;
+static Atom incr_atom, targets, utf8_string, text_atom, text_plain_utf8,
+    multiple, timestamp;
+
+/**
+ * The server time at which we took ownership of the selections, returned for
+ * TIMESTAMP requests as required by ICCCM 2.6.2.
+ */
+static Time owned_time;
 
 static size_t chunk_size;
+static size_t max_chunk_size;
+
+/**
+ * Transfers whose requestor has deleted the property and is waiting for the
+ * next chunk. These are serviced round-robin, one chunk each per pass, so a
+ * single large paste can't starve other requestors.
+ */
+static struct serve_transfer *ready_head;
+static struct serve_transfer *ready_tail;
+
+/**
+ * How many events we handle before servicing ready transfers even though more
+ * events are pending.
+ */
+#define INCR_EVENT_BATCH 64
+
+/**
+ * If the requestor asks for the next chunk faster than this, it can take
+ * bigger chunks. If it is slower than INCR_SLOW_ACK_NS, it gets smaller ones.
+ */
+#define INCR_FAST_ACK_NS (2 * 1000 * 1000ULL)
+#define INCR_SLOW_ACK_NS (50 * 1000 * 1000ULL)
 
 /**
  * Start an INCR transfer.
  */
-static void incr_send_start(XSelectionRequestEvent *req,
+static void incr_send_start(Window requestor, Atom property, Atom type,
                             struct cs_content *content) {
     long incr_size = content->size;
-    XChangeProperty(dpy, req->requestor, req->property, incr_atom, 32,
-                    PropModeReplace, (unsigned char *)&incr_size, 1);
-
-    struct incr_transfer *it = malloc(sizeof(struct incr_transfer));
-    expect(it);
-    *it = (struct incr_transfer){
-        .requestor = req->requestor,
-        .property = req->property,
-        .target = req->target,
-        .format = 8,
-        .data = (char *)content->data,
-        .data_size = content->size,
-        .offset = 0,
+    XChangeProperty(dpy, requestor, property, incr_atom, 32, PropModeReplace,
+                    (unsigned char *)&incr_size, 1);
+
+    struct incr_transfer *found = it_find(&transfers, requestor, property);
+    if (found) {
+        // The requestor reused the property before the last transfer on it
+        // finished, so that one is dead now. Restart from scratch.
+        struct serve_transfer *st = serve_transfer_of(found);
+        it_dbg(found, "Restarting transfer\n");
+        st->it.target = type;
+        st->it.offset = 0;
+        st->nr_chunks = 0;
+        st->start_ns = monotonic_ns();
+        st->last_send_ns = 0;
+        return;
+    }
+
+    struct serve_transfer *st = malloc(sizeof(struct serve_transfer));
+    expect(st);
+    *st = (struct serve_transfer){
+        .it =
+            {
+                .requestor = requestor,
+                .property = property,
+                .target = type,
+                .format = 8,
+                .data = (char *)content->data,
+                .data_size = content->size,
+                .offset = 0,
+            },
+        .chunk_size = chunk_size,
+        .start_ns = monotonic_ns(),
     };
 
-    it_dbg(it, "Starting transfer\n");
-    it_add(&it_list, it);
+    it_add(&transfers, &st->it);
+    it_dbg(&st->it, "Starting transfer (%zu active)\n", transfers.nr);
 
     // Listen for PropertyNotify events on the requestor window
-    XSelectInput(dpy, it->requestor, PropertyChangeMask);
+    XSelectInput(dpy, requestor, PropertyChangeMask);
 }
 
 /**
  * Finish an INCR transfer.
  */
-static void incr_send_finish(struct incr_transfer *it) {
+static void incr_send_finish(struct serve_transfer *st) {
+    struct incr_transfer *it = &st->it;
     XChangeProperty(dpy, it->requestor, it->property, it->target, it->format,
                     PropModeReplace, NULL, 0);
-    it_dbg(it, "Transfer complete\n");
-    it_remove(&it_list, it);
-    free(it);
+
+    uint64_t elapsed_us = (monotonic_ns() - st->start_ns) / 1000;
+    it_dbg(it,
+           "Transfer complete: %zu bytes in %zu chunks, %" PRIu64
+           " us (%" PRIu64 " KiB/s)\n",
+           it->data_size, st->nr_chunks, elapsed_us,
+           elapsed_us ? (uint64_t)it->data_size * 1000000 / 1024 / elapsed_us
+                      : 0);
+    it_remove(&transfers, it);
+    free(st);
+}
+
+/**
+ * Adapt the chunk size to how quickly the requestor consumed the last chunk.
+ */
+static void incr_adapt_chunk_size(struct serve_transfer *st, uint64_t now) {
+    if (!st->last_send_ns) {
+        return;
+    }
+    uint64_t ack_ns = now - st->last_send_ns;
+    if (ack_ns < INCR_FAST_ACK_NS && st->chunk_size < max_chunk_size) {
+        st->chunk_size = st->chunk_size * 2 < max_chunk_size
+                             ? st->chunk_size * 2
+                             : max_chunk_size;
+    } else if (ack_ns > INCR_SLOW_ACK_NS && st->chunk_size > chunk_size) {
+        st->chunk_size = st->chunk_size / 2 > chunk_size ? st->chunk_size / 2
+                                                         : chunk_size;
+    }
+}
+
+/**
+ * Send the next chunk of a transfer, or finish it if all data has been sent.
+ */
+static void incr_send_chunk(struct serve_transfer *st) {
+    struct incr_transfer *it = &st->it;
+    uint64_t now = monotonic_ns();
+    size_t remaining = it->data_size - it->offset;
+
+    incr_adapt_chunk_size(st, now);
+    size_t this_chunk_size =
+        (remaining > st->chunk_size) ? st->chunk_size : remaining;
+
+    it_dbg(it,
+           "Sending chunk (bytes sent: %zu, bytes remaining: %zu, chunk size: "
+           "%zu)\n",
+           it->offset, remaining, this_chunk_size);
+
+    if (this_chunk_size > 0) {
+        XChangeProperty(dpy, it->requestor, it->property, it->target,
+                        it->format, PropModeReplace,
+                        (unsigned char *)(it->data + it->offset),
+                        (int)this_chunk_size);
+        it->offset += this_chunk_size;
+        st->nr_chunks++;
+        st->last_send_ns = now;
+    } else {
+        incr_send_finish(st);
+    }
 }
 
 /**
- * Continue sending data during an INCR transfer.
+ * Queue the next chunk of an INCR transfer once the requestor has deleted the
+ * property to ask for it.
  */
-static void incr_send_chunk(const XPropertyEvent *pe) {
+static void incr_mark_ready(const XPropertyEvent *pe) {
     if (pe->state != PropertyDelete) {
         return;
     }
 
-    struct incr_transfer *it = it_list;
-    while (it) {
-        if (it->requestor == pe->window && it->property == pe->atom) {
-            size_t remaining = it->data_size - it->offset;
-            size_t this_chunk_size =
-                (remaining > chunk_size) ? chunk_size : remaining;
-
-            it_dbg(it,
-                   "Sending chunk (bytes sent: %zu, bytes remaining: %zu)\n",
-                   it->offset, remaining);
-
-            if (this_chunk_size > 0) {
-                XChangeProperty(dpy, it->requestor, it->property, it->target,
-                                it->format, PropModeReplace,
-                                (unsigned char *)(it->data + it->offset),
-                                this_chunk_size);
-                it->offset += this_chunk_size;
-            } else {
-                incr_send_finish(it);
+    struct incr_transfer *it = it_find(&transfers, pe->window, pe->atom);
+    if (!it) {
+        return;
+    }
+
+    struct serve_transfer *st = serve_transfer_of(it);
+    if (st->ready) {
+        return;
+    }
+    st->ready = true;
+    st->ready_next = NULL;
+    if (ready_tail) {
+        ready_tail->ready_next = st;
+    } else {
+        ready_head = st;
+    }
+    ready_tail = st;
+}
+
+/**
+ * Send one chunk to every transfer which is currently ready. Transfers which
+ * become ready while we do this wait for the next pass.
+ */
+static void incr_service_ready(void) {
+    struct serve_transfer *st = ready_head;
+    ready_head = ready_tail = NULL;
+
+    while (st) {
+        struct serve_transfer *next = st->ready_next;
+        st->ready = false;
+        st->ready_next = NULL;
+        incr_send_chunk(st); // May free st
+        st = next;
+    }
+    XFlush(dpy);
+}
+
+/**
+ * Convert the clip to a single target on the requestor's property. All text
+ * targets are served from the same mapping of the content. Returns false if
+ * we can't convert to that target.
+ */
+static bool convert_target(Window requestor, Atom target, Atom property,
+                           struct cs_content *content) {
+    if (target == targets) {
+        Atom available_targets[] = {targets,    multiple,        timestamp,
+                                    utf8_string, text_plain_utf8, text_atom,
+                                    XA_STRING};
+        XChangeProperty(dpy, requestor, property, XA_ATOM, 32,
+                        PropModeReplace, (unsigned char *)&available_targets,
+                        arrlen(available_targets));
+    } else if (target == timestamp) {
+        long time = (long)owned_time;
+        XChangeProperty(dpy, requestor, property, XA_INTEGER, 32,
+                        PropModeReplace, (unsigned char *)&time, 1);
+    } else if (target == utf8_string || target == XA_STRING ||
+               target == text_atom || target == text_plain_utf8) {
+        // TEXT lets the owner pick the encoding, and ours is always UTF-8
+        Atom type = (target == text_atom) ? utf8_string : target;
+        if (content->size < (off_t)chunk_size) {
+            // Data size is small enough, send directly
+            XChangeProperty(dpy, requestor, property, type, 8,
+                            PropModeReplace, (unsigned char *)content->data,
+                            (int)content->size);
+        } else {
+            // Initiate INCR transfer
+            incr_send_start(requestor, property, type, content);
+        }
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Convert each (target, property) pair listed in the requestor's property, as
+ * described in ICCCM 2.6.2. Pairs we can't convert have their property
+ * replaced with None.
+ */
+static bool convert_multiple(Window requestor, Atom property,
+                             struct cs_content *content) {
+    Atom type;
+    int format;
+    unsigned long nr_items, bytes_after;
+    _drop_(XFree) unsigned char *prop = NULL;
+
+    if (X_ROUND_TRIP(XGetWindowProperty(
+            dpy, requestor, property, 0, LONG_MAX, False, AnyPropertyType,
+            &type, &format, &nr_items, &bytes_after, &prop)) != Success ||
+        !prop || format != 32 || nr_items % 2 != 0) {
+        return false;
+    }
+
+    // Format 32 properties are returned as arrays of long, which is also
+    // what Atom is
+    Atom *pairs = (Atom *)prop;
+    bool any_failed = false;
+    for (size_t i = 0; i < nr_items; i += 2) {
+        if (pairs[i] == multiple || pairs[i + 1] == None ||
+            !convert_target(requestor, pairs[i], pairs[i + 1], content)) {
+            pairs[i + 1] = None;
+            any_failed = true;
+        }
+    }
+    if (any_failed) {
+        XChangeProperty(dpy, requestor, property, type, 32, PropModeReplace,
+                        prop, (int)nr_items);
+    }
+    return true;
+}
+
+/**
+ * Ask for the current server time, by making a zero-length append to a
+ * property on our own window. The answer arrives as a PropertyNotify, see
+ * await_server_time(). Other requests can be made in between, so that their
+ * replies share the round trip.
+ */
+static void request_server_time(Window win) {
+    XSelectInput(dpy, win, PropertyChangeMask);
+    XChangeProperty(dpy, win, XA_WM_NAME, XA_STRING, 8, PropModeAppend, NULL,
+                    0);
+}
+
+static Time await_server_time(Window win) {
+    XEvent evt;
+    X_ROUND_TRIP(XWindowEvent(dpy, win, PropertyChangeMask, &evt));
+    return evt.xproperty.time;
+}
+
+/**
+ * Take ownership of all of the given selections, or die. According to ICCCM
+ * 2.1, a client acquiring a selection should confirm success by verifying with
+ * GetSelectionOwner. The checks for all selections are pipelined through XCB,
+ * so each attempt costs one round trip however many selections we own.
+ */
+static void own_selections(Window win, const Atom *selections, size_t nr) {
+    xcb_connection_t *conn = XGetXCBConnection(dpy);
+    xcb_get_selection_owner_cookie_t cookies[nr];
+    bool owned[nr];
+
+    memset(owned, 0, sizeof(owned));
+    for (int attempts = 0; attempts < 5; attempts++) {
+        for (size_t i = 0; i < nr; i++) {
+            if (!owned[i]) {
+                XSetSelectionOwner(dpy, selections[i], win, owned_time);
+                cookies[i] = xcb_get_selection_owner(
+                    conn, (xcb_atom_t)selections[i]);
+            }
+        }
+
+        bool all_owned = true;
+        nr_x_round_trips++;
+        for (size_t i = 0; i < nr; i++) {
+            if (owned[i]) {
+                continue;
             }
-            break;
+            xcb_get_selection_owner_reply_t *reply =
+                xcb_get_selection_owner_reply(conn, cookies[i], NULL);
+            owned[i] = reply && reply->owner == (xcb_window_t)win;
+            all_owned &= owned[i];
+            free(reply);
+        }
+        if (all_owned) {
+            return;
+        }
+    }
+
+    for (size_t i = 0; i < nr; i++) {
+        if (!owned[i]) {
+            _drop_(XFree) char *name = XGetAtomName(dpy, selections[i]);
+            die("Failed to set selection for %s\n", name);
         }
-        it = it->next;
     }
 }
 
@@ -99,79 +381,79 @@ static void _nonnull_ serve_clipboard(uint64_t hash,
                                       struct cs_content *content) {
     bool running = true;
     XEvent evt;
-    Atom targets, utf8_string, selections[2] = {XA_PRIMARY};
+    Atom selections[2] = {XA_PRIMARY};
     Window win;
     int remaining_selections;
+    int batched_events = 0;
 
     dpy = XOpenDisplay(NULL);
     expect(dpy);
 
     chunk_size = get_chunk_size(dpy);
+    max_chunk_size = get_max_chunk_size(dpy);
 
     win = XCreateSimpleWindow(dpy, DefaultRootWindow(dpy), 0, 0, 1, 1, 0, 0, 0);
     XStoreName(dpy, win, "clipserve");
-    targets = XInternAtom(dpy, "TARGETS", False);
-    utf8_string = XInternAtom(dpy, "UTF8_STRING", False);
-    incr_atom = XInternAtom(dpy, "INCR", False);
-
-    selections[1] = XInternAtom(dpy, "CLIPBOARD", False);
-    for (size_t i = 0; i < arrlen(selections); i++) {
-        bool success = false;
-        for (int attempts = 0; attempts < 5; attempts++) {
-            XSetSelectionOwner(dpy, selections[i], win, CurrentTime);
-
-            // According to ICCCM 2.1, a client acquiring a selection should
-            // confirm success by verifying with GetSelectionOwner.
-            if (XGetSelectionOwner(dpy, selections[i]) == win) {
-                success = true;
-                break;
-            }
-        }
-        if (!success) {
-            die("Failed to set selection for %s\n",
-                XGetAtomName(dpy, selections[i]));
-        }
-    }
+
+    // ICCCM 2.1 forbids CurrentTime when taking ownership, and we need the
+    // real time to answer TIMESTAMP anyway. The PropertyNotify carrying it
+    // comes back in the same round trip as the atoms.
+    request_server_time(win);
+    targets = get_atom(dpy, X_ATOM_TARGETS);
+    utf8_string = get_atom(dpy, X_ATOM_UTF8_STRING);
+    incr_atom = get_atom(dpy, X_ATOM_INCR);
+    text_atom = get_atom(dpy, X_ATOM_TEXT);
+    text_plain_utf8 = get_atom(dpy, X_ATOM_TEXT_PLAIN_UTF8);
+    multiple = get_atom(dpy, X_ATOM_MULTIPLE);
+    timestamp = get_atom(dpy, X_ATOM_TIMESTAMP);
+
+    owned_time = await_server_time(win);
+
+    selections[1] = get_atom(dpy, X_ATOM_CLIPBOARD);
+    own_selections(win, selections, arrlen(selections));
     remaining_selections = arrlen(selections);
 
     while (running) {
+        if (ready_head &&
+            (batched_events >= INCR_EVENT_BATCH || !XPending(dpy))) {
+            incr_service_ready();
+            batched_events = 0;
+            continue;
+        }
+
         XNextEvent(dpy, &evt);
+        batched_events++;
         switch (evt.type) {
             case SelectionRequest: {
                 XSelectionRequestEvent *req = &evt.xselectionrequest;
+                // Obsolete clients may leave the property as None, in which
+                // case ICCCM 2.2 says to use the target atom instead
+                Atom property =
+                    req->property == None ? req->target : req->property;
                 XSelectionEvent sev = {.type = SelectionNotify,
                                        .display = req->display,
                                        .requestor = req->requestor,
                                        .selection = req->selection,
                                        .time = req->time,
                                        .target = req->target,
-                                       .property = req->property};
+                                       .property = property};
 
-                _drop_(XFree) char *window_title =
-                    get_window_title(dpy, req->requestor);
+                // Fetching the title costs round trips, only do it if
+                // we're going to print it.
+                _drop_(free) char *window_title =
+                    debug_mode_enabled() ? get_window_title(dpy, req->requestor)
+                                         : NULL;
                 dbg("Servicing request to window '%s' (0x%lX) for clip " PRI_HASH
-                    "\n",
-                    strnull(window_title), (unsigned long)req->requestor, hash);
-
-                if (req->target == targets) {
-                    Atom available_targets[] = {utf8_string, XA_STRING};
-                    XChangeProperty(dpy, req->requestor, req->property, XA_ATOM,
-                                    32, PropModeReplace,
-                                    (unsigned char *)&available_targets,
-                                    arrlen(available_targets));
-                } else if (req->target == utf8_string ||
-                           req->target == XA_STRING) {
-                    if (content->size < (off_t)chunk_size) {
-                        // Data size is small enough, send directly
-                        XChangeProperty(dpy, req->requestor, req->property,
-                                        req->target, 8, PropModeReplace,
-                                        (unsigned char *)content->data,
-                                        (int)content->size);
-                    } else {
-                        // Initiate INCR transfer
-                        incr_send_start(req, content);
-                    }
-                } else {
+                    " (%" PRIu64 " X round trips so far)\n",
+                    strnull(window_title), (unsigned long)req->requestor, hash,
+                    nr_x_round_trips);
+
+                bool converted =
+                    req->target == multiple
+                        ? convert_multiple(req->requestor, property, content)
+                        : convert_target(req->requestor, req->target,
+                                         property, content);
+                if (!converted) {
                     sev.property = None;
                 }
 
@@ -190,7 +472,7 @@ static void _nonnull_ serve_clipboard(uint64_t hash,
                 break;
             }
             case PropertyNotify: {
-                incr_send_chunk(&evt.xproperty);
+                incr_mark_ready(&evt.xproperty);
                 break;
             }
         }
@@ -209,11 +491,11 @@ int main(int argc, char *argv[]) {
 
     _drop_(close) int content_dir_fd = open(get_cache_dir(&cfg), O_RDONLY);
     _drop_(close) int snip_fd =
-        open(get_line_cache_path(&cfg), O_RDWR | O_CREAT, 0600);
+        open(get_line_cache_path(&cfg), O_RDONLY | O_CREAT, 0600);
     expect(content_dir_fd >= 0 && snip_fd >= 0);
 
     _drop_(cs_destroy) struct clip_store cs;
-    expect(cs_init(&cs, snip_fd, content_dir_fd) == 0);
+    expect(cs_init_readonly(&cs, snip_fd, content_dir_fd) == 0);
 
     _drop_(cs_content_unmap) struct cs_content content;
     die_on(cs_content_get(&cs, hash, &content) < 0,
@@ -106,6 +106,16 @@ static int convert_cm_dir(const char *str, void *output) {
     return 0;
 }
 
+static int convert_persist_dir(const char *str, void *output) {
+    char *dir = NULL;
+    if (str && *str) {
+        dir = strdup(str);
+        expect(dir);
+    }
+    *(char **)output = dir;
+    return 0;
+}
+
 static int _nonnull_ convert_launcher(const char *str, void *output) {
     struct launcher *lnch = output;
 
@@ -114,6 +124,8 @@ static int _nonnull_ convert_launcher(const char *str, void *output) {
 
     if (streq(str, "rofi")) {
         lnch->ltype = LAUNCHER_ROFI;
+    } else if (streq(str, "builtin")) {
+        lnch->ltype = LAUNCHER_BUILTIN;
     } else {
         lnch->ltype = LAUNCHER_CUSTOM;
     }
@@ -284,6 +296,12 @@ int config_setup_internal(FILE *file, struct config *cfg) {
          0},
         {"launcher_pass_dmenu_args", "CM_LAUNCHER_PASS_DMENU_ARGS",
          &cfg->launcher_pass_dmenu_args, convert_bool, "1", 0},
+        {"menu_page_size", "CM_MENU_PAGE_SIZE", &cfg->menu_page_size,
+         convert_positive_int, "0", 0},
+        {"persist_dir", "CM_PERSIST_DIR", &cfg->persist_dir,
+         convert_persist_dir, NULL, 0},
+        {"persist_interval", "CM_PERSIST_INTERVAL", &cfg->persist_interval,
+         convert_positive_int, "1000", 0},
         {"cm_dir", "CM_DIR", &cfg->runtime_dir, convert_cm_dir, NULL, 0}};
 
     size_t entries_len = arrlen(entries);
@@ -311,6 +329,7 @@ int config_setup_internal(FILE *file, struct config *cfg) {
  */
 void config_free(struct config *cfg) {
     free(cfg->runtime_dir);
+    free(cfg->persist_dir);
     free(cfg->launcher.custom);
     free(cfg->selections);
     free(cfg->owned_selections);
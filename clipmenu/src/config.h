@@ -31,6 +31,7 @@ struct ignore_window {
 };
 enum launcher_known {
     LAUNCHER_ROFI,
+    LAUNCHER_BUILTIN,
     LAUNCHER_CUSTOM,
 };
 struct launcher {
@@ -51,6 +52,9 @@ struct config {
     struct ignore_window ignore_window;
     struct launcher launcher;
     bool launcher_pass_dmenu_args;
+    int menu_page_size;
+    char *persist_dir;
+    int persist_interval;
 };
 typedef int (*conversion_func_t)(const char *, void *);
 struct config_entry {
@@ -85,6 +89,8 @@ void exec_man_on_help(int argc, char *argv[]);
 DEFINE_GET_PATH_FUNCTION(line_cache)
 DEFINE_GET_PATH_FUNCTION(enabled)
 DEFINE_GET_PATH_FUNCTION(session_lock)
+DEFINE_GET_PATH_FUNCTION(latency)
+DEFINE_GET_PATH_FUNCTION(menu)
 
 extern const char *prog_name;
 struct config _nonnull_ setup(const char *inner_prog_name);
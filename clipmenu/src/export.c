@@ -0,0 +1,295 @@
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "export.h"
+
+/**
+ * An export stream is a struct export_header, then a struct export_record for
+ * each snip followed by its snip line and content, and finally an end record.
+ * See export.h for the details.
+ *
+ * Only the snip metadata goes through userspace. The content, which is nearly
+ * all of the data, is moved from the content files to the output and from the
+ * input to the new content files with copy_fd(), so the kernel can use
+ * copy_file_range() or splice() depending on what is at either end.
+ *
+ * The snip lines are copied out under the clip store lock up front, so we
+ * never hold it while waiting on the output. Content removed from the clip
+ * store before we get to it is left out of the export.
+ */
+
+static_assert(sizeof(struct export_header) == 16, "export_header not packed");
+static_assert(sizeof(struct export_record) == 32, "export_record not packed");
+
+#define EXPORT_RECORD_SIZE_MAX 4096
+
+/**
+ * A snip copied out of the clip store, with its line in the arena.
+ */
+struct export_entry {
+    uint64_t hash;
+    uint64_t nr_lines;
+    size_t line_offset;
+    uint32_t line_size;
+};
+
+static int _must_use_ _nonnull_ write_all(int fd, const void *buf,
+                                          size_t count) {
+    const char *cur = buf;
+    while (count > 0) {
+        ssize_t written = write(fd, cur, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return negative_errno();
+        }
+        cur += written;
+        count -= (size_t)written;
+    }
+    return 0;
+}
+
+/**
+ * Read exactly count bytes. Returns -ENODATA if the input ends early.
+ */
+static int _must_use_ _nonnull_ read_all(int fd, void *buf, size_t count) {
+    char *cur = buf;
+    while (count > 0) {
+        ssize_t ret = read(fd, cur, count);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return negative_errno();
+        }
+        if (ret == 0) {
+            return -ENODATA;
+        }
+        cur += ret;
+        count -= (size_t)ret;
+    }
+    return 0;
+}
+
+static int _must_use_ _nonnull_ write_record(int fd,
+                                             const struct export_record *rec,
+                                             const char *line) {
+    char buf[sizeof(*rec) + CS_SNIP_LINE_SIZE];
+    struct export_record le = {
+        .hash = htole64(rec->hash),
+        .nr_lines = htole64(rec->nr_lines),
+        .content_size = htole64(rec->content_size),
+        .line_size = htole32(rec->line_size),
+        .flags = htole32(rec->flags),
+    };
+    memcpy(buf, &le, sizeof(le));
+    memcpy(buf + sizeof(le), line, rec->line_size);
+    return write_all(fd, buf, sizeof(le) + rec->line_size);
+}
+
+/**
+ * Copy the snips out of the clip store, oldest first.
+ */
+static int _must_use_ _nonnull_ snapshot_snips(struct clip_store *cs,
+                                               struct export_entry **out,
+                                               size_t *out_nr, char **arena) {
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(cs);
+    if (guard.status < 0) {
+        return guard.status;
+    }
+
+    size_t nr = cs->header->nr_snips;
+    size_t arena_size = 0;
+    struct cs_snip *snip = NULL;
+    while (cs_snip_iter(&guard, CS_ITER_OLDEST_FIRST, &snip)) {
+        arena_size += strnlen(snip->line, CS_SNIP_LINE_SIZE);
+    }
+
+    *out = malloc(nr * sizeof(**out) + 1);
+    *arena = malloc(arena_size + 1);
+    if (!*out || !*arena) {
+        return -ENOMEM;
+    }
+
+    size_t offset = 0, i = 0;
+    snip = NULL;
+    while (cs_snip_iter(&guard, CS_ITER_OLDEST_FIRST, &snip)) {
+        size_t len = strnlen(snip->line, CS_SNIP_LINE_SIZE);
+        memcpy(*arena + offset, snip->line, len);
+        (*out)[i++] = (struct export_entry){
+            .hash = snip->hash,
+            .nr_lines = snip->nr_lines,
+            .line_offset = offset,
+            .line_size = (uint32_t)len,
+        };
+        offset += len;
+    }
+    *out_nr = nr;
+    return 0;
+}
+
+/**
+ * Write one snip and its content. Returns -ENOENT if the content has been
+ * removed from the clip store since the snapshot, in which case nothing was
+ * written.
+ */
+static int _must_use_ _nonnull_ export_entry(struct clip_store *cs,
+                                             const struct export_entry *e,
+                                             const char *arena, int out_fd) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), PRI_HASH "/1", e->hash);
+    _drop_(close) int in_fd =
+        openat(cs->content_dir_fd, path, O_RDONLY | O_CLOEXEC);
+    if (in_fd < 0) {
+        return negative_errno();
+    }
+
+    struct stat st;
+    if (fstat(in_fd, &st) < 0) {
+        return negative_errno();
+    }
+
+    struct export_record rec = {
+        .hash = e->hash,
+        .nr_lines = e->nr_lines,
+        .content_size = (uint64_t)st.st_size,
+        .line_size = e->line_size,
+    };
+    int ret = write_record(out_fd, &rec, arena + e->line_offset);
+    return ret ? ret : copy_fd(in_fd, out_fd, (size_t)st.st_size);
+}
+
+/**
+ * Write the whole clip store to out_fd as an export stream.
+ *
+ * @cs: The clip store to export
+ * @out_fd: The fd to write the stream to
+ * @out_nr: Output for the number of snips written, or NULL
+ */
+int export_write(struct clip_store *cs, int out_fd, size_t *out_nr) {
+    _drop_(free) struct export_entry *entries = NULL;
+    _drop_(free) char *arena = NULL;
+    size_t nr_entries = 0;
+    int ret = snapshot_snips(cs, &entries, &nr_entries, &arena);
+    if (ret < 0) {
+        return ret;
+    }
+
+    struct export_header hdr = {
+        .magic = htole64(EXPORT_MAGIC),
+        .version = htole32(EXPORT_VERSION),
+        .record_size = htole32(sizeof(struct export_record)),
+    };
+    ret = write_all(out_fd, &hdr, sizeof(hdr));
+    if (ret < 0) {
+        return ret;
+    }
+
+    size_t nr_written = 0;
+    for (size_t i = 0; i < nr_entries; i++) {
+        ret = export_entry(cs, &entries[i], arena, out_fd);
+        if (ret == -ENOENT) {
+            continue;
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        nr_written++;
+    }
+
+    struct export_record end = {
+        .hash = nr_written,
+        .flags = EXPORT_RECORD_END,
+    };
+    ret = write_record(out_fd, &end, "");
+    if (ret == 0 && out_nr) {
+        *out_nr = nr_written;
+    }
+    return ret;
+}
+
+/**
+ * Read an export stream from in_fd and add each snip in it to the clip store,
+ * in the order they were exported. The snips are added to the clip store as it
+ * is, so importing into a non-empty clip store makes the imported clips the
+ * newest.
+ *
+ * Returns -EINVAL if the stream is not an export stream or is corrupt, and
+ * -ENODATA if it was truncated. Any snips before the problem stay imported.
+ *
+ * @cs: The clip store to import into
+ * @in_fd: The fd to read the stream from
+ * @dupe_policy: Policy to use for duplicate entries
+ * @out_nr: Output for the number of snips read, or NULL
+ */
+int export_read(struct clip_store *cs, int in_fd,
+                enum cs_dupe_policy dupe_policy, size_t *out_nr) {
+    struct export_header hdr;
+    int ret = read_all(in_fd, &hdr, sizeof(hdr));
+    if (ret < 0) {
+        return ret;
+    }
+    uint32_t record_size = le32toh(hdr.record_size);
+    if (le64toh(hdr.magic) != EXPORT_MAGIC ||
+        le32toh(hdr.version) != EXPORT_VERSION ||
+        record_size < sizeof(struct export_record) ||
+        record_size > EXPORT_RECORD_SIZE_MAX) {
+        return -EINVAL;
+    }
+
+    size_t nr_read = 0;
+    while (1) {
+        char buf[EXPORT_RECORD_SIZE_MAX];
+        ret = read_all(in_fd, buf, record_size);
+        if (ret < 0) {
+            return ret;
+        }
+
+        struct export_record rec;
+        memcpy(&rec, buf, sizeof(rec));
+        rec.hash = le64toh(rec.hash);
+        rec.nr_lines = le64toh(rec.nr_lines);
+        rec.content_size = le64toh(rec.content_size);
+        rec.line_size = le32toh(rec.line_size);
+        rec.flags = le32toh(rec.flags);
+
+        if (rec.flags & ~(uint32_t)EXPORT_RECORD_END ||
+            rec.line_size >= CS_SNIP_LINE_SIZE ||
+            rec.content_size > SIZE_MAX) {
+            return -EINVAL;
+        }
+        if (rec.flags & EXPORT_RECORD_END) {
+            if (rec.hash != nr_read) {
+                return -EINVAL;
+            }
+            break;
+        }
+
+        char line[CS_SNIP_LINE_SIZE];
+        ret = read_all(in_fd, line, rec.line_size);
+        if (ret < 0) {
+            return ret;
+        }
+        line[rec.line_size] = '\0';
+
+        ret = cs_add_fd(cs, rec.hash, line, rec.nr_lines, in_fd,
+                        (size_t)rec.content_size, dupe_policy);
+        if (ret < 0) {
+            return ret;
+        }
+        nr_read++;
+    }
+
+    if (out_nr) {
+        *out_nr = nr_read;
+    }
+    return 0;
+}
@@ -0,0 +1,61 @@
+#ifndef CM_EXPORT_H
+#define CM_EXPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "store.h"
+#include "util.h"
+
+#define EXPORT_MAGIC 0x54524F5058454D43ULL /* "CMEXPORT" */
+#define EXPORT_VERSION 1
+
+/**
+ * The header at the start of an export stream. All integers in the stream are
+ * little endian, so it can be moved between machines.
+ *
+ * @magic: EXPORT_MAGIC
+ * @version: EXPORT_VERSION
+ * @record_size: The size of each struct export_record in the stream. Newer
+ *               versions may append fields, which older readers skip
+ */
+struct export_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t record_size;
+};
+
+enum export_record_flags {
+    EXPORT_RECORD_END = 1 << 0,
+};
+
+/**
+ * The metadata for one snip in an export stream, oldest snip first. Each
+ * record is followed by line_size bytes of snip line, without the terminating
+ * NUL, and then by content_size bytes of content.
+ *
+ * The stream ends with a record with EXPORT_RECORD_END set, and no line or
+ * content. A stream without it was truncated.
+ *
+ * @hash: The hash of the content, or for the end record, the number of
+ *        records before it
+ * @nr_lines: The number of lines in the content
+ * @content_size: The size of the content in bytes
+ * @line_size: The size of the snip line in bytes
+ * @flags: A mask of enum export_record_flags
+ */
+struct export_record {
+    uint64_t hash;
+    uint64_t nr_lines;
+    uint64_t content_size;
+    uint32_t line_size;
+    uint32_t flags;
+};
+
+int _must_use_ _nonnull_n_(1) export_write(struct clip_store *cs, int out_fd,
+                                           size_t *out_nr);
+int _must_use_ _nonnull_n_(1)
+    export_read(struct clip_store *cs, int in_fd,
+                enum cs_dupe_policy dupe_policy, size_t *out_nr);
+
+#endif
@@ -0,0 +1,139 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "fuzzy.h"
+
+/**
+ * Scoring in the style of fzf's v1 algorithm. Each matched character scores
+ * SCORE_MATCH, plus a bonus if it starts a word or directly follows the
+ * previous match. Gaps between matches are penalised, so tighter matches rank
+ * higher. The bonus for the first pattern character is doubled, since where a
+ * match starts is what people tend to aim for when typing.
+ */
+#define SCORE_MATCH 16
+#define SCORE_GAP_START -3
+#define SCORE_GAP_EXTENSION -1
+#define BONUS_BOUNDARY 8
+#define BONUS_CAMEL 7
+#define BONUS_CONSECUTIVE 4
+#define BONUS_FIRST_CHAR_MULTIPLIER 2
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+static inline char fold(char c) { return (char)tolower((unsigned char)c); }
+
+/**
+ * Find the first case-insensitive occurrence of the already folded c in text.
+ * memchr() is vectorised in any libc worth using, so scanning for both cases
+ * separately is much faster than a byte by byte loop on long lines.
+ */
+static const char *find_folded(const char *text, size_t len, char c) {
+    const char *lower = memchr(text, c, len);
+    char upper_c = (char)toupper((unsigned char)c);
+    if (upper_c == c) {
+        return lower;
+    }
+    size_t upper_len = lower ? (size_t)(lower - text) : len;
+    const char *upper = memchr(text, upper_c, upper_len);
+    return upper ? upper : lower;
+}
+
+/**
+ * Find the last case-insensitive occurrence of the already folded c in text.
+ */
+static const char *rfind_folded(const char *text, size_t len, char c) {
+    const char *lower = memrchr(text, c, len);
+    char upper_c = (char)toupper((unsigned char)c);
+    if (upper_c == c) {
+        return lower;
+    }
+    size_t skip = lower ? (size_t)(lower - text) + 1 : 0;
+    const char *upper = memrchr(text + skip, upper_c, len - skip);
+    return upper ? upper : lower;
+}
+
+static int char_bonus(const char *text, size_t i) {
+    if (i == 0) {
+        return BONUS_BOUNDARY;
+    }
+    unsigned char prev = (unsigned char)text[i - 1];
+    unsigned char cur = (unsigned char)text[i];
+    if (!isalnum(prev) && isalnum(cur)) {
+        return BONUS_BOUNDARY;
+    }
+    if (islower(prev) && isupper(cur)) {
+        return BONUS_CAMEL;
+    }
+    return 0;
+}
+
+/**
+ * Score how well pattern fuzzy matches text, case insensitively. The pattern
+ * must be lowercase. Returns FUZZY_NO_MATCH if the characters of pattern do
+ * not all appear in text in order, otherwise a score where higher is better.
+ *
+ * @pattern: The lowercase pattern to match
+ * @pattern_len: The length of the pattern
+ * @text: The text to match against
+ * @text_len: The length of the text
+ */
+int fuzzy_score(const char *pattern, size_t pattern_len, const char *text,
+                size_t text_len) {
+    if (pattern_len == 0) {
+        return 0;
+    }
+
+    // Forward pass: find the earliest point at which the whole pattern has
+    // matched. This is also what rejects the vast majority of candidates.
+    const char *cur = text;
+    const char *end = text + text_len;
+    for (size_t i = 0; i < pattern_len; i++) {
+        cur = find_folded(cur, (size_t)(end - cur), pattern[i]);
+        if (!cur) {
+            return FUZZY_NO_MATCH;
+        }
+        cur++;
+    }
+    size_t match_end = (size_t)(cur - text);
+
+    // Backward pass: find the latest start for that end, which gives the
+    // shortest window containing a match
+    size_t match_start = match_end;
+    for (size_t i = pattern_len; i-- > 0;) {
+        const char *found = rfind_folded(text, match_start, pattern[i]);
+        match_start = (size_t)(found - text);
+    }
+
+    // Score the window, greedily matching from its start
+    int score = 0;
+    int chunk_bonus = 0;
+    bool in_gap = false;
+    bool prev_matched = false;
+    size_t p = 0;
+    for (size_t i = match_start; i < match_end && p < pattern_len; i++) {
+        if (fold(text[i]) == pattern[p]) {
+            int bonus = char_bonus(text, i);
+            if (prev_matched) {
+                // A run of matches keeps the bonus of where it started, so
+                // "foo" in "foobar" beats "f_o_o" with a boundary on each
+                bonus = MAX(bonus, MAX(chunk_bonus, BONUS_CONSECUTIVE));
+            } else {
+                chunk_bonus = bonus;
+            }
+            score += SCORE_MATCH +
+                     (p == 0 ? bonus * BONUS_FIRST_CHAR_MULTIPLIER : bonus);
+            in_gap = false;
+            prev_matched = true;
+            p++;
+        } else {
+            score += in_gap ? SCORE_GAP_EXTENSION : SCORE_GAP_START;
+            in_gap = true;
+            prev_matched = false;
+        }
+    }
+
+    return score;
+}
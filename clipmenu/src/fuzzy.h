@@ -0,0 +1,13 @@
+#ifndef CM_FUZZY_H
+#define CM_FUZZY_H
+
+#include <stddef.h>
+
+#include "util.h"
+
+#define FUZZY_NO_MATCH -1
+
+int _nonnull_ fuzzy_score(const char *pattern, size_t pattern_len,
+                          const char *text, size_t text_len);
+
+#endif
@@ -0,0 +1,632 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "menu.h"
+
+/**
+ * The menu blob is the launcher input for clipmenu, pre-rendered by clipmenud
+ * after each clip is stored, so that clipmenu can hand it to the launcher in
+ * one go instead of formatting every snip itself. The label to hash table
+ * lets the selection be resolved without another walk over the clip store.
+ *
+ * clipmenud keeps its copy up to date from the clip store's change events, see
+ * menu_live_update(), so storing a clip only renders that clip's line, and
+ * only that line, its hash and the header are written to the file, see
+ * menu_live_write().
+ *
+ * The blob records the generation of the clip store it was rendered from, so
+ * any other change to the store (clipdel, clipctl, ...) makes it stale, in
+ * which case menu_open() fails with -ESTALE and clipmenu renders the menu
+ * itself. The snip count and end hashes are checked too, in case the store was
+ * recreated and has reached the same generation again.
+ */
+
+/* Longest possible label prefix, ellipsis and line count suffix */
+#define MENU_LINE_MAX (CS_SNIP_LINE_SIZE + 64)
+
+/**
+ * Calculate the base 10 padding length for a number.
+ */
+static int get_padding_length(size_t num) {
+    int digits = 1;
+    while (num /= 10) {
+        digits++;
+    }
+    return digits;
+}
+
+static int _must_use_ _nonnull_ menu_buf_reserve(struct menu_buf *buf,
+                                                 size_t extra) {
+    if (buf->size + extra <= buf->capacity) {
+        return 0;
+    }
+    size_t new_capacity = buf->capacity ? buf->capacity : 4096;
+    while (new_capacity < buf->size + extra) {
+        new_capacity *= 2;
+    }
+    char *new_data = realloc(buf->data, new_capacity);
+    if (!new_data) {
+        return -ENOMEM;
+    }
+    buf->data = new_data;
+    buf->capacity = new_capacity;
+    return 0;
+}
+
+/**
+ * Render the launcher line for a snip, as "[label] line (N lines)\n". Lines
+ * which were truncated to fit in the snip are ellipsised.
+ */
+static size_t _nonnull_ menu_render_line(char *out, size_t label, int pad,
+                                         const struct cs_snip *snip) {
+    size_t line_len = strnlen(snip->line, CS_SNIP_LINE_SIZE - 1);
+    bool truncated = line_len == CS_SNIP_LINE_SIZE - 1;
+    int len;
+
+    if (truncated) {
+        line_len = CS_SNIP_LINE_SIZE - 4;
+    }
+    len = snprintf(out, MENU_LINE_MAX, "[%*zu] %.*s%s", pad, label,
+                   (int)line_len, snip->line, truncated ? "..." : "");
+    expect(len > 0 && (size_t)len < MENU_LINE_MAX);
+    if (snip->nr_lines > 1) {
+        len += snprintf(out + len, MENU_LINE_MAX - (size_t)len,
+                        " (%" PRIu64 " lines)", snip->nr_lines);
+        expect((size_t)len < MENU_LINE_MAX);
+    }
+    out[len++] = '\n';
+    return (size_t)len;
+}
+
+/**
+ * Render part of the menu into buf, replacing anything already there: count
+ * entries starting at the start'th newest clip. Labels are the same as in the
+ * full menu, so a selection from any page can be resolved. Only the snips on
+ * the page are touched, see cs_snip_range().
+ *
+ * The buffer is reused, so callers which render repeatedly should keep it
+ * around.
+ *
+ * @guard: The guard lock
+ * @start: How many of the newest clips to skip
+ * @count: The maximum number of entries to render
+ * @buf: The buffer to render into
+ */
+int menu_build_page(struct ref_guard *guard, size_t start, size_t count,
+                    struct menu_buf *buf) {
+    struct cs_snip_view view;
+    int ret = cs_snip_range(guard, CS_ITER_NEWEST_FIRST, start, count, &view);
+    if (ret < 0) {
+        return ret;
+    }
+
+    const struct clip_store *cs = guard->cs;
+    size_t nr_snips = cs->header->nr_snips;
+    size_t text_start =
+        sizeof(struct menu_header) + view.nr * sizeof(uint64_t);
+
+    buf->size = 0;
+    ret = menu_buf_reserve(buf, text_start);
+    if (ret < 0) {
+        return ret;
+    }
+    buf->size = text_start;
+
+    int pad = get_padding_length(nr_snips);
+    size_t first_label = nr_snips - start - view.nr + 1;
+
+    for (size_t i = 0; i < view.nr; i++) {
+        const struct cs_snip *snip = cs_snip_view_at(&view, i);
+        size_t label = nr_snips - start - i;
+
+        ret = menu_buf_reserve(buf, MENU_LINE_MAX);
+        if (ret < 0) {
+            return ret;
+        }
+        buf->size += menu_render_line(buf->data + buf->size, label, pad, snip);
+        // The buffer may have moved, so don't keep pointers into it
+        memcpy(buf->data + sizeof(struct menu_header) +
+                   (label - first_label) * sizeof(uint64_t),
+               &snip->hash, sizeof(uint64_t));
+    }
+
+    struct menu_header header = {
+        .magic = MENU_MAGIC,
+        .nr_snips = nr_snips,
+        .oldest_hash = nr_snips ? cs->snips[0].hash : 0,
+        .newest_hash = nr_snips ? cs->snips[nr_snips - 1].hash : 0,
+        .generation = cs->header->generation,
+        .first_label = first_label,
+        .nr_entries = view.nr,
+        .text_size = buf->size - text_start,
+        .hashes_capacity = view.nr,
+    };
+    memcpy(buf->data, &header, sizeof(header));
+
+    return 0;
+}
+
+/**
+ * Render the full menu for the current contents of the clip store into buf,
+ * replacing anything already there.
+ *
+ * @guard: The guard lock
+ * @buf: The buffer to render into
+ */
+int menu_build(struct ref_guard *guard, struct menu_buf *buf) {
+    return menu_build_page(guard, 0, SIZE_MAX, buf);
+}
+
+/**
+ * Make room for at least extra more bytes in front of the live menu's text,
+ * moving the text to the end of a bigger buffer if needed.
+ */
+static int _must_use_ _nonnull_ menu_live_reserve_text(struct menu_live *menu,
+                                                       size_t extra) {
+    size_t used = menu->header.text_size;
+    if (used + extra <= menu->text_capacity) {
+        return 0;
+    }
+    size_t new_capacity = menu->text_capacity ? menu->text_capacity : 4096;
+    while (new_capacity < used + extra) {
+        new_capacity *= 2;
+    }
+    char *new_text = malloc(new_capacity);
+    if (!new_text) {
+        return -ENOMEM;
+    }
+    if (used) {
+        memcpy(new_text + new_capacity - used,
+               menu->text + menu->text_capacity - used, used);
+    }
+    free(menu->text);
+    menu->text = new_text;
+    menu->text_capacity = new_capacity;
+    return 0;
+}
+
+/**
+ * Add a snip to the live menu as its newest entry, with the given label
+ * padding.
+ */
+static int _must_use_ _nonnull_ menu_live_push(struct menu_live *menu,
+                                               const struct cs_snip *snip,
+                                               int pad) {
+    if (menu->header.nr_entries == menu->hashes_capacity) {
+        size_t new_capacity =
+            menu->hashes_capacity ? menu->hashes_capacity * 2 : 1024;
+        uint64_t *new_hashes =
+            realloc(menu->hashes, new_capacity * sizeof(uint64_t));
+        if (!new_hashes) {
+            return -ENOMEM;
+        }
+        menu->hashes = new_hashes;
+        menu->hashes_capacity = new_capacity;
+    }
+
+    int ret = menu_live_reserve_text(menu, MENU_LINE_MAX);
+    if (ret < 0) {
+        return ret;
+    }
+
+    char line[MENU_LINE_MAX];
+    size_t label = menu->header.nr_entries + 1;
+    size_t len = menu_render_line(line, label, pad, snip);
+    menu->header.text_size += len;
+    memcpy(menu->text + menu->text_capacity - menu->header.text_size, line,
+           len);
+    menu->hashes[menu->header.nr_entries++] = snip->hash;
+    return 0;
+}
+
+/**
+ * Check whether the changes since the live menu was rendered are only clips
+ * being added as the newest, without the labels getting wider, so the existing
+ * lines can be kept.
+ */
+static bool _nonnull_ menu_live_can_append(const struct menu_live *menu,
+                                           struct ref_guard *guard,
+                                           const struct cs_event *events,
+                                           size_t nr_events) {
+    const struct clip_store *cs = guard->cs;
+    size_t old_nr = menu->header.nr_snips;
+    size_t new_nr = cs->header->nr_snips;
+
+    if (new_nr != old_nr + nr_events ||
+        get_padding_length(new_nr) != get_padding_length(old_nr)) {
+        return false;
+    }
+    for (size_t i = 0; i < nr_events; i++) {
+        if (events[i].type != CS_EVENT_ADD || events[i].index != old_nr + i ||
+            cs->snips[old_nr + i].hash != events[i].hash) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Bring clipmenud's full menu up to date with the clip store. If the only
+ * changes since it was last updated are clips added as the newest, as after
+ * cs_add(), just those lines are rendered. Anything else, like a trim, a
+ * replace, a move, or the labels needing more padding, renders the whole menu
+ * again.
+ *
+ * @guard: The guard lock
+ * @menu: The live menu, zero initialised before the first call
+ */
+int menu_live_update(struct ref_guard *guard, struct menu_live *menu) {
+    if (guard->status < 0) {
+        return guard->status;
+    }
+
+    const struct clip_store *cs = guard->cs;
+    size_t nr_snips = cs->header->nr_snips;
+    struct cs_event events[CS_EVENT_RING_SIZE];
+    size_t nr_events;
+    size_t first_new = 0;
+
+    if (menu->header.magic == MENU_MAGIC &&
+        cs_changes(guard, menu->header.generation, events, &nr_events) == 0 &&
+        menu_live_can_append(menu, guard, events, nr_events)) {
+        first_new = menu->header.nr_snips;
+    } else {
+        menu->header.nr_entries = 0;
+        menu->header.text_size = 0;
+        menu->file.magic = 0; // The lines in the file are no longer a prefix
+    }
+
+    int pad = get_padding_length(nr_snips);
+    for (size_t i = first_new; i < nr_snips; i++) {
+        int ret = menu_live_push(menu, &cs->snips[i], pad);
+        if (ret < 0) {
+            menu->header.magic = 0;
+            return ret;
+        }
+    }
+
+    menu->header = (struct menu_header){
+        .magic = MENU_MAGIC,
+        .nr_snips = nr_snips,
+        .oldest_hash = nr_snips ? cs->snips[0].hash : 0,
+        .newest_hash = nr_snips ? cs->snips[nr_snips - 1].hash : 0,
+        .generation = cs->header->generation,
+        .first_label = 1,
+        .nr_entries = menu->header.nr_entries,
+        .text_size = menu->header.text_size,
+        .hashes_capacity = menu->header.nr_entries,
+    };
+    return 0;
+}
+
+void menu_live_free(struct menu_live *menu) {
+    free(menu->hashes);
+    free(menu->text);
+    *menu = (struct menu_live){0};
+}
+
+/**
+ * Atomically replace the file at path with the concatenation of iov.
+ */
+static int _must_use_ _nonnull_ menu_write_iov(struct iovec *iov, int iovcnt,
+                                               const char *path) {
+    char tmp_path[PATH_MAX];
+    snprintf_safe(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    _drop_(close) int fd =
+        open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return negative_errno();
+    }
+
+    while (iovcnt > 0) {
+        ssize_t written = writev(fd, iov, iovcnt);
+        if (written < 0) {
+            return negative_errno();
+        }
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= (size_t)written;
+        }
+    }
+
+    if (rename(tmp_path, path) < 0) {
+        return negative_errno();
+    }
+    return 0;
+}
+
+/**
+ * Atomically replace the menu file at path with the rendered blob.
+ *
+ * @buf: The rendered blob, from menu_build()
+ * @path: The path to the menu file
+ */
+int menu_write(const struct menu_buf *buf, const char *path) {
+    struct iovec iov[] = {{buf->data, buf->size}};
+    return menu_write_iov(iov, arrlen(iov), path);
+}
+
+/**
+ * pwrite() all of buf at offset, retrying on short writes.
+ */
+static int _must_use_ _nonnull_ menu_pwrite(int fd, const void *buf,
+                                            size_t count, off_t offset) {
+    const char *pos = buf;
+    while (count > 0) {
+        ssize_t written = pwrite(fd, pos, count, offset);
+        if (written < 0) {
+            return negative_errno();
+        }
+        pos += written;
+        count -= (size_t)written;
+        offset += written;
+    }
+    return 0;
+}
+
+/**
+ * Write the live menu's entries from the file's nr_entries on into the menu
+ * file, which must have room for them, and then the header. Bytes a reader may
+ * already be using are never touched. The generation is written on its own
+ * after the rest of the header: until then it's older than the clip store's,
+ * so menu_open() rejects the file as stale rather than seeing a torn header.
+ */
+static int _must_use_ _nonnull_ menu_live_write_entries(struct menu_live *menu,
+                                                        int fd) {
+    struct menu_header header = menu->header;
+    header.hashes_capacity = menu->file.hashes_capacity;
+
+    size_t first = menu->file.nr_entries;
+    int ret = menu_pwrite(fd, menu->hashes + first,
+                          (header.nr_entries - first) * sizeof(uint64_t),
+                          (off_t)(sizeof(header) + first * sizeof(uint64_t)));
+    if (ret < 0) {
+        return ret;
+    }
+
+    size_t new_text = header.text_size - menu->file.text_size;
+    ret = menu_pwrite(fd,
+                      menu->text + menu->text_capacity - header.text_size,
+                      new_text, (off_t)(menu->file_size - header.text_size));
+    if (ret < 0) {
+        return ret;
+    }
+
+    struct menu_header unpublished = header;
+    unpublished.generation = menu->file.generation;
+    ret = menu_pwrite(fd, &unpublished, sizeof(unpublished), 0);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = menu_pwrite(fd, &header.generation, sizeof(header.generation),
+                      (off_t)offsetof(struct menu_header, generation));
+    if (ret < 0) {
+        return ret;
+    }
+
+    menu->file = header;
+    return 0;
+}
+
+/**
+ * Write clipmenud's live menu out to a new file with room for it to double,
+ * and atomically replace the menu file at path with it.
+ */
+static int _must_use_ _nonnull_ menu_live_write_full(struct menu_live *menu,
+                                                     const char *path) {
+    char tmp_path[PATH_MAX];
+    snprintf_safe(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    _drop_(close) int fd =
+        open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return negative_errno();
+    }
+
+    size_t hashes_capacity = menu->header.nr_entries * 2;
+    size_t text_capacity = menu->header.text_size * 2;
+    if (hashes_capacity < 1024) {
+        hashes_capacity = 1024;
+    }
+    if (text_capacity < 65536) {
+        text_capacity = 65536;
+    }
+    size_t size = sizeof(struct menu_header) +
+                  hashes_capacity * sizeof(uint64_t) + text_capacity;
+
+    // The unused space in the middle is left as a hole
+    if (ftruncate(fd, (off_t)size) < 0) {
+        return negative_errno();
+    }
+    menu->file = (struct menu_header){.hashes_capacity = hashes_capacity};
+    menu->file_size = size;
+    int ret = menu_live_write_entries(menu, fd);
+    if (ret < 0) {
+        menu->file.magic = 0;
+        return ret;
+    }
+
+    if (rename(tmp_path, path) < 0) {
+        menu->file.magic = 0;
+        return negative_errno();
+    }
+    return 0;
+}
+
+/**
+ * Bring the menu file at path up to date with clipmenud's live menu. If the
+ * only change since the last write is entries being added, and the file has
+ * room for them, only those entries and the header are written, in place.
+ * Otherwise the file is written out again in full and atomically replaced.
+ *
+ * @menu: The live menu, from menu_live_update()
+ * @path: The path to the menu file
+ */
+int menu_live_write(struct menu_live *menu, const char *path) {
+    const struct menu_header *file = &menu->file;
+    if (file->magic != MENU_MAGIC ||
+        menu->header.nr_entries > file->hashes_capacity ||
+        menu->header.text_size > menu->file_size - sizeof(*file) -
+                                     file->hashes_capacity * sizeof(uint64_t)) {
+        return menu_live_write_full(menu, path);
+    }
+
+    _drop_(close) int fd = open(path, O_WRONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 ||
+        (size_t)st.st_size != menu->file_size) {
+        // Gone or not ours, start again
+        return menu_live_write_full(menu, path);
+    }
+
+    int ret = menu_live_write_entries(menu, fd);
+    if (ret < 0) {
+        menu->file.magic = 0;
+    }
+    return ret;
+}
+
+static void _nonnull_ menu_view_init(struct menu_view *view,
+                                     const struct menu_header *header,
+                                     const char *blob, size_t size) {
+    view->header = *header;
+    view->hashes = (const uint64_t *)(blob + sizeof(struct menu_header));
+    view->text_offset = (off_t)(size - header->text_size);
+    view->text = blob + view->text_offset;
+}
+
+/**
+ * Get a view of a menu blob rendered in memory. The view is only valid as long
+ * as the buffer is not changed or freed.
+ */
+void menu_view_from_buf(const struct menu_buf *buf, struct menu_view *view) {
+    expect(buf->size >= sizeof(struct menu_header));
+    *view = (struct menu_view){.fd = -1};
+    menu_view_init(view, (const struct menu_header *)buf->data, buf->data,
+                   buf->size);
+}
+
+/**
+ * Map the menu file at path, and check that it is well formed and was rendered
+ * from the current contents of the clip store. Returns -ESTALE if it's out of
+ * date. On success, the caller must call menu_close() when done.
+ *
+ * @path: The path to the menu file
+ * @guard: The guard lock on the clip store the menu is for
+ * @view: The view to populate
+ */
+int menu_open(const char *path, struct ref_guard *guard,
+              struct menu_view *view) {
+    *view = (struct menu_view){.fd = -1};
+
+    if (guard->status < 0) {
+        return guard->status;
+    }
+
+    _drop_(close) int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return negative_errno();
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return negative_errno();
+    }
+    size_t size = (size_t)st.st_size;
+    if (size < sizeof(struct menu_header)) {
+        return -EINVAL;
+    }
+
+    char *blob = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (blob == MAP_FAILED) {
+        return negative_errno();
+    }
+
+    // clipmenud writes the generation last, see menu_live_write_entries(), so
+    // if it matches the clip store the rest of the header is complete. The
+    // store can't change while we hold the lock, so neither can the header.
+    struct menu_header header;
+    uint64_t generation = __atomic_load_n(
+        &((const struct menu_header *)blob)->generation, __ATOMIC_ACQUIRE);
+    memcpy(&header, blob, sizeof(header));
+    header.generation = generation;
+
+    const struct clip_store *cs = guard->cs;
+    size_t nr_snips = cs->header->nr_snips;
+    size_t room = size - sizeof(header);
+    int ret = 0;
+
+    if (header.magic != MENU_MAGIC ||
+        header.hashes_capacity > room / sizeof(uint64_t) ||
+        header.nr_entries > header.hashes_capacity ||
+        header.text_size > room - header.hashes_capacity * sizeof(uint64_t)) {
+        ret = -EINVAL;
+    } else if (header.generation != cs->header->generation ||
+               header.nr_snips != nr_snips ||
+               header.oldest_hash != (nr_snips ? cs->snips[0].hash : 0) ||
+               header.newest_hash !=
+                   (nr_snips ? cs->snips[nr_snips - 1].hash : 0)) {
+        ret = -ESTALE;
+    }
+
+    if (ret < 0) {
+        munmap(blob, size);
+        return ret;
+    }
+
+    menu_view_init(view, &header, blob, size);
+    view->fd = fd;
+    view->map = blob;
+    view->map_size = size;
+    fd = -1; // Owned by the view now
+    return 0;
+}
+
+/**
+ * Release a view from menu_open().
+ */
+void menu_close(struct menu_view *view) {
+    if (view->map) {
+        munmap((void *)view->map, view->map_size);
+    }
+    if (view->fd >= 0) {
+        close(view->fd);
+    }
+    *view = (struct menu_view){.fd = -1};
+}
+
+/**
+ * _drop_() function for menu_close().
+ */
+void drop_menu_close(struct menu_view *view) { menu_close(view); }
+
+/**
+ * Get the hash for the entry with the given label.
+ *
+ * @view: The menu
+ * @label: The label the user selected, as shown in the menu
+ * @out_hash: Output for the hash
+ */
+int menu_lookup(const struct menu_view *view, uint64_t label,
+                uint64_t *out_hash) {
+    if (label < view->header.first_label ||
+        label - view->header.first_label >= view->header.nr_entries) {
+        return -ERANGE;
+    }
+    *out_hash = view->hashes[label - view->header.first_label];
+    return 0;
+}
@@ -0,0 +1,127 @@
+#ifndef CM_MENU_H
+#define CM_MENU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "store.h"
+#include "util.h"
+
+#define MENU_MAGIC 0x34554E454D4D43ULL /* "CMMENU4" */
+
+/**
+ * The header of a menu blob. It is followed by room for hashes_capacity hashes,
+ * of which the first nr_entries are used, where the hash for the entry labelled
+ * [N] is at index N - first_label. The last text_size bytes of the blob are the
+ * launcher input, newest clip first. Any space between the two is unused, so
+ * that clipmenud can add entries to its file in place, see menu_live_write().
+ *
+ * A full menu covers every snip, so first_label is 1 and nr_entries is
+ * nr_snips. A page covers only part of the clip store, see menu_build_page().
+ *
+ * @magic: MENU_MAGIC
+ * @nr_snips: The number of snips in the clip store when rendered
+ * @oldest_hash: The hash of the oldest snip when rendered, or 0 if empty
+ * @newest_hash: The hash of the newest snip when rendered, or 0 if empty
+ * @generation: The generation of the clip store when rendered
+ * @first_label: The label of the oldest entry in the menu
+ * @nr_entries: The number of entries in the menu
+ * @text_size: The size of the launcher input in bytes
+ * @hashes_capacity: The number of hashes there is room for
+ */
+struct menu_header {
+    uint64_t magic;
+    uint64_t nr_snips;
+    uint64_t oldest_hash;
+    uint64_t newest_hash;
+    uint64_t generation;
+    uint64_t first_label;
+    uint64_t nr_entries;
+    uint64_t text_size;
+    uint64_t hashes_capacity;
+};
+
+/**
+ * A growable buffer holding a rendered menu blob.
+ *
+ * @data: The blob, starting with a struct menu_header
+ * @size: The number of bytes used
+ * @capacity: The number of bytes allocated
+ */
+struct menu_buf {
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+/**
+ * The full menu as clipmenud keeps it between updates. It is laid out so that
+ * the common change, a clip being added as the newest, is cheap: the hash goes
+ * on the end of the label table, and the launcher line is prepended to the
+ * text, which is kept at the end of its buffer for that purpose. See
+ * menu_live_update().
+ *
+ * @header: The header for the current contents, with magic 0 if empty
+ * @hashes: The label to hash table
+ * @hashes_capacity: The number of hashes allocated
+ * @text: The text buffer. The launcher input is its last header.text_size
+ *        bytes.
+ * @text_capacity: The size of the text buffer
+ * @file: The header last written to the menu file, with magic 0 if the file
+ *        has to be written out in full
+ * @file_size: The size of the menu file
+ */
+struct menu_live {
+    struct menu_header header;
+    uint64_t *hashes;
+    size_t hashes_capacity;
+    char *text;
+    size_t text_capacity;
+    struct menu_header file;
+    size_t file_size;
+};
+
+/**
+ * A read-only view of a menu blob, either mapped from the file clipmenud
+ * maintains or pointing into a struct menu_buf.
+ *
+ * @header: A copy of the blob header, since clipmenud updates its file's
+ *          header in place
+ * @hashes: The label to hash table
+ * @text: The launcher input
+ * @text_offset: The offset of the launcher input within the file
+ * @fd: The open menu file, or -1 if not backed by a file
+ * @map: The mapping of the menu file, or NULL if not mapped
+ * @map_size: The size of the mapping, or 0 if not mapped
+ */
+struct menu_view {
+    struct menu_header header;
+    const uint64_t *hashes;
+    const char *text;
+    off_t text_offset;
+    int fd;
+    const void *map;
+    size_t map_size;
+};
+
+int _must_use_ _nonnull_ menu_build(struct ref_guard *guard,
+                                    struct menu_buf *buf);
+int _must_use_ _nonnull_ menu_build_page(struct ref_guard *guard, size_t start,
+                                         size_t count, struct menu_buf *buf);
+int _must_use_ _nonnull_ menu_write(const struct menu_buf *buf,
+                                    const char *path);
+int _must_use_ _nonnull_ menu_live_update(struct ref_guard *guard,
+                                          struct menu_live *menu);
+int _must_use_ _nonnull_ menu_live_write(struct menu_live *menu,
+                                         const char *path);
+void _nonnull_ menu_live_free(struct menu_live *menu);
+void _nonnull_ menu_view_from_buf(const struct menu_buf *buf,
+                                  struct menu_view *view);
+int _must_use_ _nonnull_ menu_open(const char *path, struct ref_guard *guard,
+                                   struct menu_view *view);
+void _nonnull_ menu_close(struct menu_view *view);
+void drop_menu_close(struct menu_view *view);
+int _must_use_ _nonnull_ menu_lookup(const struct menu_view *view,
+                                     uint64_t label, uint64_t *out_hash);
+
+#endif
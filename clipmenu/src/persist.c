@@ -0,0 +1,640 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "persist.h"
+
+/**
+ * The clip store lives in the runtime directory, which is usually a tmpfs that
+ * is cleared at logout. The persistent mirror keeps a copy of it somewhere
+ * durable, without ever putting an fsync on the path a new clip takes.
+ *
+ * LAYOUT
+ *
+ * - snips: A copy of the snip file as of the last group commit
+ * - content/HASH: The content for each hash referenced by snips
+ *
+ * GROUP COMMIT
+ *
+ * clipmenud calls persist_commit() from its own thread, after changes to the
+ * clip store have had some time to accumulate. A commit copies the snip file
+ * under a shared lock, which only takes as long as a memcpy(), and then copies
+ * any content not already mirrored without the lock. Everything is made durable
+ * with a single syncfs() before the new snips file is renamed into place, so
+ * the snips file on disk only ever references content which is also on disk.
+ * Finally, content no longer referenced is removed, so deleted clips don't
+ * linger on disk.
+ *
+ * Since content files are named by hash and never change, the mirror only
+ * needs to know which hashes it already has, see struct persist_set. Content
+ * files are renamed into place before the syncfs(), so after a crash one may
+ * exist under its hash name without being complete. persist_init() therefore
+ * only trusts content referenced by the snips file on disk, and removes the
+ * rest to be copied again.
+ *
+ * WARM LOAD
+ *
+ * persist_restore() rebuilds an empty clip store from the mirror by copying
+ * the snips file in one go, and the content files with copy_fd(). Nothing is
+ * rehashed or re-added clip by clip.
+ */
+
+#define PERSIST_SNIPS "snips"
+#define PERSIST_SNIPS_TMP "snips.tmp"
+#define PERSIST_CONTENT_DIR "content"
+#define PERSIST_TMP_SUFFIX ".tmp"
+
+static size_t persist_set_slot(const struct persist_set *set, uint64_t hash) {
+    // Fibonacci hashing, since djb64 hashes are poorly mixed in the low bits
+    int shift = 64 - __builtin_ctzl(set->capacity);
+    return (size_t)((hash * 0x9E3779B97F4A7C15ULL) >> shift);
+}
+
+static bool persist_set_contains(const struct persist_set *set,
+                                 uint64_t hash) {
+    if (hash == 0) {
+        return set->has_zero;
+    }
+    if (set->capacity == 0) {
+        return false;
+    }
+    size_t mask = set->capacity - 1;
+    for (size_t i = persist_set_slot(set, hash);; i = (i + 1) & mask) {
+        if (set->slots[i] == hash) {
+            return true;
+        }
+        if (set->slots[i] == 0) {
+            return false;
+        }
+    }
+}
+
+static int _must_use_ persist_set_add(struct persist_set *set, uint64_t hash);
+
+static int _must_use_ persist_set_grow(struct persist_set *set) {
+    struct persist_set grown = {
+        .capacity = set->capacity ? set->capacity * 2 : 1024,
+        .has_zero = set->has_zero,
+    };
+    grown.slots = calloc(grown.capacity, sizeof(*grown.slots));
+    if (!grown.slots) {
+        return -ENOMEM;
+    }
+    for (size_t i = 0; i < set->capacity; i++) {
+        if (set->slots[i]) {
+            expect(persist_set_add(&grown, set->slots[i]) == 0);
+        }
+    }
+    free(set->slots);
+    *set = grown;
+    return 0;
+}
+
+static int persist_set_add(struct persist_set *set, uint64_t hash) {
+    if (hash == 0) {
+        set->has_zero = true;
+        return 0;
+    }
+    // Keep the load factor under 1/2, so probes stay short
+    if ((set->nr + 1) * 2 > set->capacity) {
+        int ret = persist_set_grow(set);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    size_t mask = set->capacity - 1;
+    for (size_t i = persist_set_slot(set, hash);; i = (i + 1) & mask) {
+        if (set->slots[i] == hash) {
+            return 0;
+        }
+        if (set->slots[i] == 0) {
+            set->slots[i] = hash;
+            set->nr++;
+            return 0;
+        }
+    }
+}
+
+static void persist_set_free(struct persist_set *set) {
+    free(set->slots);
+    *set = (struct persist_set){0};
+}
+
+/**
+ * Add the hashes in a mirror content directory to set, and remove any
+ * temporary files left behind by an interrupted commit. One pass over the
+ * directory is much cheaper than checking for each hash separately.
+ *
+ * If trusted is not NULL, only hashes in it are added, and any other content
+ * files are removed: they may be from a commit that never reached its
+ * syncfs(), in which case they could be truncated or empty.
+ */
+static int _must_use_ _nonnull_n_(3)
+    persist_scan_content(int content_dir_fd, const struct persist_set *trusted,
+                         struct persist_set *set) {
+    int dir_fd = dup(content_dir_fd);
+    if (dir_fd < 0) {
+        return negative_errno();
+    }
+    _drop_(closedir) DIR *dir = fdopendir(dir_fd);
+    if (!dir) {
+        close(dir_fd);
+        return negative_errno();
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        uint64_t hash;
+        if (strlen(ent->d_name) == CS_HASH_STR_MAX - 1 &&
+            str_to_hex64(ent->d_name, &hash) == 0) {
+            if (trusted && !persist_set_contains(trusted, hash)) {
+                unlinkat(content_dir_fd, ent->d_name, 0);
+                continue;
+            }
+            int ret = persist_set_add(set, hash);
+            if (ret < 0) {
+                return ret;
+            }
+        } else if (strstr(ent->d_name, PERSIST_TMP_SUFFIX)) {
+            unlinkat(content_dir_fd, ent->d_name, 0);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Add the hashes referenced by the mirror's snips file to set. The snips file
+ * is only renamed into place after everything it references was flushed, so
+ * this is exactly the content which is known to be durable. If there is no
+ * snips file yet, nothing is.
+ */
+static int _must_use_ _nonnull_ persist_read_durable(int dir_fd,
+                                                     struct persist_set *set) {
+    _drop_(close) int fd = openat(dir_fd, PERSIST_SNIPS, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno == ENOENT ? 0 : negative_errno();
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return negative_errno();
+    }
+    size_t size = (size_t)st.st_size;
+    if (size < CS_SNIP_SIZE || size % CS_SNIP_SIZE != 0) {
+        return 0;
+    }
+
+    void *snap = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (snap == MAP_FAILED) {
+        return negative_errno();
+    }
+    const struct cs_header *header = snap;
+    const struct cs_snip *snips = (const struct cs_snip *)(header + 1);
+    size_t nr = size / CS_SNIP_SIZE - 1;
+    if (header->nr_snips < nr) {
+        nr = header->nr_snips;
+    }
+    int ret = 0;
+    for (size_t i = 0; ret == 0 && i < nr; i++) {
+        ret = persist_set_add(set, snips[i].hash);
+    }
+    munmap(snap, size);
+    return ret;
+}
+
+/**
+ * Open or create the persistent mirror at dir, for the clip store at snip_fd
+ * and content_dir_fd. The mirror keeps its own read-only handle on the clip
+ * store, so snip_fd must be a separate open of the snip file from the one the
+ * writer uses, or the locks would be shared.
+ *
+ * @p: The mirror to initialise
+ * @dir: The directory to keep the mirror in, created if needed
+ * @snip_fd: Open file descriptor for the snip file
+ * @content_dir_fd: Open file descriptor for the content directory
+ */
+int persist_init(struct persist *p, const char *dir, int snip_fd,
+                 int content_dir_fd) {
+    *p = (struct persist){
+        .dir_fd = -1,
+        .content_dir_fd = -1,
+        // Nothing has been committed yet, so the first commit always runs
+        .generation = UINT64_MAX,
+    };
+
+    if (mkdir(dir, S_IRWXU) < 0 && errno != EEXIST) {
+        return negative_errno();
+    }
+    p->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (p->dir_fd < 0) {
+        return negative_errno();
+    }
+    if (mkdirat(p->dir_fd, PERSIST_CONTENT_DIR, S_IRWXU) < 0 &&
+        errno != EEXIST) {
+        int ret = negative_errno();
+        persist_destroy(p);
+        return ret;
+    }
+    p->content_dir_fd = openat(p->dir_fd, PERSIST_CONTENT_DIR,
+                               O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (p->content_dir_fd < 0) {
+        int ret = negative_errno();
+        persist_destroy(p);
+        return ret;
+    }
+
+    // Content which isn't referenced by the durable snips file is copied
+    // again, rather than trusting whatever a crash left behind
+    struct persist_set durable = {0};
+    int ret = persist_read_durable(p->dir_fd, &durable);
+    if (ret == 0) {
+        ret = persist_scan_content(p->content_dir_fd, &durable,
+                                   &p->persisted);
+    }
+    persist_set_free(&durable);
+    if (ret == 0) {
+        ret = cs_init_readonly(&p->cs, snip_fd, content_dir_fd);
+    }
+    if (ret < 0) {
+        persist_destroy(p);
+        return ret;
+    }
+
+    return 0;
+}
+
+/**
+ * Copy the content for hash from the clip store into the mirror. The copy is
+ * written under a temporary name first, so that the mirror never has a
+ * partial file under a hash name.
+ */
+static int _must_use_ _nonnull_ persist_copy_content(struct persist *p,
+                                                     uint64_t hash) {
+    char src_path[PATH_MAX], name[CS_HASH_STR_MAX],
+        tmp_name[CS_HASH_STR_MAX + sizeof(PERSIST_TMP_SUFFIX)];
+    snprintf_safe(src_path, sizeof(src_path), PRI_HASH "/1", hash);
+    snprintf_safe(name, sizeof(name), PRI_HASH, hash);
+    snprintf_safe(tmp_name, sizeof(tmp_name), "%s" PERSIST_TMP_SUFFIX, name);
+
+    _drop_(close) int in_fd =
+        openat(p->cs.content_dir_fd, src_path, O_RDONLY | O_CLOEXEC);
+    if (in_fd < 0) {
+        return negative_errno();
+    }
+    struct stat st;
+    if (fstat(in_fd, &st) < 0) {
+        return negative_errno();
+    }
+
+    _drop_(close) int out_fd =
+        openat(p->content_dir_fd, tmp_name,
+               O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (out_fd < 0) {
+        return negative_errno();
+    }
+    int ret = copy_fd(in_fd, out_fd, (size_t)st.st_size);
+    if (ret < 0) {
+        unlinkat(p->content_dir_fd, tmp_name, 0);
+        return ret;
+    }
+
+    if (renameat(p->content_dir_fd, tmp_name, p->content_dir_fd, name) < 0) {
+        return negative_errno();
+    }
+    return 0;
+}
+
+/**
+ * Copy the snip file while holding the clip store lock. This is only a
+ * memcpy(), so writers are held up as little as possible. Returns the size of
+ * the copy in out_size, or 0 if nothing changed since the last commit.
+ */
+static int _must_use_ _nonnull_ persist_copy_snips(struct persist *p,
+                                                   size_t *out_size,
+                                                   uint64_t *out_generation) {
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(&p->cs);
+    if (guard.status < 0) {
+        return guard.status;
+    }
+
+    *out_size = 0;
+    *out_generation = p->cs.header->generation;
+    if (*out_generation == p->generation) {
+        return 0;
+    }
+
+    size_t size = (p->cs.header->nr_snips + 1) * CS_SNIP_SIZE;
+    if (size > p->snapshot_capacity) {
+        char *snapshot = realloc(p->snapshot, size);
+        if (!snapshot) {
+            return -ENOMEM;
+        }
+        p->snapshot = snapshot;
+        p->snapshot_capacity = size;
+    }
+    memcpy(p->snapshot, p->cs.header, size);
+    *out_size = size;
+    return 0;
+}
+
+/**
+ * Copy the content for any snips in the snapshot which the mirror doesn't have
+ * yet. This runs without the lock, so a clip may have been removed from the
+ * clip store since the snapshot was taken. Such snips are dropped from the
+ * snapshot, and the next commit catches up with whatever else changed. size
+ * is updated to match.
+ */
+static int _must_use_ _nonnull_ persist_copy_content_all(struct persist *p,
+                                                         size_t *size) {
+    struct cs_header *header = (struct cs_header *)p->snapshot;
+    struct cs_snip *snips = (struct cs_snip *)(header + 1);
+    size_t nr_gone = 0;
+
+    for (size_t i = 0; i < header->nr_snips; i++) {
+        snips[i].doomed = false;
+        if (!persist_set_contains(&p->persisted, snips[i].hash)) {
+            int ret = persist_copy_content(p, snips[i].hash);
+            if (ret == 0) {
+                ret = persist_set_add(&p->persisted, snips[i].hash);
+            }
+            if (ret == -ENOENT) {
+                nr_gone++;
+                continue;
+            }
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        if (nr_gone > 0) {
+            snips[i - nr_gone] = snips[i];
+        }
+    }
+
+    header->nr_snips -= nr_gone;
+    *size -= nr_gone * CS_SNIP_SIZE;
+    return 0;
+}
+
+/**
+ * Remove content from the mirror which is not referenced by the snapshot, and
+ * make the persisted set match the snapshot.
+ */
+static int _must_use_ _nonnull_ persist_gc(struct persist *p) {
+    const struct cs_header *header = (const struct cs_header *)p->snapshot;
+    const struct cs_snip *snips = (const struct cs_snip *)(header + 1);
+    struct persist_set current = {0};
+
+    for (size_t i = 0; i < header->nr_snips; i++) {
+        int ret = persist_set_add(&current, snips[i].hash);
+        if (ret < 0) {
+            persist_set_free(&current);
+            return ret;
+        }
+    }
+
+    for (size_t i = 0; i < p->persisted.capacity; i++) {
+        uint64_t hash = p->persisted.slots[i];
+        if (hash && !persist_set_contains(&current, hash)) {
+            char name[CS_HASH_STR_MAX];
+            snprintf_safe(name, sizeof(name), PRI_HASH, hash);
+            // If this fails, the next persist_init() will find it again
+            unlinkat(p->content_dir_fd, name, 0);
+        }
+    }
+
+    persist_set_free(&p->persisted);
+    p->persisted = current;
+    return 0;
+}
+
+/**
+ * Bring the mirror up to date with the clip store, as a single group commit.
+ * Does nothing if the clip store hasn't changed since the last commit.
+ *
+ * @p: The mirror
+ */
+int persist_commit(struct persist *p) {
+    size_t size;
+    uint64_t generation;
+    int ret = persist_copy_snips(p, &size, &generation);
+    if (ret < 0 || size == 0) {
+        return ret;
+    }
+    ret = persist_copy_content_all(p, &size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    // Notifications are only meaningful within a session, so start afresh
+    struct cs_header *header = (struct cs_header *)p->snapshot;
+    header->nr_snips_alloc = header->nr_snips;
+    header->generation = 0;
+    header->wake_seq = 0;
+    memset(header->events, 0, sizeof(header->events));
+
+    {
+        _drop_(close) int fd =
+            openat(p->dir_fd, PERSIST_SNIPS_TMP,
+                   O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            return negative_errno();
+        }
+        const char *cur = p->snapshot;
+        size_t remaining = size;
+        while (remaining > 0) {
+            ssize_t written = write(fd, cur, remaining);
+            if (written < 0) {
+                return negative_errno();
+            }
+            remaining -= (size_t)written;
+            cur += written;
+        }
+    }
+
+    // One flush for the new content and the snapshot together, instead of an
+    // fsync() per file
+    if (syncfs(p->dir_fd) < 0 ||
+        renameat(p->dir_fd, PERSIST_SNIPS_TMP, p->dir_fd, PERSIST_SNIPS) < 0 ||
+        fsync(p->dir_fd) < 0) {
+        return negative_errno();
+    }
+
+    p->generation = generation;
+    return persist_gc(p);
+}
+
+/**
+ * Release the resources held by the mirror. Does not commit.
+ */
+void persist_destroy(struct persist *p) {
+    if (p->cs.ready) {
+        expect(cs_destroy(&p->cs) == 0);
+    }
+    if (p->content_dir_fd >= 0) {
+        close(p->content_dir_fd);
+    }
+    if (p->dir_fd >= 0) {
+        close(p->dir_fd);
+    }
+    persist_set_free(&p->persisted);
+    free(p->snapshot);
+    *p = (struct persist){.dir_fd = -1, .content_dir_fd = -1};
+}
+
+/**
+ * _drop_() function for persist_destroy().
+ */
+void drop_persist_destroy(struct persist *p) { persist_destroy(p); }
+
+/**
+ * Restore the content for one snip into the clip store's content directory,
+ * laid out as cs_add() would have: HASH/1, with a further link for each
+ * duplicate.
+ */
+static int _must_use_ persist_restore_content(int mirror_content_fd,
+                                              int content_dir_fd,
+                                              uint64_t hash) {
+    char name[CS_HASH_STR_MAX], base_path[PATH_MAX];
+    snprintf_safe(name, sizeof(name), PRI_HASH, hash);
+    snprintf_safe(base_path, sizeof(base_path), "%s/1", name);
+
+    if (mkdirat(content_dir_fd, name, 0700) < 0) {
+        if (errno != EEXIST) {
+            return negative_errno();
+        }
+        struct stat st;
+        if (fstatat(content_dir_fd, base_path, &st, 0) < 0) {
+            return negative_errno();
+        }
+        char link_path[PATH_MAX];
+        snprintf_safe(link_path, sizeof(link_path), "%s/%zu", name,
+                      (size_t)st.st_nlink + 1);
+        if (linkat(content_dir_fd, base_path, content_dir_fd, link_path, 0) <
+            0) {
+            return negative_errno();
+        }
+        return 0;
+    }
+
+    _drop_(close) int in_fd =
+        openat(mirror_content_fd, name, O_RDONLY | O_CLOEXEC);
+    if (in_fd < 0) {
+        return negative_errno();
+    }
+    struct stat st;
+    if (fstat(in_fd, &st) < 0) {
+        return negative_errno();
+    }
+    _drop_(close) int out_fd =
+        openat(content_dir_fd, base_path,
+               O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (out_fd < 0) {
+        return negative_errno();
+    }
+    return copy_fd(in_fd, out_fd, (size_t)st.st_size);
+}
+
+/**
+ * Check that a snapshot is well formed and all of its content is present,
+ * before anything is written to the clip store.
+ */
+static int _must_use_ _nonnull_ persist_snapshot_validate(
+    const struct cs_header *header, size_t size, int mirror_content_fd) {
+    if (size < CS_SNIP_SIZE || size % CS_SNIP_SIZE != 0 ||
+        header->nr_snips != header->nr_snips_alloc ||
+        header->nr_snips != size / CS_SNIP_SIZE - 1) {
+        return -EINVAL;
+    }
+
+    struct persist_set present = {0};
+    int ret = persist_scan_content(mirror_content_fd, NULL, &present);
+    const struct cs_snip *snips = (const struct cs_snip *)(header + 1);
+    for (size_t i = 0; ret == 0 && i < header->nr_snips; i++) {
+        if (!persist_set_contains(&present, snips[i].hash)) {
+            ret = -ENOENT;
+        }
+    }
+    persist_set_free(&present);
+    return ret;
+}
+
+/**
+ * Warm load an empty clip store from the mirror at dir. Must be called before
+ * cs_init(). Does nothing if the clip store already has snips, or there is no
+ * snapshot yet.
+ *
+ * @dir: The mirror directory
+ * @snip_fd: Open file descriptor for the snip file, opened for writing
+ * @content_dir_fd: Open file descriptor for the content directory
+ */
+int persist_restore(const char *dir, int snip_fd, int content_dir_fd) {
+    // Keep clipmenu and friends from seeing a half restored clip store
+    expect(flock(snip_fd, LOCK_EX) == 0);
+
+    struct cs_header current;
+    ssize_t nr_read = pread(snip_fd, &current, sizeof(current), 0);
+    if (nr_read == (ssize_t)sizeof(current) && current.nr_snips > 0) {
+        expect(flock(snip_fd, LOCK_UN) == 0);
+        return 0;
+    }
+
+    _drop_(close) int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    _drop_(close) int snap_fd =
+        dir_fd < 0 ? -1 : openat(dir_fd, PERSIST_SNIPS, O_RDONLY | O_CLOEXEC);
+    _drop_(close) int mirror_content_fd =
+        dir_fd < 0 ? -1
+                   : openat(dir_fd, PERSIST_CONTENT_DIR,
+                            O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (snap_fd < 0 || mirror_content_fd < 0) {
+        int ret = errno == ENOENT ? 0 : negative_errno();
+        expect(flock(snip_fd, LOCK_UN) == 0);
+        return ret;
+    }
+
+    struct stat st;
+    int ret = fstat(snap_fd, &st) < 0 ? negative_errno() : 0;
+    size_t size = (size_t)st.st_size;
+    void *snap = MAP_FAILED;
+    if (ret == 0 && size >= CS_SNIP_SIZE) {
+        snap = mmap(NULL, size, PROT_READ, MAP_PRIVATE, snap_fd, 0);
+        ret = snap == MAP_FAILED ? negative_errno() : 0;
+    } else if (ret == 0) {
+        ret = -EINVAL;
+    }
+    if (ret == 0) {
+        ret = persist_snapshot_validate(snap, size, mirror_content_fd);
+    }
+
+    const struct cs_header *header = snap;
+    const struct cs_snip *snips = (const struct cs_snip *)(header + 1);
+    for (size_t i = 0; ret == 0 && i < header->nr_snips; i++) {
+        ret = persist_restore_content(mirror_content_fd, content_dir_fd,
+                                      snips[i].hash);
+    }
+
+    // The snip file goes last, so it never references missing content
+    if (ret == 0) {
+        if (ftruncate(snip_fd, 0) < 0 || lseek(snap_fd, 0, SEEK_SET) < 0 ||
+            lseek(snip_fd, 0, SEEK_SET) < 0) {
+            ret = negative_errno();
+        } else {
+            ret = copy_fd(snap_fd, snip_fd, size);
+        }
+    }
+
+    if (snap != MAP_FAILED) {
+        munmap(snap, size);
+    }
+    expect(flock(snip_fd, LOCK_UN) == 0);
+    return ret;
+}
@@ -0,0 +1,54 @@
+#ifndef CM_PERSIST_H
+#define CM_PERSIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "store.h"
+#include "util.h"
+
+/**
+ * A set of clip hashes, using open addressing.
+ *
+ * @slots: The hash table, where 0 marks an empty slot
+ * @capacity: The number of slots, always a power of two
+ * @nr: The number of hashes in the set, excluding has_zero
+ * @has_zero: Whether the hash 0 is in the set
+ */
+struct persist_set {
+    uint64_t *slots;
+    size_t capacity;
+    size_t nr;
+    bool has_zero;
+};
+
+/**
+ * A persistent mirror of the clip store, see persist.c.
+ *
+ * @dir_fd: The persist directory
+ * @content_dir_fd: The content directory inside the persist directory
+ * @cs: Our own read-only handle on the clip store being mirrored
+ * @persisted: The hashes whose content is already in the mirror
+ * @generation: The clip store generation of the last snapshot
+ * @snapshot: Buffer for the snip file copy, reused between commits
+ * @snapshot_capacity: The allocated size of snapshot
+ */
+struct persist {
+    int dir_fd;
+    int content_dir_fd;
+    struct clip_store cs;
+    struct persist_set persisted;
+    uint64_t generation;
+    char *snapshot;
+    size_t snapshot_capacity;
+};
+
+int _must_use_ _nonnull_ persist_init(struct persist *p, const char *dir,
+                                      int snip_fd, int content_dir_fd);
+int _must_use_ _nonnull_ persist_commit(struct persist *p);
+void _nonnull_ persist_destroy(struct persist *p);
+void drop_persist_destroy(struct persist *p);
+int _must_use_ _nonnull_ persist_restore(const char *dir, int snip_fd,
+                                         int content_dir_fd);
+
+#endif
@@ -0,0 +1,366 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "fuzzy.h"
+#include "picker.h"
+
+/**
+ * The built-in picker is a minimal terminal UI on /dev/tty which clipmenu can
+ * use instead of forking a launcher. The snip lines are copied out of the clip
+ * store up front, so we don't hold the clip store lock while the user types.
+ *
+ * Filtering is incremental: while the user only appends to the query, we only
+ * rescore the entries which matched last time. Only the best PICKER_MAX_ROWS
+ * matches are kept in order, so we never sort the full match list.
+ */
+
+#define KEY_CTRL(c) ((c) & 0x1f)
+#define KEY_ESC 0x1b
+#define KEY_DEL 0x7f
+#define ESC_TIMEOUT_MS 25
+
+/**
+ * Copy all snip lines out of the clip store, newest first.
+ *
+ * @p: The picker to load into
+ * @guard: The guard lock on the clip store
+ */
+int picker_load(struct picker *p, struct ref_guard *guard) {
+    *p = (struct picker){0};
+    if (guard->status < 0) {
+        return guard->status;
+    }
+
+    size_t nr = guard->cs->header->nr_snips;
+    size_t arena_size = 0;
+    struct cs_snip *snip = NULL;
+    while (cs_snip_iter(guard, CS_ITER_NEWEST_FIRST, &snip)) {
+        arena_size += strnlen(snip->line, CS_SNIP_LINE_SIZE);
+    }
+
+    p->entries = malloc(nr * sizeof(*p->entries) + 1);
+    p->matches = malloc(nr * sizeof(*p->matches) + 1);
+    p->arena = malloc(arena_size + 1);
+    if (!p->entries || !p->matches || !p->arena) {
+        picker_free(p);
+        return -ENOMEM;
+    }
+
+    char *cur = p->arena;
+    snip = NULL;
+    while (cs_snip_iter(guard, CS_ITER_NEWEST_FIRST, &snip)) {
+        size_t len = strnlen(snip->line, CS_SNIP_LINE_SIZE);
+        // Control characters would mess up the terminal
+        for (size_t i = 0; i < len; i++) {
+            unsigned char c = (unsigned char)snip->line[i];
+            cur[i] = (c < 0x20 || c == KEY_DEL) ? ' ' : (char)c;
+        }
+        p->entries[p->nr_entries++] = (struct picker_entry){
+            .line = cur,
+            .len = len,
+            .hash = snip->hash,
+        };
+        cur += len;
+    }
+
+    picker_filter(p);
+    return 0;
+}
+
+/**
+ * Insert a match into the top list if it ranks high enough. Ties go to the
+ * newer clip, which is the one already in the list since we scan newest first.
+ */
+static void top_insert(struct picker *p, size_t idx, int score) {
+    if (p->nr_top == PICKER_MAX_ROWS &&
+        score <= p->top_scores[PICKER_MAX_ROWS - 1]) {
+        return;
+    }
+    size_t pos =
+        p->nr_top < PICKER_MAX_ROWS ? p->nr_top++ : PICKER_MAX_ROWS - 1;
+    while (pos > 0 && p->top_scores[pos - 1] < score) {
+        p->top[pos] = p->top[pos - 1];
+        p->top_scores[pos] = p->top_scores[pos - 1];
+        pos--;
+    }
+    p->top[pos] = idx;
+    p->top_scores[pos] = score;
+}
+
+/**
+ * Recompute the matches and the top list for the current query.
+ */
+void picker_filter(struct picker *p) {
+    uint64_t start = monotonic_ns();
+    // Everything matches the empty query, so if we have no narrower match
+    // list, start from all entries
+    bool from_all = p->filtered_query_len == 0;
+    size_t nr_candidates = from_all ? p->nr_entries : p->nr_matches;
+    size_t nr_matches = 0;
+
+    p->nr_top = 0;
+    for (size_t i = 0; i < nr_candidates; i++) {
+        size_t idx = from_all ? i : p->matches[i];
+        const struct picker_entry *e = &p->entries[idx];
+        int score = fuzzy_score(p->query, p->query_len, e->line, e->len);
+        if (score == FUZZY_NO_MATCH) {
+            continue;
+        }
+        // nr_matches <= i, so this never overwrites an unread candidate
+        p->matches[nr_matches++] = idx;
+        top_insert(p, idx, score);
+    }
+
+    p->nr_matches = nr_matches;
+    p->filtered_query_len = p->query_len;
+    p->filter_ns = monotonic_ns() - start;
+}
+
+/**
+ * Remove the last character from the query, including any UTF-8 continuation
+ * bytes.
+ */
+static void query_delete_char(struct picker *p) {
+    while (p->query_len > 0 &&
+           ((unsigned char)p->query[--p->query_len] & 0xc0) == 0x80) {
+    }
+    p->query[p->query_len] = '\0';
+    // The old matches were for a longer query, so are no longer a superset
+    p->filtered_query_len = 0;
+}
+
+static void query_clear(struct picker *p) {
+    p->query_len = 0;
+    p->query[0] = '\0';
+    p->filtered_query_len = 0;
+}
+
+static void query_append(struct picker *p, char c) {
+    if (p->query_len < sizeof(p->query) - 1) {
+        p->query[p->query_len++] = (char)tolower((unsigned char)c);
+        p->query[p->query_len] = '\0';
+    }
+}
+
+/**
+ * A growable output buffer, so that each frame is drawn with a single write.
+ */
+struct frame {
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+static void _printf_(2, 3) frame_printf(struct frame *f, const char *fmt, ...) {
+    va_list args;
+    while (1) {
+        va_start(args, fmt);
+        int len =
+            vsnprintf(f->data + f->size, f->capacity - f->size, fmt, args);
+        va_end(args);
+        expect(len >= 0);
+        if ((size_t)len < f->capacity - f->size) {
+            f->size += (size_t)len;
+            return;
+        }
+        f->capacity = (f->capacity + (size_t)len + 1) * 2;
+        f->data = realloc(f->data, f->capacity);
+        expect(f->data);
+    }
+}
+
+/**
+ * Get the number of bytes of line that fit in cols columns, assuming one
+ * column per UTF-8 character, without splitting a character.
+ */
+static size_t fit_columns(const char *line, size_t len, size_t cols) {
+    size_t bytes = 0;
+    while (bytes < len && cols > 0) {
+        bytes++;
+        while (bytes < len && ((unsigned char)line[bytes] & 0xc0) == 0x80) {
+            bytes++;
+        }
+        cols--;
+    }
+    return bytes;
+}
+
+static void draw(int tty, const struct picker *p, size_t selected) {
+    struct winsize ws = {.ws_row = 24, .ws_col = 80};
+    ioctl(tty, TIOCGWINSZ, &ws);
+    size_t rows = ws.ws_row > 2 ? ws.ws_row - 2u : 1;
+    size_t cols = ws.ws_col > 2 ? ws.ws_col - 2u : 1;
+    if (rows > p->nr_top) {
+        rows = p->nr_top;
+    }
+
+    static struct frame f;
+    f.size = 0;
+    frame_printf(&f, "\033[H> %s\033[K\r\n", p->query);
+    frame_printf(&f, "  %zu/%zu (%" PRIu64 ".%03" PRIu64 "ms)\033[K\r\n",
+                 p->nr_matches, p->nr_entries, p->filter_ns / 1000000,
+                 (p->filter_ns / 1000) % 1000);
+    for (size_t i = 0; i < rows; i++) {
+        const struct picker_entry *e = &p->entries[p->top[i]];
+        frame_printf(&f, "%s%.*s\033[K\033[0m\r\n",
+                     i == selected ? "\033[7m> " : "  ",
+                     (int)fit_columns(e->line, e->len, cols), e->line);
+    }
+    frame_printf(&f, "\033[J\033[1;%zuH", 3 + p->query_len);
+    write_safe(tty, f.data, f.size);
+}
+
+/**
+ * Check whether more input arrives within a short timeout. Used to tell a
+ * lone Escape key press from the start of an escape sequence.
+ */
+static bool input_pending(int tty) {
+    struct pollfd pfd = {.fd = tty, .events = POLLIN};
+    return poll(&pfd, 1, ESC_TIMEOUT_MS) > 0;
+}
+
+/**
+ * Read the rest of an escape sequence after KEY_ESC, one byte at a time so
+ * that we never consume more than the sequence itself. Returns the final
+ * byte of a CSI sequence ("\033[A" gives 'A'), or 0 for a lone Escape. Other
+ * sequences are consumed and ignored, so they aren't taken as query text.
+ */
+static char read_escape(int tty) {
+    char c;
+    if (!input_pending(tty) || read(tty, &c, 1) != 1) {
+        return 0;
+    }
+    if (c != '[') {
+        return -1;
+    }
+    // Parameter and intermediate bytes, up to the final byte in 0x40-0x7e
+    while (input_pending(tty) && read(tty, &c, 1) == 1) {
+        if (c >= 0x40 && c <= 0x7e) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Run the picker on the controlling terminal until the user selects a clip or
+ * cancels. Returns EXIT_SUCCESS and sets out_hash if a clip was selected, like
+ * a launcher would. If there is no usable terminal, as when clipmenu is started
+ * from a hotkey, returns a negative errno without showing anything.
+ *
+ * @p: The loaded picker
+ * @out_hash: Output for the hash of the selected clip
+ */
+int picker_run(struct picker *p, uint64_t *out_hash) {
+    _drop_(close) int tty = open("/dev/tty", O_RDWR | O_CLOEXEC);
+    if (tty < 0) {
+        return negative_errno();
+    }
+
+    struct termios orig, raw;
+    if (tcgetattr(tty, &orig) < 0) {
+        return negative_errno();
+    }
+    raw = orig;
+    raw.c_iflag &= ~(tcflag_t)(IXON | ICRNL);
+    raw.c_lflag &= ~(tcflag_t)(ECHO | ICANON | ISIG | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    expect(tcsetattr(tty, TCSAFLUSH, &raw) == 0);
+    write_safe(tty, "\033[?1049h", strlen("\033[?1049h"));
+
+    size_t selected = 0;
+    int ret = -1;
+
+    while (ret < 0) {
+        if (selected >= p->nr_top) {
+            selected = p->nr_top ? p->nr_top - 1 : 0;
+        }
+        draw(tty, p, selected);
+
+        char c;
+        if (read(tty, &c, 1) != 1) {
+            ret = EXIT_FAILURE;
+            break;
+        }
+
+        switch (c) {
+            case '\r':
+            case '\n':
+                if (p->nr_top > 0) {
+                    *out_hash = p->entries[p->top[selected]].hash;
+                    ret = EXIT_SUCCESS;
+                }
+                break;
+            case KEY_CTRL('c'):
+            case KEY_CTRL('g'):
+                ret = EXIT_FAILURE;
+                break;
+            case KEY_ESC: {
+                char final = read_escape(tty);
+                if (final == 0) {
+                    ret = EXIT_FAILURE;
+                } else if (final == 'A' && selected > 0) {
+                    selected--;
+                } else if (final == 'B') {
+                    selected++;
+                }
+                break;
+            }
+            case KEY_CTRL('p'):
+                if (selected > 0) {
+                    selected--;
+                }
+                break;
+            case KEY_CTRL('n'):
+                selected++;
+                break;
+            case KEY_DEL:
+            case KEY_CTRL('h'):
+                if (p->query_len > 0) {
+                    query_delete_char(p);
+                    picker_filter(p);
+                    selected = 0;
+                }
+                break;
+            case KEY_CTRL('u'):
+                query_clear(p);
+                picker_filter(p);
+                selected = 0;
+                break;
+            default:
+                if ((unsigned char)c >= 0x20) {
+                    query_append(p, c);
+                    picker_filter(p);
+                    selected = 0;
+                }
+                break;
+        }
+    }
+
+    write_safe(tty, "\033[?1049l", strlen("\033[?1049l"));
+    expect(tcsetattr(tty, TCSAFLUSH, &orig) == 0);
+    return ret;
+}
+
+void picker_free(struct picker *p) {
+    free(p->entries);
+    free(p->matches);
+    free(p->arena);
+    *p = (struct picker){0};
+}
+
+/**
+ * _drop_() function for picker_free().
+ */
+void drop_picker_free(struct picker *p) { picker_free(p); }
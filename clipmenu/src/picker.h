@@ -0,0 +1,63 @@
+#ifndef CM_PICKER_H
+#define CM_PICKER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "store.h"
+#include "util.h"
+
+#define PICKER_QUERY_MAX 256
+#define PICKER_MAX_ROWS 128
+
+/**
+ * A clip shown in the picker.
+ *
+ * @line: The sanitised snip line, inside the picker's arena
+ * @len: The length of line
+ * @hash: The hash of the clip
+ */
+struct picker_entry {
+    const char *line;
+    size_t len;
+    uint64_t hash;
+};
+
+/**
+ * State for the built-in picker.
+ *
+ * @entries: All clips, newest first
+ * @nr_entries: The number of clips
+ * @arena: Storage for the entry lines
+ * @matches: Indices of the entries matching the query, newest first
+ * @nr_matches: The number of matching entries
+ * @top: Indices of the best matches, best first
+ * @top_scores: The scores of the entries in top
+ * @nr_top: The number of entries in top
+ * @query: The current query, lowercased
+ * @query_len: The length of the query
+ * @filtered_query_len: The length of the query that matches was built for
+ * @filter_ns: How long the last filter took
+ */
+struct picker {
+    struct picker_entry *entries;
+    size_t nr_entries;
+    char *arena;
+    size_t *matches;
+    size_t nr_matches;
+    size_t top[PICKER_MAX_ROWS];
+    int top_scores[PICKER_MAX_ROWS];
+    size_t nr_top;
+    char query[PICKER_QUERY_MAX];
+    size_t query_len;
+    size_t filtered_query_len;
+    uint64_t filter_ns;
+};
+
+int _must_use_ _nonnull_ picker_load(struct picker *p, struct ref_guard *guard);
+void _nonnull_ picker_filter(struct picker *p);
+int _must_use_ _nonnull_ picker_run(struct picker *p, uint64_t *out_hash);
+void _nonnull_ picker_free(struct picker *p);
+void drop_picker_free(struct picker *p);
+
+#endif
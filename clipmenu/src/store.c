@@ -4,12 +4,16 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <linux/futex.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "store.h"
@@ -30,7 +34,9 @@
  * - cs_remove - remove a clip store entry by callback
  * - cs_trim - trim to the newest/oldest N entries
  * - cs_snip_iter - iterate over snip hashes and lines
+ * - cs_snip_at, cs_snip_range - random access to snips by age
  * - cs_content_get - get the content for a snip hash
+ * - cs_changes, cs_wait - follow changes without rescanning the snips
  *
  * CLIP STORE DESIGN
  *
@@ -53,6 +59,22 @@
  * header was updated. If it was, we update the size of the mmapped area to
  * suit. The lock is implemented using flock() on cs->snip_fd, see cs_ref(),
  * cs_ref_no_update(), and cs_unref().
+ *
+ * Short-lived readers like clipserve and clipmenu use cs_init_readonly()
+ * instead, which maps the snip file read-only and only takes a shared lock,
+ * so they don't serialise against each other.
+ *
+ * CHANGE NOTIFICATION
+ *
+ * Every change to the snips is also recorded as a `struct cs_event` in a small
+ * ring in the header, numbered by header->generation. A reader which keeps the
+ * generation it last saw can ask cs_changes() for just what changed since,
+ * instead of rescanning the whole snip file. If it fell too far behind, the
+ * events it needs have been overwritten and it has to rescan.
+ *
+ * To avoid polling, cs_wait() sleeps on a futex in the header, which is woken
+ * when the writer releases its lock after publishing events. Since the snip
+ * file is a shared mapping, this works across processes.
  */
 
 /**
@@ -80,6 +102,61 @@ static int _must_use_ _nonnull_ cs_header_validate(const struct clip_store *cs,
     return 0;
 }
 
+static_assert(offsetof(struct cs_header, wake_seq) % sizeof(uint32_t) == 0,
+              "futex word must be aligned");
+
+/**
+ * Get the futex word in the header. The header is packed, so the compiler
+ * can't know it's aligned, but the static_assert above checks that it is.
+ */
+static uint32_t *cs_wake_seq(struct clip_store *cs) {
+    return (uint32_t *)((char *)cs->header +
+                        offsetof(struct cs_header, wake_seq));
+}
+
+static long futex(uint32_t *uaddr, int op, uint32_t val,
+                  const struct timespec *timeout) {
+    return syscall(SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
+
+/**
+ * Record a change in the header's event ring. Must be called with the lock
+ * held. Waiters are woken once the lock is released, see cs_unref().
+ *
+ * @cs: The clip store to operate on
+ * @type: The type of change
+ * @hash: The hash of the affected snip
+ * @index: The index of the affected snip, counting from the oldest
+ * @nr: How many consecutive snips from index were affected
+ */
+static void _nonnull_ cs_event_publish(struct clip_store *cs,
+                                       enum cs_event_type type, uint64_t hash,
+                                       size_t index, size_t nr) {
+    uint64_t gen = cs->header->generation + 1;
+    cs->header->events[(gen - 1) % CS_EVENT_RING_SIZE] = (struct cs_event){
+        .hash = hash,
+        .type = type,
+        .index = index > UINT32_MAX ? UINT32_MAX : (uint32_t)index,
+        .nr = nr > UINT32_MAX ? UINT32_MAX : (uint32_t)nr,
+    };
+    // Lockless readers in cs_wait() must see the event before the generation
+    __atomic_store_n(&cs->header->generation, gen, __ATOMIC_RELEASE);
+    cs->wake_pending = true;
+}
+
+/**
+ * Wake anyone in cs_wait() if we published events.
+ *
+ * @cs: The clip store to operate on
+ */
+static void _nonnull_ cs_wake_waiters(struct clip_store *cs) {
+    if (cs->wake_pending) {
+        cs->wake_pending = false;
+        __atomic_add_fetch(cs_wake_seq(cs), 1, __ATOMIC_RELEASE);
+        futex(cs_wake_seq(cs), FUTEX_WAKE, INT_MAX, NULL);
+    }
+}
+
 /**
  * Decrease the reference count for the clip store lock, unrefing it if
  * the refcount reaches zero.
@@ -91,6 +168,8 @@ void cs_unref(struct clip_store *cs) {
     cs->refcount--;
     if (cs->refcount == 0) {
         expect(flock(cs->snip_fd, LOCK_UN) == 0);
+        // Wake after unlocking, so that waiters can take the lock
+        cs_wake_waiters(cs);
     }
 }
 
@@ -103,7 +182,7 @@ static struct ref_guard _must_use_ _nonnull_
 cs_ref_no_update(struct clip_store *cs) {
     struct ref_guard guard = {.status = 0, .unref = cs_unref, .cs = cs};
     if (cs->refcount == 0) {
-        expect(flock(cs->snip_fd, LOCK_EX) == 0);
+        expect(flock(cs->snip_fd, cs->readonly ? LOCK_SH : LOCK_EX) == 0);
     }
     static_assert(sizeof(cs->refcount) == sizeof(size_t),
                   "refcount type wrong");
@@ -181,6 +260,8 @@ void drop_cs_unref(struct ref_guard *guard) {
  */
 int cs_destroy(struct clip_store *cs) {
     cs->ready = false;
+    // We may still hold the lock, but the header is about to go away
+    cs_wake_waiters(cs);
     // Don't use the value from the header: if it's out of date, we haven't
     // done mremap() with the new size yet
     if (munmap(cs->header, cs_file_size(cs->local_nr_snips_alloc))) {
@@ -197,18 +278,19 @@ int cs_destroy(struct clip_store *cs) {
 void drop_cs_destroy(struct clip_store *cs) { expect(cs_destroy(cs) == 0); }
 
 /**
- * Initialise a `struct clip_store` with snip_fd open to a file for snip
- * storage and content_fd open to a directory for content entry storage.
- *
- * The snip file is extended and the header snip is written if the file size is
- * zero. The file is mapped into memory until cs_destroy() is called.
+ * Common initialisation for cs_init() and cs_init_readonly().
  *
  * @cs: The clip store to initialise
  * @snip_fd: Open file descriptor for the snip file
  * @content_dir_fd: Open file descriptor for the content directory
+ * @readonly: Whether to map the snip file read-only
  */
-int cs_init(struct clip_store *cs, int snip_fd, int content_dir_fd) {
+static int _must_use_ _nonnull_ cs_init_common(struct clip_store *cs,
+                                               int snip_fd, int content_dir_fd,
+                                               bool readonly) {
     cs->ready = false;
+    cs->readonly = readonly;
+    cs->wake_pending = false;
     cs->snip_fd = snip_fd;
     cs->content_dir_fd = content_dir_fd;
     cs->refcount = 0;
@@ -223,15 +305,22 @@ int cs_init(struct clip_store *cs, int snip_fd, int content_dir_fd) {
     }
 
     size_t file_size = (size_t)st.st_size;
-    if (file_size == 0) {
+    if (file_size == 0 && readonly) {
+        // We can't write the header, and nobody else has yet either, so
+        // there's nothing to read. Stand in an empty header.
         file_size = CS_SNIP_SIZE;
-        if (ftruncate(snip_fd, (off_t)file_size) < 0) {
-            return negative_errno();
+        cs->header = mmap(NULL, file_size, PROT_READ,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    } else {
+        if (file_size == 0) {
+            file_size = CS_SNIP_SIZE;
+            if (ftruncate(snip_fd, (off_t)file_size) < 0) {
+                return negative_errno();
+            }
         }
+        int prot = readonly ? PROT_READ : PROT_READ | PROT_WRITE;
+        cs->header = mmap(NULL, file_size, prot, MAP_SHARED, snip_fd, 0);
     }
-
-    cs->header =
-        mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, snip_fd, 0);
     if (cs->header == MAP_FAILED) {
         return negative_errno();
     }
@@ -252,6 +341,37 @@ int cs_init(struct clip_store *cs, int snip_fd, int content_dir_fd) {
     return 0;
 }
 
+/**
+ * Initialise a `struct clip_store` with snip_fd open to a file for snip
+ * storage and content_fd open to a directory for content entry storage.
+ *
+ * The snip file is extended and the header snip is written if the file size is
+ * zero. The file is mapped into memory until cs_destroy() is called.
+ *
+ * @cs: The clip store to initialise
+ * @snip_fd: Open file descriptor for the snip file
+ * @content_dir_fd: Open file descriptor for the content directory
+ */
+int cs_init(struct clip_store *cs, int snip_fd, int content_dir_fd) {
+    return cs_init_common(cs, snip_fd, content_dir_fd, false);
+}
+
+/**
+ * Initialise a `struct clip_store` for reading only. snip_fd may be opened
+ * O_RDONLY: the snip file is mapped read-only, the header is validated but
+ * never written, and cs_ref() takes a shared rather than an exclusive lock.
+ * Any function which would modify the clip store fails with -EROFS.
+ *
+ * An empty snip file is treated as an empty clip store.
+ *
+ * @cs: The clip store to initialise
+ * @snip_fd: Open file descriptor for the snip file
+ * @content_dir_fd: Open file descriptor for the content directory
+ */
+int cs_init_readonly(struct clip_store *cs, int snip_fd, int content_dir_fd) {
+    return cs_init_common(cs, snip_fd, content_dir_fd, true);
+}
+
 /**
  * Round up a number to the nearest multiple of a specified step.
  *
@@ -343,6 +463,29 @@ static uint64_t djb64_hash(const char *buf) {
     return hash;
 }
 
+/**
+ * Like djb64_hash(), but for a buffer of known size. Hashing stops at the first
+ * NUL, as with a string, so the result matches djb64_hash() of the same text.
+ * @out_nul is set if a NUL was found before the end of the buffer.
+ *
+ * @buf: The input buffer to hash
+ * @size: The size of the buffer in bytes
+ * @out_nul: Output for whether the buffer contains a NUL
+ */
+static uint64_t djb64_hash_n(const char *buf, size_t size, bool *out_nul) {
+    const uint8_t *src = (const uint8_t *)buf;
+    uint64_t hash = 5381;
+    *out_nul = false;
+    for (size_t i = 0; i < size; i++) {
+        if (!src[i]) {
+            *out_nul = true;
+            break;
+        }
+        hash = ((hash << 5) + hash) + src[i];
+    }
+    return hash;
+}
+
 /**
  * Extracts the first non-empty line from a given text buffer and copies it to
  * the output buffer. Returns the total number of lines. A final line with no
@@ -392,22 +535,27 @@ static int _must_use_ _nonnull_ cs_snip_add(struct clip_store *cs,
         return ret;
     }
     cs_snip_update(cs->snips + cs->header->nr_snips - 1, hash, line, nr_lines);
+    cs_event_publish(cs, CS_EVENT_ADD, hash, cs->header->nr_snips - 1, 1);
     return 0;
 }
 
 /**
- * Add content to the content directory using the hash as the filename.
+ * Create the content entry for a hash in the content directory. If the hash is
+ * new, HASH/1 is created and an fd for writing it is returned in out_fd, so
+ * the caller can fill it in however suits. Otherwise a further link is made for
+ * refcounting and out_fd is set to -1.
  *
  * @cs: The clip store to operate on
  * @hash: The hash of the content to add
- * @content: The content to add to the file
  * @dupe_policy: If set to CS_DUPE_KEEP_LAST, will return with -EEXIST when
  * trying to insert duplicate entry.
+ * @out_fd: Output for the fd of the new content file
  */
 static int _must_use_ _nonnull_
-cs_content_add(struct clip_store *cs, uint64_t hash, const char *content,
-               enum cs_dupe_policy dupe_policy) {
+cs_content_create(struct clip_store *cs, uint64_t hash,
+                  enum cs_dupe_policy dupe_policy, int *out_fd) {
     bool dupe = false;
+    *out_fd = -1;
 
     char dir_path[CS_HASH_STR_MAX];
     snprintf(dir_path, sizeof(dir_path), PRI_HASH, hash);
@@ -442,10 +590,27 @@ cs_content_add(struct clip_store *cs, uint64_t hash, const char *content,
     }
 
     // This is a new clip
-    _drop_(close) int fd = openat(cs->content_dir_fd, base_file_path,
-                                  O_WRONLY | O_CREAT | O_EXCL, 0600);
-    if (fd < 0) {
-        return negative_errno();
+    *out_fd = openat(cs->content_dir_fd, base_file_path,
+                     O_WRONLY | O_CREAT | O_EXCL, 0600);
+    return *out_fd < 0 ? negative_errno() : 0;
+}
+
+/**
+ * Add content to the content directory using the hash as the filename.
+ *
+ * @cs: The clip store to operate on
+ * @hash: The hash of the content to add
+ * @content: The content to add to the file
+ * @dupe_policy: If set to CS_DUPE_KEEP_LAST, will return with -EEXIST when
+ * trying to insert duplicate entry.
+ */
+static int _must_use_ _nonnull_
+cs_content_add(struct clip_store *cs, uint64_t hash, const char *content,
+               enum cs_dupe_policy dupe_policy) {
+    _drop_(close) int fd = -1;
+    int ret = cs_content_create(cs, hash, dupe_policy, &fd);
+    if (ret < 0 || fd < 0) {
+        return ret;
     }
 
     const char *cur = content;
@@ -545,6 +710,7 @@ static int cs_make_newest(struct clip_store *cs, uint64_t hash) {
             memmove(cs->snips + i, cs->snips + i + 1,
                     (cs->local_nr_snips - (i + 1)) * sizeof(*cs->snips));
             cs->snips[cs->local_nr_snips - 1] = tmp;
+            cs_event_publish(cs, CS_EVENT_MAKE_NEWEST, hash, (size_t)i, 1);
             return 0;
         }
     }
@@ -561,6 +727,10 @@ static int cs_make_newest(struct clip_store *cs, uint64_t hash) {
  */
 int cs_add(struct clip_store *cs, const char *content, uint64_t *out_hash,
            enum cs_dupe_policy dupe_policy) {
+    if (cs->readonly) {
+        return -EROFS;
+    }
+
     uint64_t hash = djb64_hash(content);
     char line[CS_SNIP_LINE_SIZE];
     size_t nr_lines = first_line(content, line);
@@ -576,6 +746,91 @@ int cs_add(struct clip_store *cs, const char *content, uint64_t *out_hash,
     return ret ? ret : cs_snip_add(cs, hash, line, nr_lines);
 }
 
+/**
+ * Check that freshly written content really has the hash it was stored under.
+ * The content was just written, so reading it back is served from the page
+ * cache. Content containing a NUL can never come from cs_add(), so it's
+ * rejected too. Returns -EINVAL on mismatch.
+ *
+ * @cs: The clip store to operate on
+ * @hash: The hash the content was stored under
+ * @size: The expected size of the content
+ */
+static int cs_content_verify(struct clip_store *cs, uint64_t hash,
+                             size_t size) {
+    bool nul;
+    if (size == 0) {
+        return djb64_hash_n("", 0, &nul) == hash ? 0 : -EINVAL;
+    }
+
+    _drop_(cs_content_unmap) struct cs_content content;
+    int ret = cs_content_get(cs, hash, &content);
+    if (ret < 0) {
+        return ret;
+    }
+    if ((size_t)content.size != size ||
+        djb64_hash_n(content.data, size, &nul) != hash || nul) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * Add an entry whose content is read from an fd, like cs_add(), but with the
+ * hash and snip line already known. This is for bulk imports, where the content
+ * is moved straight from the input into the content file with copy_fd(), so it
+ * never has to be in memory. The stored content is hashed again before its snip
+ * is added, and -EINVAL is returned if it doesn't match the hash passed in.
+ *
+ * Exactly size bytes are always consumed from fd on success, even if the
+ * content is a duplicate and doesn't need to be stored again.
+ *
+ * @cs: The clip store to operate on
+ * @hash: The hash of the content
+ * @line: The snip line for the content
+ * @nr_lines: The number of lines in the content
+ * @fd: The fd to read the content from, at its current offset
+ * @size: The size of the content in bytes
+ * @dupe_policy: Policy to use for duplicate entries
+ */
+int cs_add_fd(struct clip_store *cs, uint64_t hash, const char *line,
+              uint64_t nr_lines, int fd, size_t size,
+              enum cs_dupe_policy dupe_policy) {
+    if (cs->readonly) {
+        return -EROFS;
+    }
+
+    _drop_(close) int content_fd = -1;
+    int ret = cs_content_create(cs, hash, dupe_policy, &content_fd);
+    if (ret == -EEXIST && dupe_policy == CS_DUPE_KEEP_LAST) {
+        ret = skip_fd(fd, size);
+        return ret ? ret : cs_make_newest(cs, hash);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (content_fd < 0) {
+        ret = skip_fd(fd, size);
+    } else {
+        ret = copy_fd(fd, content_fd, size);
+        if (ret == 0) {
+            ret = cs_content_verify(cs, hash, size);
+        }
+        if (ret < 0) {
+            // Don't leave partial or bad content behind with no snip pointing
+            // to it
+            char dir_path[CS_HASH_STR_MAX], path[PATH_MAX];
+            snprintf(dir_path, sizeof(dir_path), PRI_HASH, hash);
+            snprintf(path, sizeof(path), "%s/1", dir_path);
+            unlinkat(cs->content_dir_fd, path, 0);
+            unlinkat(cs->content_dir_fd, dir_path, AT_REMOVEDIR);
+        }
+    }
+
+    return ret ? ret : cs_snip_add(cs, hash, line, nr_lines);
+}
+
 /**
  * Iterate over the snips in the clip store. The function should be initially
  * called with *snip set to NULL, which will set *snip to point to the newest
@@ -608,6 +863,60 @@ bool cs_snip_iter(struct ref_guard *guard, enum cs_iter_direction direction,
     return false;
 }
 
+/**
+ * Get the snip at the given index, counting from the newest or oldest snip.
+ * Returns NULL if the index is out of range.
+ *
+ * @guard: The guard lock
+ * @direction: Whether index 0 is the newest or the oldest snip
+ * @index: The index of the snip to get
+ */
+struct cs_snip *cs_snip_at(struct ref_guard *guard,
+                           enum cs_iter_direction direction, size_t index) {
+    size_t nr_snips = guard->cs->header->nr_snips;
+    if (guard->status < 0 || index >= nr_snips) {
+        return NULL;
+    }
+    return guard->cs->snips +
+           (direction == CS_ITER_NEWEST_FIRST ? nr_snips - 1 - index : index);
+}
+
+/**
+ * Get a view of up to count snips starting at index start, counting from the
+ * newest or oldest snip. The view is clamped to the end of the clip store, so
+ * it may be shorter than count, or empty if start is exactly the number of
+ * snips. No snips are copied: the view points into the mmapped snip file.
+ *
+ * @guard: The guard lock
+ * @direction: Whether index 0 is the newest or the oldest snip
+ * @start: The index of the first snip in the view
+ * @count: The maximum number of snips in the view
+ * @view: Output for the view
+ */
+int cs_snip_range(struct ref_guard *guard, enum cs_iter_direction direction,
+                  size_t start, size_t count, struct cs_snip_view *view) {
+    if (guard->status < 0) {
+        return guard->status;
+    }
+
+    size_t nr_snips = guard->cs->header->nr_snips;
+    if (start > nr_snips) {
+        return -ERANGE;
+    }
+    if (count > nr_snips - start) {
+        count = nr_snips - start;
+    }
+
+    size_t lowest =
+        direction == CS_ITER_NEWEST_FIRST ? nr_snips - start - count : start;
+    *view = (struct cs_snip_view){
+        .snips = guard->cs->snips + lowest,
+        .nr = count,
+        .direction = direction,
+    };
+    return 0;
+}
+
 /**
  * Remove content from the content directory using the hash as the filename.
  *
@@ -648,22 +957,42 @@ static int _must_use_ _nonnull_ cs_content_remove(struct clip_store *cs,
 
 /**
  * Compacts the clip store by removing doomed snips, finalising their removal
- * after being marked in cs_remove().
+ * after being marked in cs_remove(). Each run of consecutive doomed snips is
+ * published as one event, so that a trim doesn't flood the event ring.
  *
  * @guard: The guard lock
  */
 static size_t _nonnull_ cs_snip_remove_doomed(struct ref_guard *guard) {
     size_t nr_doomed = 0;
+    size_t run_index = 0, run_nr = 0;
+    uint64_t run_hash = 0;
     struct cs_snip *snip = NULL;
 
     while (cs_snip_iter(guard, CS_ITER_OLDEST_FIRST, &snip)) {
         if (snip->doomed) {
+            if (run_nr++ == 0) {
+                // Earlier removals have already shifted this snip down
+                run_index = (size_t)(snip - guard->cs->snips) - nr_doomed;
+                run_hash = snip->hash;
+            }
             nr_doomed++;
-        } else if (nr_doomed > 0) {
+            continue;
+        }
+        if (run_nr > 0) {
+            cs_event_publish(guard->cs, CS_EVENT_REMOVE, run_hash, run_index,
+                             run_nr);
+            run_nr = 0;
+        }
+        if (nr_doomed > 0) {
             *(snip - nr_doomed) = *snip;
         }
     }
 
+    if (run_nr > 0) {
+        cs_event_publish(guard->cs, CS_EVENT_REMOVE, run_hash, run_index,
+                         run_nr);
+    }
+
     return nr_doomed;
 }
 
@@ -681,6 +1010,10 @@ int cs_remove(struct clip_store *cs, enum cs_iter_direction direction,
               enum cs_remove_action (*should_remove)(uint64_t, const char *,
                                                      void *),
               void *private) {
+    if (cs->readonly) {
+        return -EROFS;
+    }
+
     _drop_(cs_unref) struct ref_guard guard = cs_ref(cs);
     if (guard.status < 0) {
         return guard.status;
@@ -748,6 +1081,9 @@ trim_callback(uint64_t hash, const char *line, void *private) {
  */
 int cs_trim(struct clip_store *cs, enum cs_iter_direction direction,
             size_t nr_keep) {
+    if (cs->readonly) {
+        return -EROFS;
+    }
     if (nr_keep >= cs->header->nr_snips) {
         return 0; // No action needed if we're keeping everything or more
     }
@@ -772,6 +1108,10 @@ int cs_trim(struct clip_store *cs, enum cs_iter_direction direction,
  */
 int cs_replace(struct clip_store *cs, enum cs_iter_direction direction,
                size_t age, const char *content, uint64_t *out_hash) {
+    if (cs->readonly) {
+        return -EROFS;
+    }
+
     _drop_(cs_unref) struct ref_guard guard = cs_ref(cs);
     if (guard.status < 0) {
         return guard.status;
@@ -794,6 +1134,7 @@ int cs_replace(struct clip_store *cs, enum cs_iter_direction direction,
     size_t nr_lines = first_line(content, line);
     uint64_t hash = djb64_hash(content);
     cs_snip_update(snip, hash, line, nr_lines);
+    cs_event_publish(cs, CS_EVENT_REPLACE, hash, idx, 1);
     ret = cs_content_add(cs, hash, content, CS_DUPE_KEEP_ALL);
     if (ret) {
         return ret;
@@ -818,3 +1159,92 @@ int cs_len(struct clip_store *cs, size_t *out_len) {
     *out_len = cs->header->nr_snips;
     return 0;
 }
+
+/**
+ * Get the current generation of the clip store, to later pass to
+ * cs_changes() or cs_wait(). Needs no lock.
+ *
+ * @cs: The clip store to operate on
+ */
+uint64_t cs_generation(struct clip_store *cs) {
+    return __atomic_load_n(&cs->header->generation, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Get the changes made to the clip store since generation since, oldest first.
+ * Applying them in order to a copy of the snips taken at that generation
+ * brings it up to date with cs->header->generation.
+ *
+ * Returns -EOVERFLOW if the events have already been overwritten, or since is
+ * from the future (for example, because the clip store was recreated). In that
+ * case the caller must rescan the snips.
+ *
+ * @guard: The guard lock
+ * @since: The generation the caller is up to date with
+ * @events: Output for the events, with room for CS_EVENT_RING_SIZE entries
+ * @nr_events: Output for the number of events
+ */
+int cs_changes(struct ref_guard *guard, uint64_t since,
+               struct cs_event *events, size_t *nr_events) {
+    if (guard->status < 0) {
+        return guard->status;
+    }
+
+    const struct cs_header *header = guard->cs->header;
+    if (since > header->generation ||
+        header->generation - since > CS_EVENT_RING_SIZE) {
+        return -EOVERFLOW;
+    }
+
+    *nr_events = (size_t)(header->generation - since);
+    for (size_t i = 0; i < *nr_events; i++) {
+        events[i] = header->events[(since + i) % CS_EVENT_RING_SIZE];
+    }
+    return 0;
+}
+
+/**
+ * Wait until the generation of the clip store differs from since. Must be
+ * called without holding the lock.
+ *
+ * Returns 0 once there are changes, -ETIMEDOUT if there were none within
+ * timeout_ms milliseconds, or -EINTR if interrupted by a signal. A negative
+ * timeout_ms waits forever.
+ *
+ * @cs: The clip store to operate on
+ * @since: The generation the caller is up to date with
+ * @timeout_ms: How long to wait for
+ */
+int cs_wait(struct clip_store *cs, uint64_t since, int timeout_ms) {
+    expect(cs->refcount == 0);
+
+    uint64_t deadline = 0;
+    if (timeout_ms >= 0) {
+        deadline = monotonic_ns() + (uint64_t)timeout_ms * 1000000;
+    }
+
+    while (1) {
+        // Read the futex word before the generation, so that a change
+        // published in between makes FUTEX_WAIT return immediately
+        uint32_t seq = __atomic_load_n(cs_wake_seq(cs), __ATOMIC_ACQUIRE);
+        if (cs_generation(cs) != since) {
+            return 0;
+        }
+
+        struct timespec ts, *timeout = NULL;
+        if (timeout_ms >= 0) {
+            uint64_t now = monotonic_ns();
+            if (now >= deadline) {
+                return -ETIMEDOUT;
+            }
+            ts.tv_sec = (time_t)((deadline - now) / 1000000000);
+            ts.tv_nsec = (long)((deadline - now) % 1000000000);
+            timeout = &ts;
+        }
+
+        if (futex(cs_wake_seq(cs), FUTEX_WAIT, seq, timeout) < 0 &&
+            errno != EAGAIN && errno != ETIMEDOUT) {
+            return negative_errno();
+        }
+    }
+}
@@ -29,6 +29,41 @@ struct _packed_ cs_snip {
     char line[CS_SNIP_LINE_SIZE];
 };
 
+/**
+ * The kind of change described by a `struct cs_event`. Indices count from the
+ * oldest snip, and are as they were at the time of the change.
+ *
+ * @CS_EVENT_ADD: A snip was added as the newest, at index
+ * @CS_EVENT_REMOVE: The nr snips starting at index were removed
+ * @CS_EVENT_MAKE_NEWEST: The snip at index was moved to be the newest
+ * @CS_EVENT_REPLACE: The snip at index was replaced with new content
+ */
+enum cs_event_type {
+    CS_EVENT_ADD = 1,
+    CS_EVENT_REMOVE,
+    CS_EVENT_MAKE_NEWEST,
+    CS_EVENT_REPLACE,
+};
+
+/**
+ * A single change to the clip store, as recorded in the header's event ring.
+ *
+ * @hash: The hash of the affected snip, after the change. For a removal of
+ *        several snips, the oldest of them.
+ * @type: The `enum cs_event_type` of the change
+ * @index: The index of the affected snip, counting from the oldest
+ * @nr: How many consecutive snips from index were affected. Only ever more
+ *      than 1 for CS_EVENT_REMOVE, so a whole trim is a single event.
+ */
+struct _packed_ cs_event {
+    uint64_t hash;
+    uint32_t type;
+    uint32_t index;
+    uint32_t nr;
+};
+
+#define CS_EVENT_RING_SIZE 11 /* How many events the header can hold */
+
 /**
  * The header of the clip store. Must fit within the footprint of a regular
  * `cs_snip`.
@@ -38,12 +73,21 @@ struct _packed_ cs_snip {
  * @nr_snips_alloc: The total number of allocated snips in the clip store
  *                    that can be used without _cs_file_resize(), excluding the
  *                    header
+ * @generation: The number of changes ever made to the clip store. Event number
+ *              N is stored at events[(N - 1) % CS_EVENT_RING_SIZE].
+ * @wake_seq: Futex word bumped after changes are published, see cs_wait()
+ * @events: The most recent changes, see cs_changes()
  * @_unused_padding: Padding to match the size of cs_snip
  */
-#define CS_HEADER_PADDING_SIZE CS_SNIP_SIZE - (sizeof(uint64_t) * 2)
+#define CS_HEADER_PADDING_SIZE                                                 \
+    CS_SNIP_SIZE - (sizeof(uint64_t) * 3) - sizeof(uint32_t) -                 \
+        (sizeof(struct cs_event) * CS_EVENT_RING_SIZE)
 struct _packed_ cs_header {
     uint64_t nr_snips;
     uint64_t nr_snips_alloc;
+    uint64_t generation;
+    uint32_t wake_seq;
+    struct cs_event events[CS_EVENT_RING_SIZE];
     char _unused_padding[CS_HEADER_PADDING_SIZE];
 };
 
@@ -63,6 +107,9 @@ static_assert(sizeof(struct cs_snip) == sizeof(struct cs_header),
  * @refcount: The reference count for the fd flock
  * @local_nr_snips: Our last known header->nr_snips
  * @local_nr_snips_alloc: Our last known header->nr_snips_alloc
+ * @readonly: Opened with cs_init_readonly(), so mutations fail with -EROFS
+ * @wake_pending: Events were published under the current lock, so waiters
+ *                should be woken when it is released
  */
 struct clip_store {
     /* FDs */
@@ -78,6 +125,8 @@ struct clip_store {
     size_t local_nr_snips;
     size_t local_nr_snips_alloc;
     bool ready;
+    bool readonly;
+    bool wake_pending;
 };
 
 /**
@@ -120,6 +169,30 @@ struct cs_content {
  */
 enum cs_iter_direction { CS_ITER_NEWEST_FIRST, CS_ITER_OLDEST_FIRST };
 
+/**
+ * A contiguous run of snips inside the mmapped snip file, as returned by
+ * cs_snip_range(). Only valid while the ref_guard it came from is held.
+ *
+ * @snips: The lowest addressed (oldest) snip in the run
+ * @nr: The number of snips in the run
+ * @direction: The direction the run was requested in, see cs_snip_view_at()
+ */
+struct cs_snip_view {
+    struct cs_snip *snips;
+    size_t nr;
+    enum cs_iter_direction direction;
+};
+
+/**
+ * Get the snip at index i within a view, counting in the view's direction.
+ */
+static inline struct cs_snip *cs_snip_view_at(const struct cs_snip_view *view,
+                                              size_t i) {
+    return view->direction == CS_ITER_NEWEST_FIRST
+               ? view->snips + (view->nr - 1 - i)
+               : view->snips + i;
+}
+
 /**
  * Set the bit at position n.
  *
@@ -161,6 +234,8 @@ void _nonnull_ drop_cs_unref(struct ref_guard *guard);
 int _must_use_ _nonnull_ cs_destroy(struct clip_store *cs);
 int _must_use_ _nonnull_ cs_init(struct clip_store *cs, int snip_fd,
                                  int content_dir_fd);
+int _must_use_ _nonnull_ cs_init_readonly(struct clip_store *cs, int snip_fd,
+                                          int content_dir_fd);
 int _must_use_ cs_content_unmap(struct cs_content *content);
 void drop_cs_content_unmap(struct cs_content *content);
 void drop_cs_destroy(struct clip_store *cs);
@@ -169,9 +244,20 @@ int _must_use_ _nonnull_ cs_content_get(struct clip_store *cs, uint64_t hash,
 int _must_use_ _nonnull_n_(1)
     cs_add(struct clip_store *cs, const char *content, uint64_t *out_hash,
            enum cs_dupe_policy dupe_policy);
+int _must_use_ _nonnull_ cs_add_fd(struct clip_store *cs, uint64_t hash,
+                                   const char *line, uint64_t nr_lines, int fd,
+                                   size_t size,
+                                   enum cs_dupe_policy dupe_policy);
 bool _must_use_ _nonnull_ cs_snip_iter(struct ref_guard *guard,
                                        enum cs_iter_direction direction,
                                        struct cs_snip **snip);
+struct cs_snip _must_use_ _nonnull_ *
+cs_snip_at(struct ref_guard *guard, enum cs_iter_direction direction,
+           size_t index);
+int _must_use_ _nonnull_ cs_snip_range(struct ref_guard *guard,
+                                       enum cs_iter_direction direction,
+                                       size_t start, size_t count,
+                                       struct cs_snip_view *view);
 int _must_use_ _nonnull_ cs_remove(
     struct clip_store *cs, enum cs_iter_direction direction,
     enum cs_remove_action (*should_remove)(uint64_t, const char *, void *),
@@ -183,6 +269,11 @@ int _must_use_ _nonnull_n_(1, 4)
     cs_replace(struct clip_store *cs, enum cs_iter_direction direction,
                size_t age, const char *content, uint64_t *out_hash);
 int _nonnull_ cs_len(struct clip_store *cs, size_t *out_len);
+uint64_t _must_use_ _nonnull_ cs_generation(struct clip_store *cs);
+int _must_use_ _nonnull_ cs_changes(struct ref_guard *guard, uint64_t since,
+                                    struct cs_event *events, size_t *nr_events);
+int _must_use_ _nonnull_ cs_wait(struct clip_store *cs, uint64_t since,
+                                 int timeout_ms);
 
 size_t _nonnull_ first_line(const char *text, char *out);
 
@@ -0,0 +1,251 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "trace.h"
+
+/**
+ * The intervals between stages that we keep histograms for.
+ */
+enum trace_span {
+    SPAN_OWNER_CHECK,
+    SPAN_CONVERT,
+    SPAN_INCR,
+    SPAN_QUEUE,
+    SPAN_STORE,
+    SPAN_SERVE,
+    SPAN_TOTAL,
+    SPAN_MAX
+};
+
+static const struct {
+    const char *name;
+    enum trace_stage from;
+    enum trace_stage to;
+} spans[SPAN_MAX] = {
+    [SPAN_OWNER_CHECK] = {"owner_check", TRACE_NOTIFY, TRACE_CONVERT},
+    [SPAN_CONVERT] = {"convert", TRACE_CONVERT, TRACE_PROPERTY},
+    [SPAN_INCR] = {"incr", TRACE_PROPERTY, TRACE_INCR_CHUNK},
+    [SPAN_QUEUE] = {"queue", TRACE_QUEUED, TRACE_DEQUEUED},
+    [SPAN_STORE] = {"store", TRACE_DEQUEUED, TRACE_COMMITTED},
+    [SPAN_SERVE] = {"serve", TRACE_COMMITTED, TRACE_OWNED},
+    [SPAN_TOTAL] = {"total", TRACE_NOTIFY, TRACE_COMMITTED},
+};
+
+#define SIZE_BUCKET_MAX 4
+
+static const struct {
+    const char *name;
+    size_t limit;
+} size_buckets[SIZE_BUCKET_MAX] = {
+    {"1K", 1024},
+    {"64K", 64 * 1024},
+    {"1M", 1024 * 1024},
+    {"inf", SIZE_MAX},
+};
+
+/**
+ * Log-linear histogram buckets in the style of HdrHistogram: each power of two
+ * is split into HIST_SUB_COUNT linear sub-buckets, giving a worst case
+ * relative error of 1/HIST_SUB_COUNT. Values are in microseconds, and are
+ * clamped at 2^HIST_MAX_BITS (about 19 hours).
+ */
+#define HIST_SUB_BITS 3
+#define HIST_SUB_COUNT (1U << HIST_SUB_BITS)
+#define HIST_MAX_BITS 36
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+/**
+ * A latency histogram.
+ *
+ * @counts: Number of samples in each bucket
+ * @nr: Total number of samples
+ * @max_us: Largest sample seen, unclamped
+ */
+struct latency_hist {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t nr;
+    uint64_t max_us;
+};
+
+static struct latency_hist hists[SPAN_MAX][CM_SEL_MAX][SIZE_BUCKET_MAX];
+static struct clip_trace pending_owner[CM_SEL_MAX];
+static bool pending_owner_set[CM_SEL_MAX];
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t hist_bucket(uint64_t us) {
+    if (us >= (1ULL << HIST_MAX_BITS)) {
+        us = (1ULL << HIST_MAX_BITS) - 1;
+    }
+    if (us < HIST_SUB_COUNT) {
+        return (size_t)us;
+    }
+    unsigned int msb = 63 - (unsigned int)__builtin_clzll(us);
+    unsigned int shift = msb - HIST_SUB_BITS;
+    return ((size_t)(shift + 1) << HIST_SUB_BITS) +
+           (size_t)((us >> shift) & (HIST_SUB_COUNT - 1));
+}
+
+/**
+ * Get the largest value which would be counted in the given bucket.
+ */
+static uint64_t hist_bucket_max(size_t bucket) {
+    if (bucket < HIST_SUB_COUNT) {
+        return bucket;
+    }
+    unsigned int shift = (unsigned int)(bucket >> HIST_SUB_BITS) - 1;
+    uint64_t mantissa = (bucket & (HIST_SUB_COUNT - 1)) | HIST_SUB_COUNT;
+    return (mantissa << shift) + (1ULL << shift) - 1;
+}
+
+static void hist_add(struct latency_hist *h, uint64_t us) {
+    h->counts[hist_bucket(us)]++;
+    h->nr++;
+    if (us > h->max_us) {
+        h->max_us = us;
+    }
+}
+
+/**
+ * Get the value at the given percentile, which is accurate to within the
+ * bucket resolution.
+ */
+static uint64_t hist_percentile(const struct latency_hist *h, double pct) {
+    uint64_t target = (uint64_t)((double)h->nr * pct / 100.0 + 0.5);
+    uint64_t seen = 0;
+    if (target == 0) {
+        target = 1;
+    }
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target) {
+            uint64_t val = hist_bucket_max(i);
+            return val < h->max_us ? val : h->max_us;
+        }
+    }
+    return h->max_us;
+}
+
+static size_t size_bucket(size_t size) {
+    size_t i = 0;
+    while (size >= size_buckets[i].limit && i < SIZE_BUCKET_MAX - 1) {
+        i++;
+    }
+    return i;
+}
+
+static void record_span_locked(const struct clip_trace *t,
+                               enum trace_span span) {
+    uint64_t from = t->ts_ns[spans[span].from];
+    uint64_t to = t->ts_ns[spans[span].to];
+    if (!from || !to || to < from || t->sel >= CM_SEL_MAX) {
+        return;
+    }
+    hist_add(&hists[span][t->sel][size_bucket(t->size)], (to - from) / 1000);
+}
+
+/**
+ * Start tracing a new clip from the given selection.
+ */
+void trace_start(struct clip_trace *t, enum selection_type sel) {
+    *t = (struct clip_trace){.sel = sel};
+}
+
+/**
+ * Record that the clip has reached a stage now.
+ */
+void trace_stamp(struct clip_trace *t, enum trace_stage stage) {
+    expect(stage < TRACE_STAGE_MAX);
+    t->ts_ns[stage] = monotonic_ns();
+}
+
+/**
+ * Add all completed spans of a committed clip to the histograms.
+ */
+void trace_record(const struct clip_trace *t) {
+    expect(pthread_mutex_lock(&trace_lock) == 0);
+    for (size_t i = 0; i < SPAN_MAX; i++) {
+        if (i != SPAN_SERVE) {
+            record_span_locked(t, (enum trace_span)i);
+        }
+    }
+    expect(pthread_mutex_unlock(&trace_lock) == 0);
+}
+
+/**
+ * Remember a committed clip which clipserve is about to serve, so that we can
+ * measure how long it takes to own the selection. See trace_owned().
+ */
+void trace_await_owner(const struct clip_trace *t) {
+    if (t->sel >= CM_SEL_MAX) {
+        return;
+    }
+    expect(pthread_mutex_lock(&trace_lock) == 0);
+    pending_owner[t->sel] = *t;
+    pending_owner_set[t->sel] = true;
+    expect(pthread_mutex_unlock(&trace_lock) == 0);
+}
+
+/**
+ * Called when we see clipserve take ownership of a selection.
+ */
+void trace_owned(enum selection_type sel) {
+    if (sel >= CM_SEL_MAX) {
+        return;
+    }
+    expect(pthread_mutex_lock(&trace_lock) == 0);
+    if (pending_owner_set[sel]) {
+        trace_stamp(&pending_owner[sel], TRACE_OWNED);
+        record_span_locked(&pending_owner[sel], SPAN_SERVE);
+        pending_owner_set[sel] = false;
+    }
+    expect(pthread_mutex_unlock(&trace_lock) == 0);
+}
+
+/**
+ * Write the latency histograms to the given path as text, one line per
+ * (span, selection, size) with any samples. The file is replaced atomically,
+ * so readers always see a consistent snapshot.
+ */
+int trace_export(const char *path, const struct config *cfg) {
+    char tmp_path[PATH_MAX];
+    snprintf_safe(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    _drop_(fclose) FILE *file = fopen(tmp_path, "w");
+    if (!file) {
+        return negative_errno();
+    }
+
+    fprintf(file, "# span selection size count p50_us p90_us p99_us p999_us "
+                  "max_us\n");
+
+    expect(pthread_mutex_lock(&trace_lock) == 0);
+    for (size_t span = 0; span < SPAN_MAX; span++) {
+        for (size_t sel = 0; sel < CM_SEL_MAX; sel++) {
+            for (size_t sz = 0; sz < SIZE_BUCKET_MAX; sz++) {
+                const struct latency_hist *h = &hists[span][sel][sz];
+                if (h->nr == 0) {
+                    continue;
+                }
+                fprintf(file,
+                        "%s %s %s %" PRIu64 " %" PRIu64 " %" PRIu64
+                        " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+                        spans[span].name, cfg->selections[sel].name,
+                        size_buckets[sz].name, h->nr, hist_percentile(h, 50),
+                        hist_percentile(h, 90), hist_percentile(h, 99),
+                        hist_percentile(h, 99.9), h->max_us);
+            }
+        }
+    }
+    expect(pthread_mutex_unlock(&trace_lock) == 0);
+
+    if (fflush(file) != 0 || ferror(file)) {
+        return negative_errno();
+    }
+    if (rename(tmp_path, path) < 0) {
+        return negative_errno();
+    }
+    return 0;
+}
@@ -0,0 +1,60 @@
+#ifndef CM_TRACE_H
+#define CM_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "util.h"
+
+/**
+ * The stages a clip passes through on its way into the clip store.
+ *
+ * @TRACE_NOTIFY: XFixesSelectionNotify received for the selection
+ * @TRACE_CONVERT: XConvertSelection() issued
+ * @TRACE_PROPERTY: First PropertyNotify received for the converted data
+ * @TRACE_INCR_CHUNK: Most recent INCR chunk received
+ * @TRACE_QUEUED: Handed over to the storage worker
+ * @TRACE_DEQUEUED: Picked up by the storage worker
+ * @TRACE_COMMITTED: cs_add() or cs_replace() completed
+ * @TRACE_OWNED: clipserve took ownership of the selection
+ */
+enum trace_stage {
+    TRACE_NOTIFY,
+    TRACE_CONVERT,
+    TRACE_PROPERTY,
+    TRACE_INCR_CHUNK,
+    TRACE_QUEUED,
+    TRACE_DEQUEUED,
+    TRACE_COMMITTED,
+    TRACE_OWNED,
+    TRACE_STAGE_MAX
+};
+
+/**
+ * Timestamps for a single clip. A timestamp of 0 means that the clip did not
+ * pass through that stage.
+ *
+ * @ts_ns: CLOCK_MONOTONIC timestamp for each stage
+ * @sel: The selection the clip came from
+ * @size: The size of the clip in bytes
+ * @nr_chunks: The number of INCR chunks received, or 0 if not INCR
+ * @round_trips: Blocking X requests made while receiving the clip
+ */
+struct clip_trace {
+    uint64_t ts_ns[TRACE_STAGE_MAX];
+    enum selection_type sel;
+    size_t size;
+    size_t nr_chunks;
+    uint64_t round_trips;
+};
+
+void _nonnull_ trace_start(struct clip_trace *t, enum selection_type sel);
+void _nonnull_ trace_stamp(struct clip_trace *t, enum trace_stage stage);
+void _nonnull_ trace_record(const struct clip_trace *t);
+void _nonnull_ trace_await_owner(const struct clip_trace *t);
+void trace_owned(enum selection_type sel);
+int _must_use_ _nonnull_ trace_export(const char *path,
+                                      const struct config *cfg);
+
+#endif
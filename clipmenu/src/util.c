@@ -1,7 +1,14 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <string.h>
+#include <sys/sendfile.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "store.h"
 #include "util.h"
@@ -66,6 +73,12 @@ void run_clipserve(uint64_t hash) {
         return;
     }
 
+    // The caller may block signals to read them from a signalfd, and exec
+    // keeps the mask, which would leave clipserve immune to SIGTERM
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+
     execvp(cmd[0], (char *const *)cmd);
     die("Failed to exec %s: %s\n", cmd[0], strerror(errno));
 }
@@ -131,3 +144,108 @@ bool debug_mode_enabled(void) {
     }
     return debug_enabled;
 }
+
+/**
+ * Get the current CLOCK_MONOTONIC time in nanoseconds, for measuring
+ * latencies.
+ */
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    expect(clock_gettime(CLOCK_MONOTONIC, &ts) == 0);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Copy count bytes from the current offset of in_fd to out_fd without going
+ * through userspace. copy_file_range() lets the filesystem share or offload
+ * the copy, and sendfile() covers the cases it doesn't, like out_fd being a
+ * pipe or the files being on different filesystems on older kernels. If in_fd
+ * is a pipe, only splice() can move the data, and if neither side is a file
+ * nor a pipe we fall back to copying through a buffer.
+ *
+ * Returns 0 on success, -ENODATA if in_fd ended early, or a negative errno.
+ */
+int copy_fd(int in_fd, int out_fd, size_t count) {
+    enum { COPY_CFR, COPY_SENDFILE, COPY_SPLICE, COPY_BUFFER } how = COPY_CFR;
+    char buf[65536];
+
+    while (count > 0) {
+        ssize_t copied = -1;
+        switch (how) {
+            case COPY_CFR:
+                copied = copy_file_range(in_fd, NULL, out_fd, NULL, count, 0);
+                break;
+            case COPY_SENDFILE:
+                copied = sendfile(out_fd, in_fd, NULL, count);
+                break;
+            case COPY_SPLICE:
+                copied =
+                    splice(in_fd, NULL, out_fd, NULL, count, SPLICE_F_MOVE);
+                break;
+            case COPY_BUFFER:
+                copied = read(in_fd, buf, count < sizeof(buf) ? count
+                                                              : sizeof(buf));
+                if (copied > 0) {
+                    ssize_t written = 0;
+                    while (written < copied) {
+                        ssize_t ret = write(out_fd, buf + written,
+                                            (size_t)(copied - written));
+                        if (ret < 0 && errno != EINTR) {
+                            return negative_errno();
+                        }
+                        written += ret > 0 ? ret : 0;
+                    }
+                }
+                break;
+        }
+        if (copied < 0 && how != COPY_BUFFER &&
+            (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+             errno == EOPNOTSUPP || errno == EBADF)) {
+            how++;
+            continue;
+        }
+        if (copied < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return negative_errno();
+        }
+        if (copied == 0) {
+            return -ENODATA;
+        }
+        count -= (size_t)copied;
+    }
+
+    return 0;
+}
+
+/**
+ * Discard count bytes from the current offset of fd. Files are just seeked
+ * past, anything else is read and thrown away.
+ *
+ * Returns 0 on success, -ENODATA if fd ended early, or a negative errno.
+ */
+int skip_fd(int fd, size_t count) {
+    if (count <= INT64_MAX && lseek(fd, (off_t)count, SEEK_CUR) >= 0) {
+        return 0;
+    }
+    if (errno != ESPIPE) {
+        return negative_errno();
+    }
+
+    char buf[65536];
+    while (count > 0) {
+        ssize_t ret = read(fd, buf, count < sizeof(buf) ? count : sizeof(buf));
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return negative_errno();
+        }
+        if (ret == 0) {
+            return -ENODATA;
+        }
+        count -= (size_t)ret;
+    }
+    return 0;
+}
@@ -102,5 +102,8 @@ int _must_use_ negative_errno(void);
 int _nonnull_ str_to_uint64(const char *input, uint64_t *output);
 int _nonnull_ str_to_hex64(const char *input, uint64_t *output);
 bool debug_mode_enabled(void);
+uint64_t monotonic_ns(void);
+int _must_use_ copy_fd(int in_fd, int out_fd, size_t count);
+int _must_use_ skip_fd(int fd, size_t count);
 
 #endif
@@ -1,31 +1,87 @@
 #include <X11/Xatom.h>
+#include <X11/Xlib-xcb.h>
 #include <X11/Xproto.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "x.h"
 
+uint64_t nr_x_round_trips;
+
+static const char *const atom_names[X_ATOM_MAX] = {
+    [X_ATOM_NET_WM_NAME] = "_NET_WM_NAME",
+    [X_ATOM_UTF8_STRING] = "UTF8_STRING",
+    [X_ATOM_INCR] = "INCR",
+    [X_ATOM_TARGETS] = "TARGETS",
+    [X_ATOM_CLIPBOARD] = "CLIPBOARD",
+    [X_ATOM_MULTIPLE] = "MULTIPLE",
+    [X_ATOM_TIMESTAMP] = "TIMESTAMP",
+    [X_ATOM_ATOM_PAIR] = "ATOM_PAIR",
+    [X_ATOM_TEXT] = "TEXT",
+    [X_ATOM_TEXT_PLAIN_UTF8] = "text/plain;charset=utf-8",
+};
+
 /**
- * Fetch the title of the window with the specified window ID.
+ * Get an interned atom from the cache. The first call for a given Display
+ * interns all of the atoms in atom_names in a single round trip.
+ */
+Atom get_atom(Display *dpy, enum x_atom atom) {
+    static Display *atoms_dpy;
+    static Atom atoms[X_ATOM_MAX];
+
+    expect(atom < X_ATOM_MAX);
+
+    if (atoms_dpy != dpy) {
+        expect(X_ROUND_TRIP(XInternAtoms(dpy, (char **)atom_names,
+                                         X_ATOM_MAX, False, atoms)) != 0);
+        atoms_dpy = dpy;
+    }
+
+    return atoms[atom];
+}
+
+/**
+ * Fetch the title of the window with the specified window ID, or NULL if it
+ * has none. The returned string must be freed with free().
+ *
+ * Both _NET_WM_NAME and WM_NAME are requested up front through XCB, so this
+ * costs one round trip even when we have to fall back to WM_NAME.
  */
 char *get_window_title(Display *dpy, Window owner) {
-    Atom props[] = {XInternAtom(dpy, "_NET_WM_NAME", False), XA_WM_NAME};
-    Atom utf8_string = XInternAtom(dpy, "UTF8_STRING", False);
-    Atom actual_type;
-    int format;
-    unsigned long nr_items, bytes_after;
-    unsigned char *prop = NULL;
+    xcb_connection_t *conn = XGetXCBConnection(dpy);
+    Atom props[] = {get_atom(dpy, X_ATOM_NET_WM_NAME), XA_WM_NAME};
+    Atom types[] = {get_atom(dpy, X_ATOM_UTF8_STRING), AnyPropertyType};
+    xcb_get_property_cookie_t cookies[arrlen(props)];
+    char *title = NULL;
+
+    for (size_t i = 0; i < arrlen(props); i++) {
+        cookies[i] = xcb_get_property(conn, 0, (xcb_window_t)owner,
+                                      (xcb_atom_t)props[i],
+                                      (xcb_atom_t)types[i], 0, UINT32_MAX);
+    }
 
+    nr_x_round_trips++;
     for (size_t i = 0; i < arrlen(props); i++) {
-        if (XGetWindowProperty(dpy, owner, props[i], 0, (~0L), False,
-                               (props[i] == XA_WM_NAME) ? AnyPropertyType
-                                                        : utf8_string,
-                               &actual_type, &format, &nr_items, &bytes_after,
-                               &prop) == Success &&
-            prop) {
-            return (char *)prop;
+        if (title) {
+            xcb_discard_reply(conn, cookies[i].sequence);
+            continue;
+        }
+
+        xcb_generic_error_t *err = NULL;
+        xcb_get_property_reply_t *reply =
+            xcb_get_property_reply(conn, cookies[i], &err);
+        free(err);
+        if (reply && reply->type != XCB_ATOM_NONE) {
+            size_t len = (size_t)xcb_get_property_value_length(reply);
+            title = malloc(len + 1);
+            expect(title);
+            memcpy(title, xcb_get_property_value(reply), len);
+            title[len] = '\0';
         }
+        free(reply);
     }
-    return NULL;
+    return title;
 }
 
 /**
@@ -56,6 +112,18 @@ int xerror_handler(Display *dpy _unused_, XErrorEvent *ee) {
 
 #define FALLBACK_CHUNK_BYTES 4 * 1024
 
+/**
+ * Get the maximum request size in bytes, preferring the BIG-REQUESTS limit.
+ */
+static size_t get_max_request_bytes(Display *dpy) {
+    size_t max_req = XExtendedMaxRequestSize(dpy);
+    if (max_req == 0) {
+        max_req = XMaxRequestSize(dpy);
+    }
+    // Units are 4-byte words
+    return max_req * 4;
+}
+
 /**
  * Calculate and cache an appropriate INCR chunk size.
  *
@@ -64,36 +132,73 @@ int xerror_handler(Display *dpy _unused_, XErrorEvent *ee) {
  * practice.
  */
 size_t get_chunk_size(Display *dpy) {
-    // Units are 4-byte words, so this is 1/4 in bytes
-    size_t chunk_size = XExtendedMaxRequestSize(dpy);
-    if (chunk_size == 0) {
-        chunk_size = XMaxRequestSize(dpy);
+    size_t max_bytes = get_max_request_bytes(dpy);
+    return max_bytes ? max_bytes / 16 : FALLBACK_CHUNK_BYTES;
+}
+
+/**
+ * The largest chunk which still fits in a single ChangeProperty request. Used
+ * as the upper bound when adapting the chunk size to a fast requestor.
+ */
+size_t get_max_chunk_size(Display *dpy) {
+    size_t max_bytes = get_max_request_bytes(dpy);
+    // Leave room for the request header, including the BIG-REQUESTS length
+    size_t overhead = sz_xChangePropertyReq + 4;
+    if (max_bytes <= overhead + FALLBACK_CHUNK_BYTES) {
+        return get_chunk_size(dpy);
     }
-    return chunk_size ? chunk_size / 4 : FALLBACK_CHUNK_BYTES;
+    return (max_bytes - overhead) & ~(size_t)3;
 }
 
+static struct incr_transfer **it_bucket(struct it_table *table,
+                                        Window requestor, Atom property) {
+    uint64_t key = ((uint64_t)requestor << 32) ^ (uint64_t)property;
+    key *= 0x9E3779B97F4A7C15ULL; // Fibonacci hashing
+    return &table->buckets[key >> 58];
+}
+static_assert(IT_TABLE_SIZE == 64, "it_bucket() assumes 6 bits of hash");
+
 /**
- * Add a new INCR transfer to the active list.
+ * Add a new INCR transfer to the active table.
  */
-void it_add(struct incr_transfer **it_list, struct incr_transfer *it) {
-    if (*it_list) {
-        (*it_list)->prev = it;
+void it_add(struct it_table *table, struct incr_transfer *it) {
+    struct incr_transfer **head = it_bucket(table, it->requestor, it->property);
+    if (*head) {
+        (*head)->prev = it;
     }
-    it->next = *it_list;
+    it->next = *head;
     it->prev = NULL;
-    *it_list = it;
+    *head = it;
+    table->nr++;
 }
+
 /**
- * Remove an INCR transfer from the active list.
+ * Remove an INCR transfer from the active table.
  */
-void it_remove(struct incr_transfer **it_list, struct incr_transfer *it) {
+void it_remove(struct it_table *table, struct incr_transfer *it) {
+    struct incr_transfer **head = it_bucket(table, it->requestor, it->property);
     if (it->prev) {
         it->prev->next = it->next;
     }
     if (it->next) {
         it->next->prev = it->prev;
     }
-    if (*it_list == it) {
-        *it_list = it->next;
+    if (*head == it) {
+        *head = it->next;
+    }
+    expect(table->nr > 0);
+    table->nr--;
+}
+
+/**
+ * Find the INCR transfer for a requestor window and property, or NULL if there
+ * is none.
+ */
+struct incr_transfer *it_find(struct it_table *table, Window requestor,
+                              Atom property) {
+    struct incr_transfer *it = *it_bucket(table, requestor, property);
+    while (it && (it->requestor != requestor || it->property != property)) {
+        it = it->next;
     }
+    return it;
 }
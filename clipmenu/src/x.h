@@ -7,10 +7,42 @@
 
 DEFINE_DROP_FUNC_VOID(XFree)
 
+/**
+ * Count of requests which block waiting for a reply from the X server, used to
+ * measure protocol overhead. Wrap any such call in X_ROUND_TRIP().
+ */
+extern uint64_t nr_x_round_trips;
+#define X_ROUND_TRIP(call) (nr_x_round_trips++, (call))
+
+/**
+ * Atoms which are used in hot paths, and are thus interned once per Display by
+ * get_atom() instead of being looked up with XInternAtom() each time.
+ */
+enum x_atom {
+    X_ATOM_NET_WM_NAME,
+    X_ATOM_UTF8_STRING,
+    X_ATOM_INCR,
+    X_ATOM_TARGETS,
+    X_ATOM_CLIPBOARD,
+    X_ATOM_MULTIPLE,
+    X_ATOM_TIMESTAMP,
+    X_ATOM_ATOM_PAIR,
+    X_ATOM_TEXT,
+    X_ATOM_TEXT_PLAIN_UTF8,
+    X_ATOM_MAX
+};
+
+Atom _nonnull_ get_atom(Display *dpy, enum x_atom atom);
 size_t _nonnull_ get_chunk_size(Display *dpy);
+size_t _nonnull_ get_max_chunk_size(Display *dpy);
 char _nonnull_ *get_window_title(Display *dpy, Window owner);
 int xerror_handler(Display *dpy _unused_, XErrorEvent *ee);
 
+/**
+ * An INCR transfer in either direction.
+ *
+ * @next, @prev: Chain within the it_table bucket
+ */
 struct incr_transfer {
     struct incr_transfer *next;
     struct incr_transfer *prev;
@@ -24,10 +56,25 @@ struct incr_transfer {
     size_t offset;
 };
 
+#define IT_TABLE_SIZE 64
+
+/**
+ * Active INCR transfers, indexed by (requestor, property) so that lookups on
+ * each PropertyNotify don't depend on how many transfers are in flight.
+ *
+ * @buckets: Hash chains, linked through next/prev
+ * @nr: The number of transfers in the table
+ */
+struct it_table {
+    struct incr_transfer *buckets[IT_TABLE_SIZE];
+    size_t nr;
+};
+
 #define it_dbg(it, fmt, ...)                                                   \
     dbg("[incr 0x%lx] " fmt, (unsigned long)(it)->requestor, ##__VA_ARGS__)
-void _nonnull_ it_add(struct incr_transfer **it_list, struct incr_transfer *it);
-void _nonnull_ it_remove(struct incr_transfer **it_list,
-                         struct incr_transfer *it);
+void _nonnull_ it_add(struct it_table *table, struct incr_transfer *it);
+void _nonnull_ it_remove(struct it_table *table, struct incr_transfer *it);
+struct incr_transfer _nonnull_ *it_find(struct it_table *table,
+                                        Window requestor, Atom property);
 
 #endif
@@ -0,0 +1,233 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../src/persist.h"
+#include "../src/store.h"
+#include "../src/util.h"
+
+/**
+ * Benchmark for the persistent mirror. Measures what a copy costs with and
+ * without a mirror being committed in the background, and how long startup
+ * takes when warm loading a large history compared to adding every clip again.
+ *
+ * The clip store is kept in /dev/shm like the real one in XDG_RUNTIME_DIR. The
+ * mirror goes to -d, which should be on the disk being measured.
+ *
+ * Results are written to stdout as a JSON array.
+ */
+
+#define DEFAULT_NR_CLIPS 50000
+#define COMMIT_INTERVAL_US 100000
+
+static bool first_result = true;
+
+static void result_begin(const char *bench) {
+    printf("%s  {\"bench\": \"%s\"", first_result ? "" : ",\n", bench);
+    first_result = false;
+}
+
+static void result_end(void) { printf("}"); }
+
+static void result_u64(const char *key, uint64_t val) {
+    printf(", \"%s\": %" PRIu64, key, val);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * A clip store in a fresh directory under /dev/shm.
+ */
+struct bench_store {
+    char dir[PATH_MAX];
+    char snip_path[PATH_MAX];
+    int snip_fd;
+    int content_dir_fd;
+    struct clip_store cs;
+};
+
+static void bench_store_open(struct bench_store *bs) {
+    snprintf_safe(bs->dir, sizeof(bs->dir), "/dev/shm/cm_store_bench.XXXXXX");
+    die_on(!mkdtemp(bs->dir), "mkdtemp: %s\n", strerror(errno));
+    snprintf_safe(bs->snip_path, sizeof(bs->snip_path), "%s/line_cache",
+                  bs->dir);
+    bs->snip_fd = open(bs->snip_path, O_RDWR | O_CREAT, 0600);
+    bs->content_dir_fd = open(bs->dir, O_RDONLY);
+    expect(bs->snip_fd >= 0 && bs->content_dir_fd >= 0);
+}
+
+static void remove_tree(const char *path) {
+    char cmd[PATH_MAX + 16];
+    snprintf_safe(cmd, sizeof(cmd), "rm -rf '%s'", path);
+    expect(system(cmd) == 0);
+}
+
+static void bench_store_close(struct bench_store *bs) {
+    expect(cs_destroy(&bs->cs) == 0);
+    close(bs->snip_fd);
+    close(bs->content_dir_fd);
+    remove_tree(bs->dir);
+}
+
+static void make_clip(char *buf, size_t size, size_t i) {
+    snprintf_safe(buf, size, "clip %zu\nwith a second line to look real", i);
+}
+
+static struct persist persist;
+static bool committer_stopping;
+static uint64_t nr_commits, commit_max_ns;
+
+/**
+ * Commit the mirror periodically, like clipmenud's persist worker.
+ */
+static void *committer(void *arg _unused_) {
+    while (!__atomic_load_n(&committer_stopping, __ATOMIC_ACQUIRE)) {
+        usleep(COMMIT_INTERVAL_US);
+        uint64_t start = monotonic_ns();
+        expect(persist_commit(&persist) == 0);
+        uint64_t elapsed = monotonic_ns() - start;
+        nr_commits++;
+        if (elapsed > commit_max_ns) {
+            commit_max_ns = elapsed;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Add nr_clips clips, recording the latency of each cs_add(). If persist_dir
+ * is set, a mirror is committed in the background meanwhile.
+ */
+static void bench_add(size_t nr_clips, const char *persist_dir) {
+    struct bench_store bs;
+    bench_store_open(&bs);
+    expect(cs_init(&bs.cs, bs.snip_fd, bs.content_dir_fd) == 0);
+
+    pthread_t thread;
+    if (persist_dir) {
+        int mirror_snip_fd = open(bs.snip_path, O_RDONLY);
+        expect(mirror_snip_fd >= 0);
+        expect(persist_init(&persist, persist_dir, mirror_snip_fd,
+                            bs.content_dir_fd) == 0);
+        committer_stopping = false;
+        nr_commits = commit_max_ns = 0;
+        expect(pthread_create(&thread, NULL, committer, NULL) == 0);
+    }
+
+    uint64_t *lat = malloc(nr_clips * sizeof(*lat));
+    expect(lat);
+    for (size_t i = 0; i < nr_clips; i++) {
+        char clip[128];
+        make_clip(clip, sizeof(clip), i);
+        uint64_t start = monotonic_ns();
+        expect(cs_add(&bs.cs, clip, NULL, CS_DUPE_KEEP_ALL) == 0);
+        lat[i] = monotonic_ns() - start;
+    }
+
+    uint64_t final_commit_ns = 0;
+    if (persist_dir) {
+        __atomic_store_n(&committer_stopping, true, __ATOMIC_RELEASE);
+        expect(pthread_join(thread, NULL) == 0);
+        uint64_t start = monotonic_ns();
+        expect(persist_commit(&persist) == 0);
+        final_commit_ns = monotonic_ns() - start;
+        int mirror_snip_fd = persist.cs.snip_fd;
+        persist_destroy(&persist);
+        close(mirror_snip_fd);
+    }
+
+    qsort(lat, nr_clips, sizeof(*lat), cmp_u64);
+    result_begin(persist_dir ? "add_with_persist" : "add");
+    result_u64("clips", nr_clips);
+    result_u64("p50_ns", lat[nr_clips / 2]);
+    result_u64("p99_ns", lat[nr_clips * 99 / 100]);
+    result_u64("max_ns", lat[nr_clips - 1]);
+    if (persist_dir) {
+        result_u64("commits", nr_commits);
+        result_u64("commit_max_ns", commit_max_ns);
+        result_u64("final_commit_ns", final_commit_ns);
+    }
+    result_end();
+
+    free(lat);
+    bench_store_close(&bs);
+}
+
+/**
+ * Time bringing up a clip store with nr_clips clips: by warm loading it from
+ * the mirror at persist_dir, and by adding each clip again.
+ */
+static void bench_startup(size_t nr_clips, const char *persist_dir) {
+    struct bench_store bs;
+    bench_store_open(&bs);
+    uint64_t start = monotonic_ns();
+    expect(persist_restore(persist_dir, bs.snip_fd, bs.content_dir_fd) == 0);
+    expect(cs_init(&bs.cs, bs.snip_fd, bs.content_dir_fd) == 0);
+    uint64_t restore_ns = monotonic_ns() - start;
+    size_t nr_restored = bs.cs.header->nr_snips;
+    bench_store_close(&bs);
+
+    bench_store_open(&bs);
+    start = monotonic_ns();
+    expect(cs_init(&bs.cs, bs.snip_fd, bs.content_dir_fd) == 0);
+    for (size_t i = 0; i < nr_clips; i++) {
+        char clip[128];
+        make_clip(clip, sizeof(clip), i);
+        expect(cs_add(&bs.cs, clip, NULL, CS_DUPE_KEEP_ALL) == 0);
+    }
+    uint64_t readd_ns = monotonic_ns() - start;
+    bench_store_close(&bs);
+
+    result_begin("startup");
+    result_u64("clips", nr_restored);
+    result_u64("restore_ns", restore_ns);
+    result_u64("readd_ns", readd_ns);
+    result_end();
+}
+
+int main(int argc, char *argv[]) {
+    size_t nr_clips = DEFAULT_NR_CLIPS;
+    char persist_dir[PATH_MAX] = "";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:d:")) != -1) {
+        switch (opt) {
+            case 'n':
+                nr_clips = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                snprintf_safe(persist_dir, sizeof(persist_dir), "%s/mirror",
+                              optarg);
+                break;
+            default:
+                die("Usage: %s [-n clips] [-d dir]\n", argv[0]);
+        }
+    }
+    die_on(nr_clips == 0, "Need at least one clip\n");
+
+    if (!*persist_dir) {
+        snprintf_safe(persist_dir, sizeof(persist_dir),
+                      "/var/tmp/cm_persist_bench.XXXXXX");
+        die_on(!mkdtemp(persist_dir), "mkdtemp: %s\n", strerror(errno));
+    }
+
+    printf("[\n");
+    bench_add(nr_clips, NULL);
+    bench_add(nr_clips, persist_dir);
+    bench_startup(nr_clips, persist_dir);
+    printf("\n]\n");
+
+    remove_tree(persist_dir);
+    return 0;
+}
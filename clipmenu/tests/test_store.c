@@ -5,15 +5,23 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include "../src/export.h"
+#include "../src/fuzzy.h"
+#include "../src/menu.h"
+#include "../src/persist.h"
+#include "../src/picker.h"
 #include "../src/store.h"
 #include "../src/util.h"
 
@@ -44,6 +52,12 @@
 
 #define TEST_SNIP_FILE "/clip_store_snip_test"
 #define TEST_CONTENT_DIR "/dev/shm/clip_store_content_dir_test"
+#define TEST_MENU_FILE "/dev/shm/clip_store_menu_test"
+#define TEST_PERSIST_DIR "/dev/shm/clip_store_persist_test"
+#define TEST_RESTORE_SNIP_FILE "/clip_store_snip_restore_test"
+#define TEST_RESTORE_CONTENT_DIR "/dev/shm/clip_store_content_restore_test"
+#define TEST_EXPORT_FILE "/dev/shm/clip_store_export_test"
+#define TEST_BIN_DIR "/dev/shm/clip_store_bin_test"
 
 static int create_test_snip_fd(void) {
     shm_unlink(TEST_SNIP_FILE);
@@ -103,6 +117,17 @@ static void remove_test_content_dir(const char *path) {
     drop_remove_test_content_dir_fd(&dir_fd);
 }
 
+static void remove_test_dir(const char *path) {
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0) {
+        assert(errno == ENOENT);
+        return;
+    }
+    _drop_remove_test_content_dir_fd(&dir_fd);
+    int ret = rmdir(path);
+    assert(ret == 0);
+}
+
 static int create_test_content_dir_fd(void) {
     remove_test_content_dir(TEST_CONTENT_DIR);
     int ret = mkdir(TEST_CONTENT_DIR, 0700);
@@ -649,6 +674,796 @@ static bool test__cs_add__dupe_keep_last_with_multiple_entries(void) {
     return true;
 }
 
+static bool test__cs_init_readonly(void) {
+    _drop_(teardown_test) struct clip_store cs = setup_test();
+    add_ten_snips(&cs);
+
+    _drop_(close) int ro_fd = shm_open(TEST_SNIP_FILE, O_RDONLY, 0);
+    t_assert(ro_fd >= 0);
+    struct clip_store ro_cs;
+    t_assert(cs_init_readonly(&ro_cs, ro_fd, cs.content_dir_fd) == 0);
+    t_assert(ro_cs.header->nr_snips == 10);
+
+    {
+        _drop_(cs_unref) struct ref_guard guard = cs_ref(&ro_cs);
+        t_assert(guard.status == 0);
+        struct cs_snip *snip = NULL;
+        t_assert(cs_snip_iter(&guard, CS_ITER_NEWEST_FIRST, &snip));
+        t_assert(streq(snip->line, "9"));
+
+        _drop_(cs_content_unmap) struct cs_content content;
+        t_assert(cs_content_get(&ro_cs, snip->hash, &content) == 0);
+        t_assert(strncmp(content.data, "9", (size_t)content.size) == 0);
+    }
+
+    /* Nothing that would write is allowed */
+    size_t count = 10;
+    t_assert(cs_add(&ro_cs, "new", NULL, CS_DUPE_KEEP_ALL) == -EROFS);
+    t_assert(cs_remove(&ro_cs, CS_ITER_NEWEST_FIRST, remove_if_five,
+                       &count) == -EROFS);
+    t_assert(cs_trim(&ro_cs, CS_ITER_NEWEST_FIRST, 0) == -EROFS);
+    t_assert(cs_replace(&ro_cs, CS_ITER_NEWEST_FIRST, 0, "new", NULL) ==
+             -EROFS);
+    t_assert(ro_cs.header->nr_snips == 10);
+
+    t_assert(cs_destroy(&ro_cs) == 0);
+
+    return true;
+}
+
+static bool test__cs_init_readonly__empty(void) {
+    _drop_(remove_test_snip_fd) int snip_fd = create_test_snip_fd();
+    _drop_(remove_test_content_dir_fd) int content_dir_fd =
+        create_test_content_dir_fd();
+    _drop_(close) int ro_fd = shm_open(TEST_SNIP_FILE, O_RDONLY, 0);
+    t_assert(ro_fd >= 0);
+
+    struct clip_store cs;
+    t_assert(cs_init_readonly(&cs, ro_fd, content_dir_fd) == 0);
+    t_assert(cs.header->nr_snips == 0);
+
+    /* The file must not have been initialised by us */
+    struct stat st;
+    t_assert(fstat(snip_fd, &st) == 0);
+    t_assert(st.st_size == 0);
+
+    {
+        _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+        struct cs_snip *snip = NULL;
+        t_assert(!cs_snip_iter(&guard, CS_ITER_NEWEST_FIRST, &snip));
+    }
+
+    t_assert(cs_destroy(&cs) == 0);
+
+    return true;
+}
+
+static bool test__cs_init_readonly__sees_writer(void) {
+    _drop_(teardown_test) struct clip_store cs = setup_test();
+    _drop_(close) int ro_fd = shm_open(TEST_SNIP_FILE, O_RDONLY, 0);
+    t_assert(ro_fd >= 0);
+    _drop_(cs_destroy) struct clip_store ro_cs;
+    t_assert(cs_init_readonly(&ro_cs, ro_fd, cs.content_dir_fd) == 0);
+
+    /* Grow past an allocation batch so the reader has to remap */
+    bool all_added = true;
+    for (size_t i = 0; i < CS_SNIP_ALLOC_BATCH + 1; i++) {
+        all_added &= cs_add(&cs, "x", NULL, CS_DUPE_KEEP_ALL) == 0;
+    }
+    t_assert(all_added);
+
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(&ro_cs);
+    t_assert(guard.status == 0);
+    size_t nr = 0;
+    struct cs_snip *snip = NULL;
+    while (cs_snip_iter(&guard, CS_ITER_OLDEST_FIRST, &snip)) {
+        nr++;
+    }
+    t_assert(nr == CS_SNIP_ALLOC_BATCH + 1);
+
+    /* Readers only take a shared lock, so another reader isn't blocked */
+    _drop_(close) int other_fd = shm_open(TEST_SNIP_FILE, O_RDONLY, 0);
+    t_assert(other_fd >= 0);
+    t_assert(flock(other_fd, LOCK_SH | LOCK_NB) == 0);
+    t_assert(flock(other_fd, LOCK_EX | LOCK_NB) == -1);
+
+    return true;
+}
+
+static bool test__cs_snip_at(void) {
+    _drop_(teardown_test) struct clip_store cs = setup_test();
+    add_ten_snips(&cs);
+
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+    struct cs_snip *snip = cs_snip_at(&guard, CS_ITER_NEWEST_FIRST, 0);
+    t_assert(snip && streq(snip->line, "9"));
+    snip = cs_snip_at(&guard, CS_ITER_NEWEST_FIRST, 9);
+    t_assert(snip && streq(snip->line, "0"));
+    snip = cs_snip_at(&guard, CS_ITER_OLDEST_FIRST, 3);
+    t_assert(snip && streq(snip->line, "3"));
+    t_assert(!cs_snip_at(&guard, CS_ITER_NEWEST_FIRST, 10));
+    t_assert(!cs_snip_at(&guard, CS_ITER_OLDEST_FIRST, SIZE_MAX));
+
+    return true;
+}
+
+static bool test__cs_snip_range(void) {
+    _drop_(teardown_test) struct clip_store cs = setup_test();
+    add_ten_snips(&cs);
+
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+    struct cs_snip_view view;
+
+    t_assert(cs_snip_range(&guard, CS_ITER_NEWEST_FIRST, 2, 3, &view) == 0);
+    t_assert(view.nr == 3);
+    t_assert(streq(cs_snip_view_at(&view, 0)->line, "7"));
+    t_assert(streq(cs_snip_view_at(&view, 2)->line, "5"));
+    t_assert(view.snips == cs.snips + 5);
+
+    t_assert(cs_snip_range(&guard, CS_ITER_OLDEST_FIRST, 2, 3, &view) == 0);
+    t_assert(view.nr == 3);
+    t_assert(streq(cs_snip_view_at(&view, 0)->line, "2"));
+    t_assert(streq(cs_snip_view_at(&view, 2)->line, "4"));
+
+    /* Clamped to the end of the store */
+    t_assert(cs_snip_range(&guard, CS_ITER_NEWEST_FIRST, 8, 5, &view) == 0);
+    t_assert(view.nr == 2);
+    t_assert(streq(cs_snip_view_at(&view, 1)->line, "0"));
+    t_assert(cs_snip_range(&guard, CS_ITER_NEWEST_FIRST, 10, 5, &view) == 0);
+    t_assert(view.nr == 0);
+    t_assert(cs_snip_range(&guard, CS_ITER_NEWEST_FIRST, 11, 5, &view) ==
+             -ERANGE);
+
+    return true;
+}
+
+static bool test__menu_build_page(void) {
+    _drop_(teardown_test) struct clip_store cs = setup_test();
+    add_ten_snips(&cs);
+
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+    struct menu_buf buf = {0};
+    t_assert(menu_build_page(&guard, 4, 3, &buf) == 0);
+    _drop_(free) char *data = buf.data;
+
+    struct menu_view menu;
+    menu_view_from_buf(&buf, &menu);
+    t_assert(menu.header.nr_snips == 10);
+    t_assert(menu.header.nr_entries == 3);
+    t_assert(menu.header.first_label == 4);
+    const char expected[] = "[ 6] 5\n[ 5] 4\n[ 4] 3\n";
+    t_assert(menu.header.text_size == strlen(expected));
+    t_assert(strncmp(menu.text, expected, strlen(expected)) == 0);
+
+    uint64_t hash;
+    t_assert(menu_lookup(&menu, 6, &hash) == 0);
+    t_assert(hash == cs.snips[5].hash);
+    t_assert(menu_lookup(&menu, 4, &hash) == 0);
+    t_assert(hash == cs.snips[3].hash);
+    t_assert(menu_lookup(&menu, 3, &hash) == -ERANGE);
+    t_assert(menu_lookup(&menu, 7, &hash) == -ERANGE);
+
+    return true;
+}
+
+static bool test__menu_build(void) {
+    _drop_(teardown_test) struct clip_store cs = setup_test();
+    add_ten_snips(&cs);
+    t_assert(cs_add(&cs, "multi\nline", NULL, CS_DUPE_KEEP_ALL) == 0);
+
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+    struct menu_buf buf = {0};
+    t_assert(menu_build(&guard, &buf) == 0);
+    _drop_(free) char *data = buf.data;
+
+    struct menu_view menu;
+    menu_view_from_buf(&buf, &menu);
+    t_assert(menu.header.nr_snips == 11);
+    const char expected_start[] = "[11] multi (2 lines)\n[10] 9\n[ 9] 8\n";
+    t_assert(strncmp(menu.text, expected_start, strlen(expected_start)) == 0);
+    t_assert(menu.text[menu.header.text_size - 1] == '\n');
+
+    uint64_t hash;
+    t_assert(menu_lookup(&menu, 11, &hash) == 0);
+    t_assert(hash == cs.snips[10].hash);
+    t_assert(menu_lookup(&menu, 1, &hash) == 0);
+    t_assert(hash == cs.snips[0].hash);
+    t_assert(menu_lookup(&menu, 0, &hash) == -ERANGE);
+    t_assert(menu_lookup(&menu, 12, &hash) == -ERANGE);
+
+    return true;
+}
+
+/**
+ * Check that clipmenud's live menu matches a fresh full render of the store.
+ */
+static bool menu_live_matches_build(struct clip_store *cs,
+                                    struct menu_live *live) {
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(cs);
+    t_assert(menu_live_update(&guard, live) == 0);
+
+    struct menu_buf buf = {0};
+    t_assert(menu_build(&guard, &buf) == 0);
+    _drop_(free) char *data = buf.data;
+    struct menu_view menu;
+    menu_view_from_buf(&buf, &menu);
+
+    t_assert(memcmp(&live->header, &menu.header, sizeof(live->header)) == 0);
+    t_assert(memcmp(live->hashes, menu.hashes,
+                    live->header.nr_entries * sizeof(uint64_t)) == 0);
+    t_assert(memcmp(live->text + live->text_capacity - live->header.text_size,
+                    menu.text, live->header.text_size) == 0);
+    return true;
+}
+
+static bool test__menu_live_update(void) {
+    _drop_(teardown_test) struct clip_store cs = setup_test();
+    struct menu_live live = {0};
+
+    for (char i = 0; i < 9; i++) {
+        char num[8];
+        snprintf(num, sizeof(num), "%d", i);
+        t_assert(cs_add(&cs, num, NULL, CS_DUPE_KEEP_ALL) == 0);
+    }
+    t_assert(menu_live_matches_build(&cs, &live));
+
+    /* Labels get wider */
+    t_assert(cs_add(&cs, "9", NULL, CS_DUPE_KEEP_ALL) == 0);
+    t_assert(menu_live_matches_build(&cs, &live));
+
+    /* Adds only render the new lines, so a marker in the oldest one stays */
+    char *oldest_end = live.text + live.text_capacity - 1;
+    *oldest_end = '!';
+    t_assert(cs_add(&cs, "multi\nline", NULL, CS_DUPE_KEEP_ALL) == 0);
+    t_assert(cs_add(&cs, "eleven", NULL, CS_DUPE_KEEP_ALL) == 0);
+    {
+        _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+        t_assert(menu_live_update(&guard, &live) == 0);
+    }
+    t_assert(live.text + live.text_capacity - 1 == oldest_end);
+    t_assert(*oldest_end == '!');
+    *oldest_end = '\n';
+    t_assert(menu_live_matches_build(&cs, &live));
+
+    t_assert(cs_replace(&cs, CS_ITER_NEWEST_FIRST, 0, "replaced", NULL) == 0);
+    t_assert(menu_live_matches_build(&cs, &live));
+    t_assert(cs_add(&cs, "1", NULL, CS_DUPE_KEEP_LAST) == 0);
+    t_assert(menu_live_matches_build(&cs, &live));
+    t_assert(cs_trim(&cs, CS_ITER_NEWEST_FIRST, 5) == 0);
+    t_assert(menu_live_matches_build(&cs, &live));
+
+    menu_live_free(&live);
+    return true;
+}
+
+/**
+ * Check that the menu file at TEST_MENU_FILE matches a fresh full render.
+ */
+static bool menu_file_matches_build(struct clip_store *cs) {
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(cs);
+    struct menu_buf buf = {0};
+    t_assert(menu_build(&guard, &buf) == 0);
+    _drop_(free) char *data = buf.data;
+    struct menu_view built;
+    menu_view_from_buf(&buf, &built);
+
+    _drop_(menu_close) struct menu_view menu;
+    t_assert(menu_open(TEST_MENU_FILE, &guard, &menu) == 0);
+    t_assert(menu.header.nr_entries == built.header.nr_entries);
+    t_assert(menu.header.text_size == built.header.text_size);
+    t_assert(memcmp(menu.hashes, built.hashes,
+                    menu.header.nr_entries * sizeof(uint64_t)) == 0);
+    t_assert(memcmp(menu.text, built.text, menu.header.text_size) == 0);
+    return true;
+}
+
+static bool test__menu_live_write(void) {
+    _drop_(teardown_test) struct clip_store cs = setup_test();
+    struct menu_live live = {0};
+    add_ten_snips(&cs);
+    {
+        _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+        t_assert(menu_live_update(&guard, &live) == 0);
+    }
+    t_assert(menu_live_write(&live, TEST_MENU_FILE) == 0);
+    t_assert(menu_file_matches_build(&cs));
+    struct stat before;
+    t_assert(stat(TEST_MENU_FILE, &before) == 0);
+
+    /* A reader which already has the menu open keeps seeing what it saw */
+    _drop_(menu_close) struct menu_view old;
+    {
+        _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+        t_assert(menu_open(TEST_MENU_FILE, &guard, &old) == 0);
+    }
+    _drop_(free) char *old_text = malloc(old.header.text_size);
+    t_assert(old_text);
+    memcpy(old_text, old.text, old.header.text_size);
+
+    /* Adds are written in place */
+    t_assert(cs_add(&cs, "new", NULL, CS_DUPE_KEEP_ALL) == 0);
+    {
+        _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+        t_assert(menu_live_update(&guard, &live) == 0);
+    }
+    t_assert(menu_live_write(&live, TEST_MENU_FILE) == 0);
+    t_assert(menu_file_matches_build(&cs));
+    struct stat after;
+    t_assert(stat(TEST_MENU_FILE, &after) == 0);
+    t_assert(after.st_ino == before.st_ino);
+
+    t_assert(old.header.nr_entries == 10);
+    t_assert(memcmp(old.text, old_text, old.header.text_size) == 0);
+    uint64_t hash;
+    t_assert(menu_lookup(&old, 10, &hash) == 0);
+    t_assert(hash == cs.snips[9].hash);
+    t_assert(menu_lookup(&old, 11, &hash) == -ERANGE);
+
+    /* Anything else replaces the file */
+    t_assert(cs_trim(&cs, CS_ITER_NEWEST_FIRST, 5) == 0);
+    {
+        _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+        t_assert(menu_live_update(&guard, &live) == 0);
+    }
+    t_assert(menu_live_write(&live, TEST_MENU_FILE) == 0);
+    t_assert(menu_file_matches_build(&cs));
+    t_assert(stat(TEST_MENU_FILE, &after) == 0);
+    t_assert(after.st_ino != before.st_ino);
+    t_assert(memcmp(old.text, old_text, old.header.text_size) == 0);
+
+    menu_live_free(&live);
+    t_assert(unlink(TEST_MENU_FILE) == 0);
+    return true;
+}
+
+static bool test__menu_open__stale(void) {
+    _drop_(teardown_test) struct clip_store cs = setup_test();
+    add_ten_snips(&cs);
+
+    struct menu_buf buf = {0};
+    {
+        _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+        t_assert(menu_build(&guard, &buf) == 0);
+    }
+    _drop_(free) char *data = buf.data;
+    t_assert(menu_write(&buf, TEST_MENU_FILE) == 0);
+
+    {
+        _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+        _drop_(menu_close) struct menu_view menu;
+        t_assert(menu_open(TEST_MENU_FILE, &guard, &menu) == 0);
+        t_assert(menu.fd >= 0);
+        t_assert(menu.header.text_size == buf.size - (size_t)menu.text_offset);
+        t_assert(memcmp(menu.text, buf.data + menu.text_offset,
+                        menu.header.text_size) == 0);
+    }
+
+    /* Any change to the store must invalidate the menu, even in the middle */
+    t_assert(cs_replace(&cs, CS_ITER_NEWEST_FIRST, 1, "mid", NULL) == 0);
+    {
+        _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+        _drop_(menu_close) struct menu_view menu;
+        t_assert(menu_open(TEST_MENU_FILE, &guard, &menu) == -ESTALE);
+    }
+    t_assert(cs_add(&cs, "new", NULL, CS_DUPE_KEEP_ALL) == 0);
+    {
+        _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+        _drop_(menu_close) struct menu_view menu;
+        t_assert(menu_open(TEST_MENU_FILE, &guard, &menu) == -ESTALE);
+    }
+    t_assert(cs_trim(&cs, CS_ITER_NEWEST_FIRST, 10) == 0);
+    {
+        _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+        _drop_(menu_close) struct menu_view menu;
+        t_assert(menu_open(TEST_MENU_FILE, &guard, &menu) == -ESTALE);
+    }
+
+    t_assert(unlink(TEST_MENU_FILE) == 0);
+
+    return true;
+}
+
+static bool test__cs_changes(void) {
+    _drop_(teardown_test) struct clip_store cs = setup_test();
+    t_assert(cs_generation(&cs) == 0);
+    add_ten_snips(&cs);
+    uint64_t since = cs_generation(&cs);
+    t_assert(since == 10);
+
+    uint64_t hash;
+    t_assert(cs_add(&cs, "new", &hash, CS_DUPE_KEEP_ALL) == 0);
+    t_assert(cs_add(&cs, "3", NULL, CS_DUPE_KEEP_LAST) == 0);
+    t_assert(cs_replace(&cs, CS_ITER_NEWEST_FIRST, 1, "replaced", NULL) == 0);
+    uint64_t oldest = cs.snips[0].hash;
+    t_assert(cs_trim(&cs, CS_ITER_NEWEST_FIRST, 8) == 0);
+
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+    struct cs_event events[CS_EVENT_RING_SIZE];
+    size_t nr_events;
+    t_assert(cs_changes(&guard, since, events, &nr_events) == 0);
+    t_assert(nr_events == 4);
+    t_assert(events[0].type == CS_EVENT_ADD && events[0].index == 10);
+    t_assert(events[0].hash == hash && events[0].nr == 1);
+    t_assert(events[1].type == CS_EVENT_MAKE_NEWEST && events[1].index == 3);
+    t_assert(events[2].type == CS_EVENT_REPLACE && events[2].index == 9);
+    // The three oldest are trimmed together
+    t_assert(events[3].type == CS_EVENT_REMOVE && events[3].index == 0);
+    t_assert(events[3].nr == 3 && events[3].hash == oldest);
+
+    t_assert(cs_changes(&guard, cs_generation(&cs), events, &nr_events) == 0);
+    t_assert(nr_events == 0);
+    t_assert(cs_changes(&guard, 0, events, &nr_events) == -EOVERFLOW);
+    t_assert(cs_changes(&guard, 100, events, &nr_events) == -EOVERFLOW);
+
+    return true;
+}
+
+static bool test__cs_changes__trim_larger_than_ring(void) {
+    _drop_(teardown_test) struct clip_store cs = setup_test();
+    size_t nr_add = CS_EVENT_RING_SIZE * 10;
+    for (size_t i = 0; i < nr_add; i++) {
+        char content[16];
+        snprintf(content, sizeof(content), "%zu", i);
+        t_assert(cs_add(&cs, content, NULL, CS_DUPE_KEEP_ALL) == 0);
+    }
+    uint64_t since = cs_generation(&cs);
+    uint64_t oldest = cs.snips[0].hash;
+
+    t_assert(cs_trim(&cs, CS_ITER_NEWEST_FIRST, 5) == 0);
+    t_assert(cs_add(&cs, "new", NULL, CS_DUPE_KEEP_ALL) == 0);
+
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+    struct cs_event events[CS_EVENT_RING_SIZE];
+    size_t nr_events;
+    t_assert(cs_changes(&guard, since, events, &nr_events) == 0);
+    t_assert(nr_events == 2);
+    t_assert(events[0].type == CS_EVENT_REMOVE && events[0].index == 0);
+    t_assert(events[0].nr == nr_add - 5 && events[0].hash == oldest);
+    t_assert(events[1].type == CS_EVENT_ADD && events[1].index == 5);
+
+    return true;
+}
+
+static bool test__cs_wait(void) {
+    _drop_(teardown_test) struct clip_store cs = setup_test();
+    uint64_t since = cs_generation(&cs);
+    t_assert(cs_wait(&cs, since, 10) == -ETIMEDOUT);
+
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        // Open the file again, so that we don't share the parent's flock
+        int snip_fd = shm_open(TEST_SNIP_FILE, O_RDWR, 0600);
+        struct clip_store child_cs;
+        usleep(20000);
+        _exit(snip_fd < 0 ||
+              cs_init(&child_cs, snip_fd, cs.content_dir_fd) < 0 ||
+              cs_add(&child_cs, "from child", NULL, CS_DUPE_KEEP_ALL) < 0);
+    }
+
+    t_assert(cs_wait(&cs, since, 5000) == 0);
+    int status;
+    t_assert(waitpid(pid, &status, 0) == pid);
+    t_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    t_assert(cs_generation(&cs) == since + 1);
+    t_assert(cs_wait(&cs, since, -1) == 0);
+
+    return true;
+}
+
+static bool mirror_has(const struct persist *p, uint64_t hash) {
+    char name[CS_HASH_STR_MAX];
+    snprintf(name, sizeof(name), PRI_HASH, hash);
+    return faccessat(p->content_dir_fd, name, F_OK, 0) == 0;
+}
+
+static bool test__persist_commit_and_restore(void) {
+    remove_test_dir(TEST_PERSIST_DIR);
+    _drop_(teardown_test) struct clip_store cs = setup_test();
+    add_ten_snips(&cs);
+    uint64_t dupe_hash;
+    t_assert(cs_add(&cs, "1", &dupe_hash, CS_DUPE_KEEP_ALL) == 0);
+
+    // The mirror needs its own open file description, so it has its own lock
+    _drop_(close) int mirror_snip_fd = shm_open(TEST_SNIP_FILE, O_RDONLY, 0);
+    t_assert(mirror_snip_fd >= 0);
+    _drop_(persist_destroy) struct persist p;
+    t_assert(persist_init(&p, TEST_PERSIST_DIR, mirror_snip_fd,
+                          cs.content_dir_fd) == 0);
+    t_assert(persist_commit(&p) == 0);
+    t_assert(p.persisted.nr == 10);
+    t_assert(mirror_has(&p, cs.snips[0].hash));
+
+    uint64_t generation = p.generation;
+    t_assert(persist_commit(&p) == 0);
+    t_assert(p.generation == generation);
+
+    /* Removed clips must not linger in the mirror */
+    uint64_t oldest_hash = cs.snips[0].hash;
+    t_assert(cs_trim(&cs, CS_ITER_NEWEST_FIRST, 10) == 0);
+    t_assert(persist_commit(&p) == 0);
+    t_assert(p.persisted.nr == 9);
+    t_assert(!mirror_has(&p, oldest_hash));
+
+    /* Warm load a new, empty clip store from the mirror */
+    shm_unlink(TEST_RESTORE_SNIP_FILE);
+    int snip_fd =
+        shm_open(TEST_RESTORE_SNIP_FILE, O_RDWR | O_CREAT | O_EXCL, 0600);
+    remove_test_dir(TEST_RESTORE_CONTENT_DIR);
+    t_assert(mkdir(TEST_RESTORE_CONTENT_DIR, 0700) == 0);
+    int content_dir_fd = open(TEST_RESTORE_CONTENT_DIR, O_RDONLY);
+    t_assert(snip_fd >= 0 && content_dir_fd >= 0);
+
+    t_assert(persist_restore(TEST_PERSIST_DIR, snip_fd, content_dir_fd) == 0);
+    struct clip_store restored;
+    t_assert(cs_init(&restored, snip_fd, content_dir_fd) == 0);
+    t_assert(restored.header->nr_snips == 10);
+    t_assert(restored.header->generation == 0);
+    t_assert(memcmp(restored.snips, cs.snips, 10 * sizeof(struct cs_snip)) ==
+             0);
+    {
+        _drop_(cs_content_unmap) struct cs_content content;
+        t_assert(cs_content_get(&restored, dupe_hash, &content) == 0);
+        t_assert(content.size == 1 && content.data[0] == '1');
+    }
+    char dupe_path[PATH_MAX];
+    snprintf(dupe_path, sizeof(dupe_path), PRI_HASH "/2", dupe_hash);
+    t_assert(faccessat(content_dir_fd, dupe_path, F_OK, 0) == 0);
+
+    /* A clip store which already has clips is left alone */
+    t_assert(cs_add(&restored, "new", NULL, CS_DUPE_KEEP_ALL) == 0);
+    t_assert(persist_restore(TEST_PERSIST_DIR, snip_fd, content_dir_fd) == 0);
+    t_assert(restored.header->nr_snips == 11);
+
+    t_assert(cs_destroy(&restored) == 0);
+    close(snip_fd);
+    close(content_dir_fd);
+    shm_unlink(TEST_RESTORE_SNIP_FILE);
+    remove_test_dir(TEST_RESTORE_CONTENT_DIR);
+    remove_test_dir(TEST_PERSIST_DIR);
+
+    return true;
+}
+
+static bool test__persist_init__untrusted_content(void) {
+    remove_test_dir(TEST_PERSIST_DIR);
+    _drop_(teardown_test) struct clip_store cs = setup_test();
+    add_ten_snips(&cs);
+
+    _drop_(close) int mirror_snip_fd = shm_open(TEST_SNIP_FILE, O_RDONLY, 0);
+    t_assert(mirror_snip_fd >= 0);
+    struct persist p;
+    t_assert(persist_init(&p, TEST_PERSIST_DIR, mirror_snip_fd,
+                          cs.content_dir_fd) == 0);
+    t_assert(persist_commit(&p) == 0);
+
+    /* A crash after the rename but before syncfs() can leave this behind */
+    uint64_t hash;
+    t_assert(cs_add(&cs, "not yet durable", &hash, CS_DUPE_KEEP_ALL) == 0);
+    char name[CS_HASH_STR_MAX];
+    snprintf(name, sizeof(name), PRI_HASH, hash);
+    int fd = openat(p.content_dir_fd, name, O_WRONLY | O_CREAT, 0600);
+    t_assert(fd >= 0);
+    close(fd);
+    persist_destroy(&p);
+
+    t_assert(persist_init(&p, TEST_PERSIST_DIR, mirror_snip_fd,
+                          cs.content_dir_fd) == 0);
+    t_assert(p.persisted.nr == 10);
+    t_assert(!mirror_has(&p, hash));
+
+    t_assert(persist_commit(&p) == 0);
+    struct stat st;
+    t_assert(fstatat(p.content_dir_fd, name, &st, 0) == 0);
+    t_assert(st.st_size == (off_t)strlen("not yet durable"));
+
+    persist_destroy(&p);
+    remove_test_dir(TEST_PERSIST_DIR);
+
+    return true;
+}
+
+static bool test__export_roundtrip(void) {
+    _drop_(teardown_test) struct clip_store cs = setup_test();
+    add_ten_snips(&cs);
+    uint64_t dupe_hash;
+    t_assert(cs_add(&cs, "1", &dupe_hash, CS_DUPE_KEEP_ALL) == 0);
+
+    shm_unlink(TEST_RESTORE_SNIP_FILE);
+    int snip_fd =
+        shm_open(TEST_RESTORE_SNIP_FILE, O_RDWR | O_CREAT | O_EXCL, 0600);
+    remove_test_dir(TEST_RESTORE_CONTENT_DIR);
+    t_assert(mkdir(TEST_RESTORE_CONTENT_DIR, 0700) == 0);
+    int content_dir_fd = open(TEST_RESTORE_CONTENT_DIR, O_RDONLY);
+    t_assert(snip_fd >= 0 && content_dir_fd >= 0);
+    struct clip_store imported;
+    t_assert(cs_init(&imported, snip_fd, content_dir_fd) == 0);
+
+    /* Through a pipe, as with clipexport | ssh host clipexport -i */
+    int pipefd[2];
+    t_assert(pipe(pipefd) == 0);
+    pid_t pid = fork();
+    t_assert(pid >= 0);
+    if (pid == 0) {
+        close(pipefd[0]);
+        size_t nr_written;
+        int ret = export_write(&cs, pipefd[1], &nr_written);
+        _exit(ret == 0 && nr_written == 11 ? 0 : 1);
+    }
+    close(pipefd[1]);
+    size_t nr;
+    t_assert(export_read(&imported, pipefd[0], CS_DUPE_KEEP_ALL, &nr) == 0);
+    t_assert(nr == 11);
+    close(pipefd[0]);
+    int status;
+    t_assert(waitpid(pid, &status, 0) == pid);
+    t_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    t_assert(imported.header->nr_snips == 11);
+    t_assert(memcmp(imported.snips, cs.snips, 11 * sizeof(struct cs_snip)) ==
+             0);
+    {
+        _drop_(cs_content_unmap) struct cs_content content;
+        t_assert(cs_content_get(&imported, cs.snips[3].hash, &content) == 0);
+        t_assert(content.size == 1 && content.data[0] == '3');
+    }
+    char dupe_path[PATH_MAX];
+    snprintf(dupe_path, sizeof(dupe_path), PRI_HASH "/2", dupe_hash);
+    t_assert(faccessat(content_dir_fd, dupe_path, F_OK, 0) == 0);
+
+    /* Through a file, and the same clips again with deduplication */
+    int file_fd = open(TEST_EXPORT_FILE, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    t_assert(file_fd >= 0);
+    t_assert(export_write(&cs, file_fd, NULL) == 0);
+    off_t size = lseek(file_fd, 0, SEEK_CUR);
+    t_assert(lseek(file_fd, 0, SEEK_SET) == 0);
+    t_assert(export_read(&imported, file_fd, CS_DUPE_KEEP_LAST, &nr) == 0);
+    t_assert(nr == 11);
+    t_assert(imported.header->nr_snips == 11);
+    t_assert(lseek(file_fd, 0, SEEK_CUR) == size);
+
+    /* Truncated and corrupt streams are rejected */
+    t_assert(ftruncate(file_fd, size - 1) == 0);
+    t_assert(lseek(file_fd, 0, SEEK_SET) == 0);
+    t_assert(export_read(&imported, file_fd, CS_DUPE_KEEP_LAST, NULL) ==
+             -ENODATA);
+    t_assert(lseek(file_fd, 0, SEEK_SET) == 0);
+    write_safe(file_fd, "CMIMPORT", 8);
+    t_assert(lseek(file_fd, 0, SEEK_SET) == 0);
+    t_assert(export_read(&imported, file_fd, CS_DUPE_KEEP_LAST, NULL) ==
+             -EINVAL);
+    close(file_fd);
+    unlink(TEST_EXPORT_FILE);
+
+    t_assert(cs_destroy(&imported) == 0);
+    close(snip_fd);
+    close(content_dir_fd);
+    shm_unlink(TEST_RESTORE_SNIP_FILE);
+    remove_test_dir(TEST_RESTORE_CONTENT_DIR);
+
+    return true;
+}
+
+static bool test__cs_add_fd__hash_mismatch(void) {
+    _drop_(teardown_test) struct clip_store cs = setup_test();
+    uint64_t hash;
+    t_assert(cs_add(&cs, "real", &hash, CS_DUPE_KEEP_ALL) == 0);
+    t_assert(cs_trim(&cs, CS_ITER_NEWEST_FIRST, 0) == 0);
+
+    int file_fd = open(TEST_EXPORT_FILE, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    t_assert(file_fd >= 0);
+    write_safe(file_fd, "fake", 4);
+    t_assert(lseek(file_fd, 0, SEEK_SET) == 0);
+    t_assert(cs_add_fd(&cs, hash, "real", 1, file_fd, 4, CS_DUPE_KEEP_LAST) ==
+             -EINVAL);
+    t_assert(cs.header->nr_snips == 0);
+    char dir_path[CS_HASH_STR_MAX];
+    snprintf(dir_path, sizeof(dir_path), PRI_HASH, hash);
+    t_assert(faccessat(cs.content_dir_fd, dir_path, F_OK, 0) == -1);
+
+    /* The same content under the right hash is accepted */
+    t_assert(lseek(file_fd, 0, SEEK_SET) == 0);
+    write_safe(file_fd, "real", 4);
+    t_assert(lseek(file_fd, 0, SEEK_SET) == 0);
+    t_assert(cs_add_fd(&cs, hash, "real", 1, file_fd, 4, CS_DUPE_KEEP_LAST) ==
+             0);
+    t_assert(cs.header->nr_snips == 1);
+    close(file_fd);
+    unlink(TEST_EXPORT_FILE);
+
+    return true;
+}
+
+static bool test__run_clipserve__unblocks_signals(void) {
+    remove_test_dir(TEST_BIN_DIR);
+    t_assert(mkdir(TEST_BIN_DIR, 0700) == 0);
+    int fd = open(TEST_BIN_DIR "/clipserve", O_WRONLY | O_CREAT, 0700);
+    t_assert(fd >= 0);
+    const char script[] = "#!/bin/sh\nkill -TERM $$\nexit 1\n";
+    write_safe(fd, script, strlen(script));
+    close(fd);
+
+    const char *old_path = getenv("PATH");
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s:%s", TEST_BIN_DIR,
+             old_path ? old_path : "");
+    _drop_(free) char *saved_path = old_path ? strdup(old_path) : NULL;
+    t_assert(setenv("PATH", path, 1) == 0);
+
+    /* As clipmenud does for its signalfd */
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    t_assert(sigprocmask(SIG_BLOCK, &mask, &old_mask) == 0);
+    run_clipserve(0);
+    t_assert(sigprocmask(SIG_SETMASK, &old_mask, NULL) == 0);
+    if (saved_path) {
+        t_assert(setenv("PATH", saved_path, 1) == 0);
+    }
+
+    int status;
+    t_assert(wait(&status) > 0);
+    t_assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGTERM);
+
+    remove_test_dir(TEST_BIN_DIR);
+    return true;
+}
+
+static int score(const char *pattern, const char *text) {
+    return fuzzy_score(pattern, strlen(pattern), text, strlen(text));
+}
+
+static bool test__fuzzy_score(void) {
+    t_assert(score("", "anything") == 0);
+    t_assert(score("abc", "xaxbxcx") > 0);
+    t_assert(score("abc", "ABC") > 0);
+    t_assert(score("abc", "acb") == FUZZY_NO_MATCH);
+    t_assert(score("abcd", "abc") == FUZZY_NO_MATCH);
+    // Consecutive and word start matches rank above scattered ones
+    t_assert(score("foo", "foobar") > score("foo", "f_o_o_bar"));
+    t_assert(score("bar", "foo bar") > score("bar", "foobar"));
+    t_assert(score("fb", "FooBar") > score("fb", "foobar"));
+    // The shortest window is scored, not the first one found
+    t_assert(score("ab", "a____ab") == score("ab", "ab"));
+    return true;
+}
+
+static bool test__picker_filter(void) {
+    _drop_(teardown_test) struct clip_store cs = setup_test();
+    t_assert(cs_add(&cs, "git status", NULL, CS_DUPE_KEEP_ALL) == 0);
+    t_assert(cs_add(&cs, "grep -r todo", NULL, CS_DUPE_KEEP_ALL) == 0);
+    t_assert(cs_add(&cs, "git\tstash", NULL, CS_DUPE_KEEP_ALL) == 0);
+
+    _drop_(picker_free) struct picker p;
+    {
+        _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+        t_assert(picker_load(&p, &guard) == 0);
+    }
+    t_assert(p.nr_entries == 3);
+    t_assert(p.nr_matches == 3 && p.nr_top == 3);
+    t_assert(p.entries[p.top[0]].hash == cs.snips[2].hash);
+    t_assert(strncmp(p.entries[0].line, "git stash", p.entries[0].len) == 0);
+
+    strcpy(p.query, "gst");
+    p.query_len = 3;
+    picker_filter(&p);
+    t_assert(p.nr_matches == 2);
+
+    // Extending the query only rescores the previous matches
+    strcpy(p.query, "gsta");
+    p.query_len = 4;
+    picker_filter(&p);
+    t_assert(p.nr_matches == 2 && p.filtered_query_len == 4);
+
+    strcpy(p.query, "gstash");
+    p.query_len = 6;
+    picker_filter(&p);
+    t_assert(p.nr_matches == 1 && p.nr_top == 1);
+    t_assert(p.entries[p.top[0]].hash == cs.snips[2].hash);
+
+    return true;
+}
+
 int main(void) {
     t_run(test__cs_init);
     t_run(test__cs_init__bad_size);
@@ -676,6 +1491,26 @@ int main(void) {
     t_run(test__cs_add__dupe_keep_all);
     t_run(test__cs_add__dupe_keep_last);
     t_run(test__cs_add__dupe_keep_last_with_multiple_entries);
+    t_run(test__cs_init_readonly);
+    t_run(test__cs_init_readonly__empty);
+    t_run(test__cs_init_readonly__sees_writer);
+    t_run(test__cs_snip_at);
+    t_run(test__cs_snip_range);
+    t_run(test__menu_build_page);
+    t_run(test__menu_build);
+    t_run(test__menu_live_update);
+    t_run(test__menu_live_write);
+    t_run(test__menu_open__stale);
+    t_run(test__cs_changes);
+    t_run(test__cs_changes__trim_larger_than_ring);
+    t_run(test__cs_wait);
+    t_run(test__persist_commit_and_restore);
+    t_run(test__persist_init__untrusted_content);
+    t_run(test__export_roundtrip);
+    t_run(test__cs_add_fd__hash_mismatch);
+    t_run(test__run_clipserve__unblocks_signals);
+    t_run(test__fuzzy_score);
+    t_run(test__picker_filter);
 
     return 0;
 }
@@ -0,0 +1,618 @@
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <unistd.h>
+
+#include "../src/config.h"
+#include "../src/store.h"
+#include "../src/util.h"
+#include "../src/x.h"
+
+/**
+ * End-to-end latency benchmark for the X path. This acts as a synthetic
+ * selection owner for clipmenud to read from, and as a requestor pasting from
+ * clipserve. It expects to run against a dedicated X server with clipmenud
+ * already running, see tests/x_latency_benchmark.
+ *
+ * Results are written to stdout as a JSON array.
+ */
+
+#define STORE_TIMEOUT_NS (120ULL * 1000000000ULL)
+#define POLL_INTERVAL_US 50
+#define MAX_INCR_CHUNKS (1 << 16)
+
+static Display *dpy;
+static Window win;
+static Atom clipboard, utf8_string, targets, incr_atom, bench_prop;
+static Atom multiple, timestamp, atom_pair, multiple_prop, aux_props[2];
+static struct clip_store cs;
+static bool first_result = true;
+static bool paste_multiple;
+
+/**
+ * The clip we currently own, and the state of any INCR transfer of it to a
+ * requestor.
+ *
+ * @data: The clip contents
+ * @size: The size of the clip
+ * @chunk_size: The INCR chunk size to use when serving it
+ * @owned: Whether we still own CLIPBOARD
+ * @it: The INCR transfer in progress, if it_active
+ * @incr_start_ns: When the INCR transfer started
+ * @incr_end_ns: When the final chunk was sent
+ */
+static struct owned_clip {
+    char *data;
+    size_t size;
+    size_t chunk_size;
+    bool owned;
+    bool it_active;
+    struct incr_transfer it;
+    uint64_t incr_start_ns;
+    uint64_t incr_end_ns;
+} owned;
+
+/**
+ * The state of a paste from clipserve.
+ *
+ * @received: Bytes received so far
+ * @nr_notifies: SelectionNotify events received, one per selection round trip
+ * @incr: Whether the transfer is INCR
+ * @done: Whether the whole clip has been received
+ */
+static struct paste {
+    size_t received;
+    size_t nr_notifies;
+    bool incr;
+    bool done;
+} paste;
+
+static void result_begin(const char *bench) {
+    printf("%s  {\"bench\": \"%s\"", first_result ? "" : ",\n", bench);
+    first_result = false;
+}
+
+static void result_end(void) { printf("}"); }
+
+static void result_u64(const char *key, uint64_t val) {
+    printf(", \"%s\": %" PRIu64, key, val);
+}
+
+static void result_double(const char *key, double val) {
+    printf(", \"%s\": %.3f", key, val);
+}
+
+static double mib_per_sec(size_t size, uint64_t ns) {
+    return ns ? (double)size / (1024.0 * 1024.0) / ((double)ns / 1e9) : 0;
+}
+
+/**
+ * Parse a size with an optional K, M or G suffix. "max" means the largest
+ * chunk size the server accepts.
+ */
+static size_t parse_size(const char *str) {
+    if (streq(str, "max")) {
+        return get_chunk_size(dpy);
+    }
+    char *end;
+    unsigned long long val = strtoull(str, &end, 10);
+    die_on(end == str, "Invalid size: %s\n", str);
+    switch (*end) {
+        case 'G':
+            val *= 1024;
+            /* fallthrough */
+        case 'M':
+            val *= 1024;
+            /* fallthrough */
+        case 'K':
+            val *= 1024;
+            break;
+        case '\0':
+            break;
+        default:
+            die("Invalid size: %s\n", str);
+    }
+    return (size_t)val;
+}
+
+static size_t parse_size_list(const char *str, size_t *out, size_t max) {
+    _drop_(free) char *copy = strdup(str);
+    expect(copy);
+    size_t n = 0;
+    for (char *tok = strtok(copy, ","); tok && n < max;
+         tok = strtok(NULL, ",")) {
+        out[n++] = parse_size(tok);
+    }
+    return n;
+}
+
+/**
+ * Generate a clip of the given size. Consecutive ids must produce different
+ * clips which are not possible partials of each other, so the id is put at
+ * both ends.
+ */
+static char *make_clip(size_t size, unsigned int id) {
+    char *data = malloc(size + 1);
+    expect(data);
+    memset(data, 'x', size);
+    data[size] = '\0';
+    if (size < 32) {
+        data[0] = (char)('a' + id % 26);
+        return data;
+    }
+    char tag[16];
+    int len = snprintf(tag, sizeof(tag), "%u:", id);
+    memcpy(data, tag, (size_t)len);
+    memcpy(data + size - (size_t)len, tag, (size_t)len);
+    return data;
+}
+
+static uint64_t newest_hash(void) {
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+    struct cs_snip *snip = NULL;
+    if (cs_snip_iter(&guard, CS_ITER_NEWEST_FIRST, &snip)) {
+        return snip->hash;
+    }
+    return 0;
+}
+
+static void send_notify(const XSelectionRequestEvent *req, Atom property) {
+    XSelectionEvent sev = {.type = SelectionNotify,
+                           .display = req->display,
+                           .requestor = req->requestor,
+                           .selection = req->selection,
+                           .time = req->time,
+                           .target = req->target,
+                           .property = property};
+    XSendEvent(dpy, req->requestor, False, 0, (XEvent *)&sev);
+}
+
+static void handle_selection_request(const XSelectionRequestEvent *req) {
+    if (req->target == targets) {
+        Atom available[] = {utf8_string};
+        XChangeProperty(dpy, req->requestor, req->property, XA_ATOM, 32,
+                        PropModeReplace, (unsigned char *)available,
+                        arrlen(available));
+    } else if (req->target == utf8_string && owned.size < owned.chunk_size) {
+        XChangeProperty(dpy, req->requestor, req->property, utf8_string, 8,
+                        PropModeReplace, (unsigned char *)owned.data,
+                        (int)owned.size);
+    } else if (req->target == utf8_string && !owned.it_active) {
+        long incr_size = (long)owned.size;
+        XSelectInput(dpy, req->requestor, PropertyChangeMask);
+        XChangeProperty(dpy, req->requestor, req->property, incr_atom, 32,
+                        PropModeReplace, (unsigned char *)&incr_size, 1);
+        owned.it = (struct incr_transfer){
+            .requestor = req->requestor,
+            .property = req->property,
+            .target = req->target,
+            .format = 8,
+            .data = owned.data,
+            .data_size = owned.size,
+        };
+        owned.it_active = true;
+        owned.incr_start_ns = monotonic_ns();
+    } else {
+        send_notify(req, None);
+        return;
+    }
+    send_notify(req, req->property);
+}
+
+static void incr_send_next(const XPropertyEvent *pe) {
+    struct incr_transfer *it = &owned.it;
+    if (!owned.it_active || pe->state != PropertyDelete ||
+        pe->window != it->requestor || pe->atom != it->property) {
+        return;
+    }
+    size_t remaining = it->data_size - it->offset;
+    size_t n = remaining < owned.chunk_size ? remaining : owned.chunk_size;
+    XChangeProperty(dpy, it->requestor, it->property, it->target, it->format,
+                    PropModeReplace, (unsigned char *)(it->data + it->offset),
+                    (int)n);
+    it->offset += n;
+    if (n == 0) {
+        owned.it_active = false;
+        owned.incr_end_ns = monotonic_ns();
+    }
+}
+
+static void paste_receive(Atom property) {
+    Atom type;
+    int format;
+    unsigned long nitems, bytes_after;
+    _drop_(XFree) unsigned char *prop = NULL;
+    XGetWindowProperty(dpy, win, property, 0, LONG_MAX, True, AnyPropertyType,
+                       &type, &format, &nitems, &bytes_after, &prop);
+    if (type == incr_atom) {
+        paste.incr = true;
+        return;
+    }
+    size_t n = nitems * (size_t)(format / 8);
+    paste.received += n;
+    if (!paste.incr || n == 0) {
+        paste.done = true;
+    }
+}
+
+static void handle_event(XEvent *evt) {
+    switch (evt->type) {
+        case SelectionRequest:
+            handle_selection_request(&evt->xselectionrequest);
+            break;
+        case SelectionClear:
+            if (evt->xselectionclear.selection == clipboard) {
+                owned.owned = false;
+            }
+            break;
+        case SelectionNotify: {
+            const XSelectionEvent *sev = &evt->xselection;
+            paste.nr_notifies++;
+            if (sev->target != utf8_string && sev->target != multiple) {
+                break; // Preflight TARGETS or TIMESTAMP, we don't need them
+            }
+            if (sev->property == None) {
+                paste.done = true;
+            } else {
+                // For MULTIPLE, the text is in the property from our pair
+                paste_receive(bench_prop);
+            }
+            break;
+        }
+        case PropertyNotify:
+            if (evt->xproperty.window == win) {
+                if (paste.incr && evt->xproperty.atom == bench_prop &&
+                    evt->xproperty.state == PropertyNewValue) {
+                    paste_receive(bench_prop);
+                }
+            } else {
+                incr_send_next(&evt->xproperty);
+            }
+            break;
+    }
+}
+
+/**
+ * Process X events until the predicate is satisfied or we time out. Returns
+ * the time at which the predicate was first seen to be satisfied, or 0 on
+ * timeout.
+ */
+static uint64_t pump_until(bool (*done)(void *), void *arg) {
+    uint64_t start = monotonic_ns();
+    int x_fd = ConnectionNumber(dpy);
+
+    while (monotonic_ns() - start < STORE_TIMEOUT_NS) {
+        XFlush(dpy);
+        while (XPending(dpy)) {
+            XEvent evt;
+            XNextEvent(dpy, &evt);
+            handle_event(&evt);
+        }
+        if (done(arg)) {
+            return monotonic_ns();
+        }
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(x_fd, &fds);
+        struct timeval tv = {.tv_sec = 0, .tv_usec = POLL_INTERVAL_US};
+        select(x_fd + 1, &fds, NULL, NULL, &tv);
+    }
+    return 0;
+}
+
+static bool hash_changed(void *arg) {
+    return newest_hash() != *(uint64_t *)arg;
+}
+static bool lost_ownership(void *arg _unused_) { return !owned.owned; }
+static bool paste_done(void *arg _unused_) { return paste.done; }
+static bool paste_started(void *arg _unused_) {
+    return paste.received > 0 || paste.done;
+}
+static bool notified(void *arg) {
+    return paste.nr_notifies >= *(size_t *)arg;
+}
+
+/**
+ * Take ownership of CLIPBOARD with a new clip, and wait for clipmenud to
+ * store it. Returns the time to stored in ns, or 0 on timeout.
+ */
+static uint64_t own_and_wait_stored(size_t size, size_t chunk_size,
+                                    unsigned int id) {
+    free(owned.data);
+    owned = (struct owned_clip){
+        .data = make_clip(size, id),
+        .size = size,
+        .chunk_size = chunk_size,
+        .owned = true,
+    };
+
+    uint64_t before = newest_hash();
+    uint64_t start = monotonic_ns();
+    XSetSelectionOwner(dpy, clipboard, win, CurrentTime);
+    uint64_t end = pump_until(hash_changed, &before);
+    return end ? end - start : 0;
+}
+
+static void bench_store(size_t size, size_t chunk_size, unsigned int id) {
+    uint64_t stored_ns = own_and_wait_stored(size, chunk_size, id);
+    result_begin("store");
+    result_u64("size", size);
+    result_u64("chunk_size", chunk_size);
+    result_u64("incr", size >= chunk_size);
+    result_u64("timeout", stored_ns == 0);
+    result_u64("time_to_stored_us", stored_ns / 1000);
+    if (owned.incr_end_ns) {
+        uint64_t incr_ns = owned.incr_end_ns - owned.incr_start_ns;
+        result_u64("incr_us", incr_ns / 1000);
+        result_double("incr_mib_per_sec", mib_per_sec(size, incr_ns));
+    }
+    result_end();
+}
+
+/**
+ * clipserve also owns PRIMARY. Take it away so it exits once we take
+ * CLIPBOARD back for the next clip.
+ */
+static void release_primary(void) {
+    XSetSelectionOwner(dpy, XA_PRIMARY, win, CurrentTime);
+    XSetSelectionOwner(dpy, XA_PRIMARY, None, CurrentTime);
+    XFlush(dpy);
+}
+
+/**
+ * Request TARGETS, TIMESTAMP and UTF8_STRING the way a typical application
+ * pastes: either as three sequential conversions, or as a single MULTIPLE.
+ * Returns the time the paste completed, or 0 on timeout.
+ */
+static uint64_t paste_convert(void) {
+    if (paste_multiple) {
+        Atom pairs[] = {targets,   aux_props[0], timestamp,
+                        aux_props[1], utf8_string, bench_prop};
+        XChangeProperty(dpy, win, multiple_prop, atom_pair, 32,
+                        PropModeReplace, (unsigned char *)pairs,
+                        arrlen(pairs));
+        XConvertSelection(dpy, clipboard, multiple, multiple_prop, win,
+                          CurrentTime);
+        return pump_until(paste_done, NULL);
+    }
+
+    Atom preflight[] = {targets, timestamp};
+    for (size_t i = 0; i < arrlen(preflight); i++) {
+        size_t want = paste.nr_notifies + 1;
+        XConvertSelection(dpy, clipboard, preflight[i], aux_props[i], win,
+                          CurrentTime);
+        if (!pump_until(notified, &want)) {
+            return 0;
+        }
+    }
+    XConvertSelection(dpy, clipboard, utf8_string, bench_prop, win,
+                      CurrentTime);
+    return pump_until(paste_done, NULL);
+}
+
+/**
+ * Hand the newest clip over to clipserve and paste it back, measuring how
+ * long it takes for clipserve to own the selection and to deliver the data.
+ */
+static void bench_paste(size_t size) {
+    uint64_t hash = newest_hash();
+    paste = (struct paste){0};
+
+    uint64_t start = monotonic_ns();
+    run_clipserve(hash);
+    uint64_t owned_at = pump_until(lost_ownership, NULL);
+
+    uint64_t convert_at = monotonic_ns();
+    uint64_t pasted_at = owned_at ? paste_convert() : 0;
+
+    result_begin("paste");
+    result_u64("size", size);
+    result_u64("chunk_size", get_chunk_size(dpy));
+    result_u64("incr", paste.incr);
+    result_u64("multiple", paste_multiple);
+    result_u64("selection_round_trips", paste.nr_notifies);
+    result_u64("timeout", !pasted_at);
+    result_u64("bytes_received", paste.received);
+    result_u64("time_to_owned_us", owned_at ? (owned_at - start) / 1000 : 0);
+    result_u64("time_to_paste_us", pasted_at ? (pasted_at - start) / 1000 : 0);
+    if (pasted_at) {
+        result_double("paste_mib_per_sec",
+                      mib_per_sec(paste.received, pasted_at - convert_at));
+    }
+    result_end();
+
+    release_primary();
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Measure the time from spawning clipserve to receiving the first byte of a
+ * paste from it. For small clips this is dominated by clipserve's startup:
+ * exec, opening the clip store, and taking ownership.
+ */
+static void bench_startup(size_t size, size_t count, unsigned int *id) {
+    _drop_(free) uint64_t *lat = calloc(count, sizeof(uint64_t));
+    expect(lat);
+    size_t nr_ok = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (!own_and_wait_stored(size, get_chunk_size(dpy), (*id)++)) {
+            continue;
+        }
+        uint64_t hash = newest_hash();
+        paste = (struct paste){0};
+
+        uint64_t start = monotonic_ns();
+        run_clipserve(hash);
+        if (pump_until(lost_ownership, NULL)) {
+            XConvertSelection(dpy, clipboard, utf8_string, bench_prop, win,
+                              CurrentTime);
+            uint64_t first_byte_at = pump_until(paste_started, NULL);
+            if (first_byte_at) {
+                lat[nr_ok++] = first_byte_at - start;
+            }
+        }
+        release_primary();
+    }
+    qsort(lat, nr_ok, sizeof(uint64_t), cmp_u64);
+
+    result_begin("startup");
+    result_u64("size", size);
+    result_u64("count", count);
+    result_u64("timeouts", count - nr_ok);
+    if (nr_ok) {
+        result_u64("p50_us", lat[nr_ok / 2] / 1000);
+        result_u64("p99_us", lat[nr_ok * 99 / 100] / 1000);
+        result_u64("max_us", lat[nr_ok - 1] / 1000);
+    }
+    result_end();
+}
+
+/**
+ * Own clips of a fixed size at a controlled rate, and report the distribution
+ * of time to stored.
+ */
+static void bench_rate(size_t size, double rate, size_t count,
+                       unsigned int *id) {
+    _drop_(free) uint64_t *lat = calloc(count, sizeof(uint64_t));
+    expect(lat);
+    uint64_t interval_ns = (uint64_t)(1e9 / rate);
+    size_t nr_stored = 0, nr_timeout = 0;
+    uint64_t start = monotonic_ns();
+
+    for (size_t i = 0; i < count; i++) {
+        uint64_t slot = start + i * interval_ns;
+        uint64_t now = monotonic_ns();
+        if (now < slot) {
+            usleep((useconds_t)((slot - now) / 1000));
+        }
+        uint64_t ns = own_and_wait_stored(size, get_chunk_size(dpy), (*id)++);
+        if (ns) {
+            lat[nr_stored++] = ns;
+        } else {
+            nr_timeout++;
+        }
+    }
+    uint64_t elapsed = monotonic_ns() - start;
+    qsort(lat, nr_stored, sizeof(uint64_t), cmp_u64);
+
+    result_begin("rate");
+    result_u64("size", size);
+    result_double("target_rate", rate);
+    result_double("achieved_rate", (double)count / ((double)elapsed / 1e9));
+    result_u64("count", count);
+    result_u64("timeouts", nr_timeout);
+    if (nr_stored) {
+        result_u64("p50_us", lat[nr_stored / 2] / 1000);
+        result_u64("p99_us", lat[nr_stored * 99 / 100] / 1000);
+        result_u64("max_us", lat[nr_stored - 1] / 1000);
+    }
+    result_end();
+}
+
+int main(int argc, char *argv[]) {
+    const char usage[] =
+        "Usage: x_bench [-s sizes] [-c chunk_sizes] [-r rate] [-n count] [-m] "
+        "[-p startups]";
+    const char *sizes_str = "1,1K,64K,1M,16M,256M";
+    const char *chunks_str = "4K,64K,max";
+    double rate = 0;
+    size_t count = 100;
+    size_t nr_startups = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:c:r:n:mp:")) != -1) {
+        switch (opt) {
+            case 's':
+                sizes_str = optarg;
+                break;
+            case 'c':
+                chunks_str = optarg;
+                break;
+            case 'r':
+                rate = strtod(optarg, NULL);
+                break;
+            case 'n':
+                count = strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                paste_multiple = true;
+                break;
+            case 'p':
+                nr_startups = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                die("%s\n", usage);
+        }
+    }
+
+    _drop_(config_free) struct config cfg = setup("x_bench");
+    expect(signal(SIGCHLD, SIG_IGN) != SIG_ERR);
+
+    _drop_(close) int content_dir_fd = open(get_cache_dir(&cfg), O_RDONLY);
+    _drop_(close) int snip_fd =
+        open(get_line_cache_path(&cfg), O_RDONLY | O_CREAT, 0600);
+    expect(content_dir_fd >= 0 && snip_fd >= 0);
+    expect(cs_init_readonly(&cs, snip_fd, content_dir_fd) == 0);
+
+    die_on(!(dpy = XOpenDisplay(NULL)), "Cannot open display\n");
+    win = XCreateSimpleWindow(dpy, DefaultRootWindow(dpy), 0, 0, 1, 1, 0, 0, 0);
+    XSelectInput(dpy, win, PropertyChangeMask);
+    clipboard = get_atom(dpy, X_ATOM_CLIPBOARD);
+    utf8_string = get_atom(dpy, X_ATOM_UTF8_STRING);
+    targets = get_atom(dpy, X_ATOM_TARGETS);
+    incr_atom = get_atom(dpy, X_ATOM_INCR);
+    bench_prop = XInternAtom(dpy, "CLIPMENU_BENCH", False);
+    multiple = get_atom(dpy, X_ATOM_MULTIPLE);
+    timestamp = get_atom(dpy, X_ATOM_TIMESTAMP);
+    atom_pair = get_atom(dpy, X_ATOM_ATOM_PAIR);
+    multiple_prop = XInternAtom(dpy, "CLIPMENU_BENCH_MULTIPLE", False);
+    aux_props[0] = XInternAtom(dpy, "CLIPMENU_BENCH_AUX0", False);
+    aux_props[1] = XInternAtom(dpy, "CLIPMENU_BENCH_AUX1", False);
+
+    size_t sizes[32], chunks[32];
+    size_t nr_sizes = parse_size_list(sizes_str, sizes, arrlen(sizes));
+    size_t nr_chunks = parse_size_list(chunks_str, chunks, arrlen(chunks));
+    size_t max_chunk = get_chunk_size(dpy);
+    unsigned int id = 0;
+
+    printf("[\n");
+    for (size_t i = 0; i < nr_sizes; i++) {
+        for (size_t j = 0; j < nr_chunks; j++) {
+            size_t chunk = chunks[j] < max_chunk ? chunks[j] : max_chunk;
+            // Skip pointless INCR runs: tiny chunks on huge clips take
+            // forever, and non-INCR clips don't depend on the chunk size.
+            if (sizes[i] / chunk > MAX_INCR_CHUNKS ||
+                (sizes[i] < chunk && chunk != max_chunk)) {
+                continue;
+            }
+            bench_store(sizes[i], chunk, id++);
+        }
+        bench_paste(sizes[i]);
+    }
+    if (rate > 0) {
+        bench_rate(sizes[0], rate, count, &id);
+    }
+    if (nr_startups > 0) {
+        bench_startup(sizes[0], nr_startups, &id);
+    }
+    printf("\n]\n");
+
+    // Release CLIPBOARD so any remaining clipserve exits
+    XSetSelectionOwner(dpy, clipboard, None, CurrentTime);
+    XCloseDisplay(dpy);
+    free(owned.data);
+    expect(cs_destroy(&cs) == 0);
+
+    return 0;
+}
@@ -1,4 +1,5 @@
 /* See LICENSE file for copyright and license details. */
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,6 +17,37 @@ static const unsigned char utfmask[UTF_SIZ + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8}
 static const long utfmin[UTF_SIZ + 1] = {       0,    0,  0x80,  0x800,  0x10000};
 static const long utfmax[UTF_SIZ + 1] = {0x10FFFF, 0x7F, 0x7FF, 0xFFFF, 0x10FFFF};
 
+#define ASCII_GLYPHS  128
+#define WIDTH_BITS    6
+#define WIDTH_SLOTS   (1 << WIDTH_BITS)
+
+/* The font which draws a codepoint and its advance width. Finding the font
+ * takes an XftCharExists per font and the width an extents request, so both
+ * are cached per fontset. ASCII is direct-mapped, everything else goes into an
+ * open-addressing hash table. A NULL font marks an empty slot. */
+typedef struct {
+	long codepoint;
+	Fnt *font;
+	unsigned int w;
+} CachedGlyph;
+
+/* The width of a whole string, keyed by the string's address. The contents
+ * are kept too, since the bar measures buffers like the status text whose
+ * contents change in place. */
+typedef struct {
+	const char *ptr;
+	char *text;
+	size_t size;
+	unsigned int w;
+} TextWidth;
+
+struct GlyphCache {
+	CachedGlyph ascii[ASCII_GLYPHS];
+	CachedGlyph *glyphs;
+	unsigned int bits, n; /* glyphs has 1 << bits slots */
+	TextWidth widths[WIDTH_SLOTS];
+};
+
 static long
 utf8decodebyte(const char c, size_t *i)
 {
@@ -142,11 +174,25 @@ xfont_create(Drw *drw, const char *fontname, FcPattern *fontpattern)
 	return font;
 }
 
+static void
+glyphcache_free(struct GlyphCache *cache)
+{
+	size_t i;
+
+	if (!cache)
+		return;
+	for (i = 0; i < WIDTH_SLOTS; i++)
+		free(cache->widths[i].text);
+	free(cache->glyphs);
+	free(cache);
+}
+
 static void
 xfont_free(Fnt *font)
 {
 	if (!font)
 		return;
+	glyphcache_free(font->cache);
 	if (font->pattern)
 		FcPatternDestroy(font->pattern);
 	XftFontClose(font->dpy, font->xfont);
@@ -168,6 +214,8 @@ drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount)
 			ret = cur;
 		}
 	}
+	if (ret)
+		ret->cache = ecalloc(1, sizeof(struct GlyphCache));
 	return (drw->fonts = ret);
 }
 
@@ -235,6 +283,76 @@ drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int
 		XDrawRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w - 1, h - 1);
 }
 
+static unsigned int
+glyphhash(struct GlyphCache *cache, long codepoint)
+{
+	return (unsigned int)(((unsigned long long)codepoint * 0x9E3779B97F4A7C15ULL) >> (64 - cache->bits));
+}
+
+static CachedGlyph *
+glyphslot(struct GlyphCache *cache, long codepoint)
+{
+	unsigned int i, mask = (1U << cache->bits) - 1;
+
+	if (codepoint >= 0 && codepoint < ASCII_GLYPHS)
+		return &cache->ascii[codepoint];
+	if (!cache->glyphs)
+		return NULL;
+	for (i = glyphhash(cache, codepoint); cache->glyphs[i].font; i = (i + 1) & mask)
+		if (cache->glyphs[i].codepoint == codepoint)
+			break;
+	return &cache->glyphs[i];
+}
+
+static void
+glyphstore(struct GlyphCache *cache, long codepoint, Fnt *font, unsigned int w)
+{
+	CachedGlyph *old, *g;
+	unsigned int i, oldbits;
+
+	if (codepoint >= ASCII_GLYPHS && 2 * (cache->n + 1) > (1U << cache->bits)) {
+		old = cache->glyphs;
+		oldbits = cache->bits;
+		cache->bits = oldbits ? oldbits + 1 : 8;
+		cache->glyphs = ecalloc(1 << cache->bits, sizeof(CachedGlyph));
+		for (i = 0; old && i < (1U << oldbits); i++)
+			if (old[i].font)
+				*glyphslot(cache, old[i].codepoint) = old[i];
+		free(old);
+	}
+	g = glyphslot(cache, codepoint);
+	if (codepoint >= ASCII_GLYPHS && !g->font)
+		cache->n++;
+	g->codepoint = codepoint;
+	g->font = font;
+	g->w = w;
+}
+
+/* Find the first font in the set that has a glyph for the codepoint at text,
+ * and the glyph's advance width. Returns NULL if no font has it. */
+static Fnt *
+getglyph(Drw *drw, long codepoint, const char *text, unsigned int len, unsigned int *w)
+{
+	struct GlyphCache *cache = drw->fonts->cache;
+	CachedGlyph *g;
+	Fnt *font;
+
+	if (cache && (g = glyphslot(cache, codepoint)) && g->font
+	&& g->codepoint == codepoint) {
+		*w = g->w;
+		return g->font;
+	}
+	for (font = drw->fonts; font; font = font->next)
+		if (XftCharExists(drw->dpy, font->xfont, codepoint))
+			break;
+	if (!font)
+		return NULL;
+	drw_font_getexts(font, text, len, w, NULL);
+	if (cache)
+		glyphstore(cache, codepoint, font, *w);
+	return font;
+}
+
 int
 drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert)
 {
@@ -279,34 +397,37 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 		nextfont = NULL;
 		while (*text) {
 			utf8charlen = utf8decode(text, &utf8codepoint, UTF_SIZ);
-			for (curfont = drw->fonts; curfont; curfont = curfont->next) {
-				charexists = charexists || XftCharExists(drw->dpy, curfont->xfont, utf8codepoint);
-				if (charexists) {
-					drw_font_getexts(curfont, text, utf8charlen, &tmpw, NULL);
-					if (ew + ellipsis_width <= w) {
-						/* keep track where the ellipsis still fits */
-						ellipsis_x = x + ew;
-						ellipsis_w = w - ew;
-						ellipsis_len = utf8strlen;
-					}
-
-					if (ew + tmpw > w) {
-						overflow = 1;
-						/* called from drw_fontset_getwidth_clamp():
-						 * it wants the width AFTER the overflow
-						 */
-						if (!render)
-							x += tmpw;
-						else
-							utf8strlen = ellipsis_len;
-					} else if (curfont == usedfont) {
-						utf8strlen += utf8charlen;
-						text += utf8charlen;
-						ew += tmpw;
-					} else {
-						nextfont = curfont;
-					}
-					break;
+			if (charexists) {
+				/* no font has it, draw it with the first one */
+				curfont = drw->fonts;
+				drw_font_getexts(curfont, text, utf8charlen, &tmpw, NULL);
+			} else {
+				curfont = getglyph(drw, utf8codepoint, text, utf8charlen, &tmpw);
+				charexists = curfont != NULL;
+			}
+			if (charexists) {
+				if (ew + ellipsis_width <= w) {
+					/* keep track where the ellipsis still fits */
+					ellipsis_x = x + ew;
+					ellipsis_w = w - ew;
+					ellipsis_len = utf8strlen;
+				}
+
+				if (ew + tmpw > w) {
+					overflow = 1;
+					/* called from drw_fontset_getwidth_clamp():
+					 * it wants the width AFTER the overflow
+					 */
+					if (!render)
+						x += tmpw;
+					else
+						utf8strlen = ellipsis_len;
+				} else if (curfont == usedfont) {
+					utf8strlen += utf8charlen;
+					text += utf8charlen;
+					ew += tmpw;
+				} else {
+					nextfont = curfont;
 				}
 			}
 
@@ -369,6 +490,11 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 					for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
 						; /* NOP */
 					curfont->next = usedfont;
+					/* strings measured with a missing glyph may be
+					 * wider now */
+					if (drw->fonts->cache)
+						for (i = 0; i < WIDTH_SLOTS; i++)
+							drw->fonts->cache->widths[i].ptr = NULL;
 				} else {
 					xfont_free(usedfont);
 					nomatches.codepoint[++nomatches.idx % nomatches_len] = utf8codepoint;
@@ -384,22 +510,48 @@ no_match:
 	return x + (render ? w : 0);
 }
 
+void
+drw_copy(Drw *drw, Drawable d, int x, int y, unsigned int w, unsigned int h)
+{
+	if (!drw)
+		return;
+
+	XCopyArea(drw->dpy, drw->drawable, d, drw->gc, x, y, w, h, x, y);
+}
+
 void
 drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h)
 {
 	if (!drw)
 		return;
 
-	XCopyArea(drw->dpy, drw->drawable, win, drw->gc, x, y, w, h, x, y);
+	drw_copy(drw, win, x, y, w, h);
 	XSync(drw->dpy, False);
 }
 
 unsigned int
 drw_fontset_getwidth(Drw *drw, const char *text)
 {
+	struct GlyphCache *cache;
+	TextWidth *tw;
+	size_t len;
+
 	if (!drw || !drw->fonts || !text)
 		return 0;
-	return drw_text(drw, 0, 0, 0, 0, 0, text, 0);
+	if (!(cache = drw->fonts->cache))
+		return drw_text(drw, 0, 0, 0, 0, 0, text, 0);
+	tw = &cache->widths[((uintptr_t)text * 0x9E3779B97F4A7C15ULL) >> (64 - WIDTH_BITS)];
+	if (tw->ptr == text && !strcmp(tw->text, text))
+		return tw->w;
+	len = strlen(text) + 1;
+	if (tw->size < len) {
+		free(tw->text);
+		tw->text = ecalloc(1, len);
+		tw->size = len;
+	}
+	memcpy(tw->text, text, len);
+	tw->ptr = text;
+	return (tw->w = drw_text(drw, 0, 0, 0, 0, 0, text, 0));
 }
 
 unsigned int
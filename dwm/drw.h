@@ -10,6 +10,7 @@ typedef struct Fnt {
 	XftFont *xfont;
 	FcPattern *pattern;
 	struct Fnt *next;
+	struct GlyphCache *cache; /* only set on the first font of a set */
 } Fnt;
 
 enum { ColFg, ColBg, ColBorder }; /* Clr scheme index */
@@ -55,4 +56,5 @@ void drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled
 int drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert);
 
 /* Map functions */
+void drw_copy(Drw *drw, Drawable d, int x, int y, unsigned int w, unsigned int h);
 void drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h);
@@ -8,7 +8,9 @@
  *
  * The event handlers of dwm are organized in an array which is accessed
  * whenever a new event has been fetched. This allows event dispatching
- * in O(1) time.
+ * in O(1) time. Handlers only mark the monitors they affect as needing to be
+ * arranged, restacked or have their bar redrawn; that work is done once all
+ * queued events have been handled.
  *
  * Each child of the root window is called a client, except windows which have
  * set the override_redirect flag. Clients are organized in a linked client
@@ -16,6 +18,10 @@
  * on each monitor. Each client contains a bit array to indicate the tags of a
  * client.
  *
+ * Clients, systray icons and bars are also indexed by their window in hash
+ * tables, so that event handlers find the client or monitor an event is for
+ * in O(1) time, however many windows are managed.
+ *
  * Keys and tagging rules are organized as arrays and defined in config.h.
  *
  * To understand everything else, start reading main().
@@ -27,6 +33,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -56,6 +63,10 @@
 #define HEIGHT(X)               ((X)->h + 2 * (X)->bw)
 #define TAGMASK                 ((1 << LENGTH(tags)) - 1)
 #define TEXTW(X)                (drw_fontset_getwidth(drw, (X)) + lrpad)
+#define LONGBITS                (sizeof(unsigned long) * 8)
+#define RULEWORDS               ((LENGTH(rules) + LONGBITS - 1) / LONGBITS)
+#define FLUSHEVENTS             64 /* events handled before flushmons() anyway */
+#define FLUSHPASSES             4  /* flushmons() passes for work marked by work */
 
 #define SYSTEM_TRAY_REQUEST_DOCK    0
 /* XEMBED messages */
@@ -81,6 +92,8 @@ enum { Manager, Xembed, XembedInfo, XLast }; /* Xembed atoms */
 enum { WMProtocols, WMDelete, WMState, WMTakeFocus, WMLast }; /* default atoms */
 enum { ClkTagBar, ClkLtSymbol, ClkStatusText, ClkWinTitle,
        ClkClientWin, ClkRootWin, ClkLast }; /* clicks */
+enum { BarStatus, BarLtSymbol, BarTitle, BarSystray, BarTags }; /* bar segments, BarTags + i for tag i */
+enum { NeedArrange = 1 << 0, NeedRestack = 1 << 1, NeedBar = 1 << 2 }; /* deferred monitor work */
 
 typedef union {
 	int i;
@@ -104,12 +117,18 @@ struct Client {
 	float mina, maxa;
 	int x, y, w, h;
 	int oldx, oldy, oldw, oldh;
+	int cfgx, cfgy, cfgw, cfgh, cfgbw; /* geometry last sent to the server */
+	int stackpos; /* index in mon->stacked, if stackstamp is restacks */
+	unsigned long stackstamp;
 	int basew, baseh, incw, inch, maxw, maxh, minw, minh, hintsvalid;
 	int bw, oldbw;
 	unsigned int tags;
 	int isfixed, isfloating, isurgent, neverfocus, oldstate, isfullscreen;
+	int isvisible; /* in mon->vclients and mon->vstack */
 	Client *next;
 	Client *snext;
+	Client *vnext;
+	Client *vsnext;
 	Monitor *mon;
 	Window win;
 };
@@ -126,6 +145,12 @@ typedef struct {
 	void (*arrange)(Monitor *);
 } Layout;
 
+typedef struct {
+	int x, w;           /* where the segment was drawn, w is 0 if it was not */
+	unsigned int state; /* scheme and boxes it was drawn with */
+	char text[256];     /* text it was drawn with */
+} BarSegment;
+
 typedef struct Pertag Pertag;
 struct Monitor {
 	char ltsymbol[16];
@@ -143,8 +168,18 @@ struct Monitor {
 	Client *clients;
 	Client *sel;
 	Client *stack;
+	Client *vclients;     /* visible clients, in clients order */
+	Client *vstack;       /* visible clients, in stack order */
+	Window *hiding;       /* clients hidden since showhide() last ran */
+	int nhiding, hidingsize;
 	Monitor *next;
 	Window barwin;
+	Pixmap barpix;        /* the bar as last drawn */
+	int barpixw;          /* width of barpix, 0 if there is none */
+	BarSegment *barsegs;  /* what barpix was drawn from */
+	unsigned int needs;   /* deferred work, done by flushmons() */
+	Window *stacked;      /* tiled clients as last stacked, top first */
+	int nstacked;
 	const Layout *lt[2];
 	Pertag *pertag;
 };
@@ -158,12 +193,40 @@ typedef struct {
 	int monitor;
 } Rule;
 
+/* Aho-Corasick automaton over one field of all rules, which finds the rules
+ * whose pattern occurs in a string in one pass over it. */
+typedef struct {
+	int *fail;           /* per node, longest proper suffix in the trie */
+	int *pat;            /* per node, pattern ending here or -1 */
+	int *dict;           /* per node, next node on the fail chain ending a pattern */
+	unsigned int *keys;  /* goto table, node << 8 | byte */
+	int *next;           /* goto table, target node, 0 marks an empty slot */
+	unsigned int bits;   /* the goto table has 1 << bits slots */
+	int *patrules;       /* rules of pattern p are patrules[patstart[p]..patstart[p + 1]] */
+	int *patstart;
+	int npats;
+	unsigned long *any;  /* rules without a pattern, they always match */
+} Matcher;
+
 typedef struct Systray   Systray;
 struct Systray {
 	Window win;
 	Client *icons;
 };
 
+typedef struct {
+	unsigned int *ids; /* a code and cleaned mask, 0 marks an empty slot */
+	int *vals;         /* index into keys[] or buttons[] */
+	unsigned int bits; /* the table has 1 << bits slots */
+} BindMap;
+
+typedef struct {
+	Window *wins; /* None marks an empty slot */
+	void **vals;
+	unsigned int bits; /* the table has 1 << bits slots */
+	unsigned int n;
+} WinMap;
+
 /* function declarations */
 static void applyrules(Client *c);
 static int applysizehints(Client *c, int *x, int *y, int *w, int *h, int interact);
@@ -171,11 +234,16 @@ static void arrange(Monitor *m);
 static void arrangemon(Monitor *m);
 static void attach(Client *c);
 static void attachstack(Client *c);
+static void bardamage(XRectangle *damage, unsigned int *n, int x, int w);
+static int barsegment(Monitor *m, int seg, int x, int w, unsigned int state, const char *text);
+static void bindmapinit(BindMap *map, unsigned int n);
+static void bindmapput(BindMap *map, unsigned int id, int val);
 static void buttonpress(XEvent *e);
 static void checkotherwm(void);
 static void cleanup(void);
 static void cleanupmon(Monitor *mon);
 static void clientmessage(XEvent *e);
+static void compilerules(void);
 static void configure(Client *c);
 static void configurenotify(XEvent *e);
 static void configurerequest(XEvent *e);
@@ -185,9 +253,11 @@ static void detach(Client *c);
 static void detachstack(Client *c);
 static Monitor *dirtomon(int dir);
 static void drawbar(Monitor *m);
+static void drawbarmon(Monitor *m);
 static void drawbars(void);
 static void enternotify(XEvent *e);
 static void expose(XEvent *e);
+static void flushmons(void);
 static void focus(Client *c);
 static void focusin(XEvent *e);
 static void focusmon(const Arg *arg);
@@ -205,12 +275,19 @@ static void killclient(const Arg *arg);
 static void manage(Window w, XWindowAttributes *wa);
 static void mappingnotify(XEvent *e);
 static void maprequest(XEvent *e);
+static void matcherfree(Matcher *mt);
+static void matcherinit(Matcher *mt, const char **pats, int n);
+static void matcherscan(Matcher *mt, const char *s, unsigned long *set);
 static void monocle(Monitor *m);
 static void motionnotify(XEvent *e);
 static void movemouse(const Arg *arg);
 static Client *nexttiled(Client *c);
 static void pop(Client *c);
+#ifdef STATS
+static void printstats(void);
+#endif /* STATS */
 static void propertynotify(XEvent *e);
+static void queuehide(Client *c);
 static void quit(const Arg *arg);
 static Monitor *recttomon(int x, int y, int w, int h);
 static void resetlayout(const Arg *arg);
@@ -218,6 +295,7 @@ static void resize(Client *c, int x, int y, int w, int h, int interact);
 static void resizeclient(Client *c, int x, int y, int w, int h);
 static void resizemouse(const Arg *arg);
 static void restack(Monitor *m);
+static int restackmon(Monitor *m);
 static void run(void);
 static void scan(void);
 //static int sendevent(Client *c, Atom proto);
@@ -229,7 +307,7 @@ static void setlayout(const Arg *arg);
 static void setmfact(const Arg *arg);
 static void setup(void);
 static void seturgent(Client *c, int urg);
-static void showhide(Client *c);
+static void showhide(Monitor *m);
 static void spawn(const Arg *arg);
 static Monitor *systraytomon(Monitor *m);
 static void tag(const Arg *arg);
@@ -242,8 +320,10 @@ static void toggleview(const Arg *arg);
 static void unfocus(Client *c, int setfocus);
 static void unmanage(Client *c, int destroyed);
 static void unmapnotify(XEvent *e);
+static void unstack(Client *c);
 static void updatebarpos(Monitor *m);
 static void updatebars(void);
+static void updatebuttonmap(void);
 static void updateclientlist(void);
 static int updategeom(void);
 static void updatenumlockmask(void);
@@ -253,9 +333,14 @@ static void updatesystray(void);
 static void updatesystrayicongeom(Client *i, int w, int h);
 static void updatesystrayiconstate(Client *i, XPropertyEvent *ev);
 static void updatetitle(Client *c);
+static void updatevisible(Monitor *m);
 static void updatewindowtype(Client *c);
 static void updatewmhints(Client *c);
 static void view(const Arg *arg);
+static void winmapdel(WinMap *map, Window w);
+static void winmapfree(WinMap *map);
+static void *winmapget(WinMap *map, Window w);
+static void winmapput(WinMap *map, Window w, void *val);
 static Client *wintoclient(Window w);
 static Monitor *wintomon(Window w);
 static Client *wintosystrayicon(Window w);
@@ -298,12 +383,26 @@ static void (*handler[LASTEvent]) (XEvent *) = {
 };
 static Atom wmatom[WMLast], netatom[NetLast], xatom[XLast];
 static int running = 1;
+static unsigned long restacks = 0;
 static Cur *cursor[CurLast];
 static Clr **scheme;
 static Display *dpy;
 static Drw *drw;
 static Monitor *mons, *selmon;
 static Window root, wmcheckwin;
+static WinMap clientmap, iconmap, barmap;
+static BindMap keymap, buttonmap;
+static Matcher classmatcher, instancematcher, titlematcher;
+static unsigned long *rulesets; /* scratch for applyrules(), three bitsets of rules */
+#ifdef STATS
+static struct {
+	time_t since;
+	unsigned long barpixels; /* bar pixels redrawn */
+	unsigned long arranges;  /* arrange() calls */
+	unsigned long layouts;   /* monitors actually arranged */
+	unsigned long requests;  /* X requests made by flushmons() when it arranged */
+} stats;
+#endif /* STATS */
 
 /* configuration, allows nested code to access above variables */
 #include "config.h"
@@ -325,7 +424,9 @@ void
 applyrules(Client *c)
 {
 	const char *class, *instance;
-	unsigned int i;
+	unsigned int i, w;
+	unsigned long match;
+	unsigned long *cset = rulesets, *iset = cset + RULEWORDS, *tset = iset + RULEWORDS;
 	const Rule *r;
 	Monitor *m;
 	XClassHint ch = { NULL, NULL };
@@ -337,19 +438,22 @@ applyrules(Client *c)
 	class    = ch.res_class ? ch.res_class : broken;
 	instance = ch.res_name  ? ch.res_name  : broken;
 
-	for (i = 0; i < LENGTH(rules); i++) {
-		r = &rules[i];
-		if ((!r->title || strstr(c->name, r->title))
-		&& (!r->class || strstr(class, r->class))
-		&& (!r->instance || strstr(instance, r->instance)))
-		{
+	/* the rules whose class, instance and title patterns all occur, as with
+	 * strstr(), applied in order */
+	matcherscan(&classmatcher, class, cset);
+	matcherscan(&instancematcher, instance, iset);
+	matcherscan(&titlematcher, c->name, tset);
+	for (w = 0; w < RULEWORDS; w++)
+		for (i = w * LONGBITS, match = cset[w] & iset[w] & tset[w]; match; i++, match >>= 1) {
+			if (!(match & 1))
+				continue;
+			r = &rules[i];
 			c->isfloating = r->isfloating;
 			c->tags |= r->tags;
 			for (m = mons; m && m->num != r->monitor; m = m->next);
 			if (m)
 				c->mon = m;
 		}
-	}
 	if (ch.res_class)
 		XFree(ch.res_class);
 	if (ch.res_name)
@@ -425,18 +529,18 @@ applysizehints(Client *c, int *x, int *y, int *w, int *h, int interact)
 	return *x != c->x || *y != c->y || *w != c->w || *h != c->h;
 }
 
+/* arrange(), restack() and drawbar() only mark the monitor. The work is done
+ * once by flushmons(), when run() has handled all pending events. */
 void
 arrange(Monitor *m)
 {
+#ifdef STATS
+	stats.arranges++;
+#endif /* STATS */
 	if (m)
-		showhide(m->stack);
+		m->needs |= NeedArrange | NeedRestack;
 	else for (m = mons; m; m = m->next)
-		showhide(m->stack);
-	if (m) {
-		arrangemon(m);
-		restack(m);
-	} else for (m = mons; m; m = m->next)
-		arrangemon(m);
+		m->needs |= NeedArrange;
 }
 
 void
@@ -452,6 +556,10 @@ attach(Client *c)
 {
 	c->next = c->mon->clients;
 	c->mon->clients = c;
+	if (c->isvisible) {
+		c->vnext = c->mon->vclients;
+		c->mon->vclients = c;
+	}
 }
 
 void
@@ -459,12 +567,78 @@ attachstack(Client *c)
 {
 	c->snext = c->mon->stack;
 	c->mon->stack = c;
+	if (c->isvisible) {
+		c->vsnext = c->mon->vstack;
+		c->mon->vstack = c;
+	}
+}
+
+void
+bardamage(XRectangle *damage, unsigned int *n, int x, int w)
+{
+	/* segments are drawn left to right, so neighbours can be merged */
+	if (*n && damage[*n - 1].x + damage[*n - 1].width == x) {
+		damage[*n - 1].width += w;
+		return;
+	}
+	damage[*n].x = x;
+	damage[*n].y = 0;
+	damage[*n].width = w;
+	damage[*n].height = bh;
+	(*n)++;
+}
+
+/* Records what a bar segment is drawn from and returns whether that differs
+ * from what is in the monitor's bar pixmap. */
+int
+barsegment(Monitor *m, int seg, int x, int w, unsigned int state, const char *text)
+{
+	BarSegment *s = &m->barsegs[seg];
+
+	if (s->x == x && s->w == w && s->state == state && !strcmp(s->text, text))
+		return 0;
+	s->x = x;
+	s->w = w;
+	s->state = state;
+	strncpy(s->text, text, sizeof s->text - 1);
+	return 1;
+}
+
+static unsigned int
+bindmaphash(BindMap *map, unsigned int id)
+{
+	return (id * 2654435769U) >> (32 - map->bits);
+}
+
+/* Key and button bindings are compiled into tables from a keycode or button
+ * and the cleaned modifier mask to the bindings, so that dispatching an event
+ * is a hash lookup however many bindings there are. A table is sized for n
+ * entries up front and never grows, which keeps bindings for the same id in
+ * the order they were put. */
+void
+bindmapinit(BindMap *map, unsigned int n)
+{
+	free(map->ids);
+	free(map->vals);
+	for (map->bits = 4; (1U << map->bits) < 2 * n; map->bits++);
+	map->ids = ecalloc(1 << map->bits, sizeof(unsigned int));
+	map->vals = ecalloc(1 << map->bits, sizeof(int));
+}
+
+void
+bindmapput(BindMap *map, unsigned int id, int val)
+{
+	unsigned int i, mask = (1U << map->bits) - 1;
+
+	for (i = bindmaphash(map, id); map->ids[i]; i = (i + 1) & mask);
+	map->ids[i] = id;
+	map->vals[i] = val;
 }
 
 void
 buttonpress(XEvent *e)
 {
-	unsigned int i, x, click;
+	unsigned int i, j, x, click, id, mask;
 	Arg arg = {0};
 	Client *c;
 	Monitor *m;
@@ -497,10 +671,13 @@ buttonpress(XEvent *e)
 		XAllowEvents(dpy, ReplayPointer, CurrentTime);
 		click = ClkClientWin;
 	}
-	for (i = 0; i < LENGTH(buttons); i++)
-		if (click == buttons[i].click && buttons[i].func && buttons[i].button == ev->button
-		&& CLEANMASK(buttons[i].mask) == CLEANMASK(ev->state))
+	id = click << 16 | ev->button << 8 | CLEANMASK(ev->state);
+	mask = (1U << buttonmap.bits) - 1;
+	for (j = bindmaphash(&buttonmap, id); buttonmap.ids[j]; j = (j + 1) & mask)
+		if (buttonmap.ids[j] == id) {
+			i = buttonmap.vals[j];
 			buttons[i].func(click == ClkTagBar && buttons[i].arg.i == 0 ? &arg : &buttons[i].arg);
+		}
 }
 
 void
@@ -523,6 +700,7 @@ cleanup(void)
 	size_t i;
 
 	view(&a);
+	flushmons();
 	selmon->lt[selmon->sellt] = &foo;
 	for (m = mons; m; m = m->next)
 		while (m->stack)
@@ -543,6 +721,17 @@ cleanup(void)
 		free(scheme[i]);
 	free(scheme);
 	XDestroyWindow(dpy, wmcheckwin);
+	winmapfree(&clientmap);
+	winmapfree(&iconmap);
+	winmapfree(&barmap);
+	free(keymap.ids);
+	free(keymap.vals);
+	free(buttonmap.ids);
+	free(buttonmap.vals);
+	matcherfree(&classmatcher);
+	matcherfree(&instancematcher);
+	matcherfree(&titlematcher);
+	free(rulesets);
 	drw_free(drw);
 	XSync(dpy, False);
 	XSetInputFocus(dpy, PointerRoot, RevertToPointerRoot, CurrentTime);
@@ -560,8 +749,14 @@ cleanupmon(Monitor *mon)
 		for (m = mons; m && m->next != mon; m = m->next);
 		m->next = mon->next;
 	}
+	winmapdel(&barmap, mon->barwin);
 	XUnmapWindow(dpy, mon->barwin);
 	XDestroyWindow(dpy, mon->barwin);
+	if (mon->barpix)
+		XFreePixmap(dpy, mon->barpix);
+	free(mon->barsegs);
+	free(mon->stacked);
+	free(mon->hiding);
 	free(mon);
 }
 
@@ -585,6 +780,7 @@ clientmessage(XEvent *e)
 			c->mon = selmon;
 			c->next = systray->icons;
 			systray->icons = c;
+			winmapput(&iconmap, c->win, c);
 			if (!XGetWindowAttributes(dpy, c->win, &wa)) {
 				/* use sane defaults */
 				wa.width = bh;
@@ -633,6 +829,24 @@ clientmessage(XEvent *e)
 	}
 }
 
+void
+compilerules(void)
+{
+	const char *pats[LENGTH(rules)];
+	unsigned int i;
+
+	for (i = 0; i < LENGTH(rules); i++)
+		pats[i] = rules[i].class;
+	matcherinit(&classmatcher, pats, LENGTH(rules));
+	for (i = 0; i < LENGTH(rules); i++)
+		pats[i] = rules[i].instance;
+	matcherinit(&instancematcher, pats, LENGTH(rules));
+	for (i = 0; i < LENGTH(rules); i++)
+		pats[i] = rules[i].title;
+	matcherinit(&titlematcher, pats, LENGTH(rules));
+	rulesets = ecalloc(3 * RULEWORDS, sizeof(unsigned long));
+}
+
 void
 configure(Client *c)
 {
@@ -716,7 +930,8 @@ configurerequest(XEvent *e)
 			if ((ev->value_mask & (CWX|CWY)) && !(ev->value_mask & (CWWidth|CWHeight)))
 				configure(c);
 			if (ISVISIBLE(c))
-				XMoveResizeWindow(dpy, c->win, c->x, c->y, c->w, c->h);
+				XMoveResizeWindow(dpy, c->win, c->cfgx = c->x, c->cfgy = c->y,
+					c->cfgw = c->w, c->cfgh = c->h);
 		} else
 			configure(c);
 	} else {
@@ -747,6 +962,7 @@ createmon(void)
 	m->lt[0] = &layouts[0];
 	m->lt[1] = &layouts[1 % LENGTH(layouts)];
 	strncpy(m->ltsymbol, layouts[0].symbol, sizeof m->ltsymbol);
+	m->barsegs = ecalloc(BarTags + LENGTH(tags), sizeof(BarSegment));
 	m->pertag = ecalloc(1, sizeof(Pertag));
 	m->pertag->curtag = m->pertag->prevtag = 1;
 
@@ -786,20 +1002,26 @@ detach(Client *c)
 
 	for (tc = &c->mon->clients; *tc && *tc != c; tc = &(*tc)->next);
 	*tc = c->next;
+	if (c->isvisible) {
+		for (tc = &c->mon->vclients; *tc && *tc != c; tc = &(*tc)->vnext);
+		*tc = c->vnext;
+	}
 }
 
 void
 detachstack(Client *c)
 {
-	Client **tc, *t;
+	Client **tc;
 
 	for (tc = &c->mon->stack; *tc && *tc != c; tc = &(*tc)->snext);
 	*tc = c->snext;
-
-	if (c == c->mon->sel) {
-		for (t = c->mon->stack; t && !ISVISIBLE(t); t = t->snext);
-		c->mon->sel = t;
+	if (c->isvisible) {
+		for (tc = &c->mon->vstack; *tc && *tc != c; tc = &(*tc)->vsnext);
+		*tc = c->vsnext;
 	}
+
+	if (c == c->mon->sel)
+		c->mon->sel = c->mon->vstack;
 }
 
 Monitor *
@@ -820,10 +1042,20 @@ dirtomon(int dir)
 void
 drawbar(Monitor *m)
 {
-	int x, w, tw = 0, stw = 0;
+	m->needs |= NeedBar;
+}
+
+/* Only the segments of the bar whose inputs changed since they were last drawn
+ * are redrawn, and only those are copied into the monitor's bar pixmap and
+ * window. Expose events are served from the pixmap. */
+void
+drawbarmon(Monitor *m)
+{
+	int x, w, tw = 0, stw = 0, sx, force;
 	int boxs = drw->fonts->h / 9;
 	int boxw = drw->fonts->h / 6 + 2;
-	unsigned int i, occ = 0, urg = 0;
+	unsigned int i, occ = 0, urg = 0, state, ndamage = 0;
+	XRectangle damage[BarTags + LENGTH(tags)];
 	Client *c;
 
 	if (!m->showbar)
@@ -832,11 +1064,16 @@ drawbar(Monitor *m)
 	if(showsystray && m == systraytomon(m) && !systrayonleft)
 		stw = getsystraywidth();
 
-	/* draw status first so it can be overdrawn by tags later */
-	if (m == selmon) { /* status is only drawn on selected monitor */
-		drw_setscheme(drw, scheme[SchemeNorm]);
-		tw = TEXTW(stext) - lrpad / 2 + 2; /* 2px extra right padding */
-		drw_text(drw, m->ww - tw - stw, 0, tw, bh, lrpad / 2 - 2, stext, 0);
+	if (m->barpixw != m->ww) {
+		if (m->barpix)
+			XFreePixmap(dpy, m->barpix);
+		m->barpix = XCreatePixmap(dpy, root, m->ww, bh, DefaultDepth(dpy, screen));
+		m->barpixw = m->ww;
+		/* expose copies all of it, so nothing may be left undefined */
+		XSetForeground(dpy, drw->gc, scheme[SchemeNorm][ColBg].pixel);
+		XFillRectangle(dpy, m->barpix, drw->gc, 0, 0, m->ww, bh);
+		for (i = 0; i < BarTags + LENGTH(tags); i++)
+			m->barsegs[i].x = -1;
 	}
 
 	resizebarwin(m);
@@ -845,33 +1082,81 @@ drawbar(Monitor *m)
 		if (c->isurgent)
 			urg |= c->tags;
 	}
+
+	/* draw status first so it can be overdrawn by tags later */
+	if (m == selmon) /* status is only drawn on selected monitor */
+		tw = TEXTW(stext) - lrpad / 2 + 2; /* 2px extra right padding */
+	sx = m->ww - tw - stw;
+	force = 0;
+	if (barsegment(m, BarStatus, sx, tw, 0, tw ? stext : "") && tw) {
+		drw_setscheme(drw, scheme[SchemeNorm]);
+		drw_text(drw, sx, 0, tw, bh, lrpad / 2 - 2, stext, 0);
+		/* a status too long for the bar went over the tags */
+		for (i = 0, x = TEXTW(m->ltsymbol); i < LENGTH(tags); i++)
+			x += TEXTW(tags[i]);
+		force = sx < x;
+		bardamage(damage, &ndamage, sx, tw);
+	}
+	if (barsegment(m, BarSystray, m->ww - stw, stw, 0, "") && stw) {
+		drw_setscheme(drw, scheme[SchemeNorm]);
+		drw_rect(drw, m->ww - stw, 0, stw, bh, 1, 1);
+		bardamage(damage, &ndamage, m->ww - stw, stw);
+	}
 	x = 0;
 	for (i = 0; i < LENGTH(tags); i++) {
 		w = TEXTW(tags[i]);
-		drw_setscheme(drw, scheme[m->tagset[m->seltags] & 1 << i ? SchemeSel : SchemeNorm]);
-		drw_text(drw, x, 0, w, bh, lrpad / 2, tags[i], urg & 1 << i);
-		if (occ & 1 << i)
-			drw_rect(drw, x + boxs, boxs, boxw, boxw,
-				m == selmon && selmon->sel && selmon->sel->tags & 1 << i,
-				urg & 1 << i);
+		state = (m->tagset[m->seltags] & 1 << i ? 1 : 0)
+			| (occ & 1 << i ? 2 : 0)
+			| (urg & 1 << i ? 4 : 0)
+			| (m == selmon && selmon->sel && selmon->sel->tags & 1 << i ? 8 : 0);
+		if (barsegment(m, BarTags + i, x, w, state, tags[i]) || force) {
+			drw_setscheme(drw, scheme[state & 1 ? SchemeSel : SchemeNorm]);
+			drw_text(drw, x, 0, w, bh, lrpad / 2, tags[i], state & 4);
+			if (state & 2)
+				drw_rect(drw, x + boxs, boxs, boxw, boxw, state & 8, state & 4);
+			bardamage(damage, &ndamage, x, w);
+		}
 		x += w;
 	}
 	w = TEXTW(m->ltsymbol);
-	drw_setscheme(drw, scheme[SchemeNorm]);
-	x = drw_text(drw, x, 0, w, bh, lrpad / 2, m->ltsymbol, 0);
-
-	if ((w = m->ww - tw - stw - x) > bh) {
-		if (m->sel) {
-			drw_setscheme(drw, scheme[m == selmon ? SchemeSel : SchemeNorm]);
-			drw_text(drw, x, 0, w, bh, lrpad / 2, m->sel->name, 0);
-			if (m->sel->isfloating)
-				drw_rect(drw, x + boxs, boxs, boxw, boxw, m->sel->isfixed, 0);
-		} else {
-			drw_setscheme(drw, scheme[SchemeNorm]);
-			drw_rect(drw, x, 0, w, bh, 1, 1);
+	if (barsegment(m, BarLtSymbol, x, w, 0, m->ltsymbol) || force) {
+		drw_setscheme(drw, scheme[SchemeNorm]);
+		drw_text(drw, x, 0, w, bh, lrpad / 2, m->ltsymbol, 0);
+		bardamage(damage, &ndamage, x, w);
+	}
+	x += w;
+
+	if ((w = sx - x) > bh) {
+		state = m->sel ? 1 | (m == selmon ? 2 : 0)
+			| (m->sel->isfloating ? 4 : 0) | (m->sel->isfixed ? 8 : 0) : 0;
+		if (barsegment(m, BarTitle, x, w, state, m->sel ? m->sel->name : "")) {
+			if (m->sel) {
+				drw_setscheme(drw, scheme[m == selmon ? SchemeSel : SchemeNorm]);
+				drw_text(drw, x, 0, w, bh, lrpad / 2, m->sel->name, 0);
+				if (m->sel->isfloating)
+					drw_rect(drw, x + boxs, boxs, boxw, boxw, m->sel->isfixed, 0);
+			} else {
+				drw_setscheme(drw, scheme[SchemeNorm]);
+				drw_rect(drw, x, 0, w, bh, 1, 1);
+			}
+			bardamage(damage, &ndamage, x, w);
 		}
+	} else if (barsegment(m, BarTitle, x, MAX(w, 0), 0, "") && w > 0) {
+		/* too narrow for a title, but the gap must not keep an old one */
+		drw_setscheme(drw, scheme[SchemeNorm]);
+		drw_rect(drw, x, 0, w, bh, 1, 1);
+		bardamage(damage, &ndamage, x, w);
+	}
+
+	for (i = 0; i < ndamage; i++) {
+		drw_copy(drw, m->barpix, damage[i].x, 0, damage[i].width, bh);
+		drw_copy(drw, m->barwin, damage[i].x, 0, damage[i].width, bh);
+#ifdef STATS
+		stats.barpixels += damage[i].width * bh;
+#endif /* STATS */
 	}
-	drw_map(drw, m->barwin, 0, 0, m->ww - stw, bh);
+	if (ndamage)
+		XSync(dpy, False);
 }
 
 void
@@ -909,17 +1194,66 @@ expose(XEvent *e)
 	XExposeEvent *ev = &e->xexpose;
 
 	if (ev->count == 0 && (m = wintomon(ev->window))) {
-		drawbar(m);
+		if (m->barpixw)
+			XCopyArea(dpy, m->barpix, m->barwin, drw->gc, 0, 0, m->barpixw, bh, 0, 0);
+		else
+			drawbarmon(m);
 		if (m == selmon)
 			updatesystray();
 	}
 }
 
+/* The work may mark monitors again, so it is repeated until nothing is left,
+ * up to FLUSHPASSES times. Whatever is still marked then is done by the next
+ * call rather than looping forever. */
+void
+flushmons(void)
+{
+	Monitor *m;
+	unsigned int needs, pending, pass, arranged = 0;
+	int sync = 0;
+#ifdef STATS
+	unsigned long req = NextRequest(dpy);
+#endif /* STATS */
+
+	for (pass = 0; pass < FLUSHPASSES; pass++) {
+		for (pending = 0, m = mons; m; m = m->next)
+			pending |= m->needs;
+		if (!pending)
+			break;
+		for (m = mons; m; m = m->next)
+			if (m->needs & NeedArrange)
+				showhide(m);
+		for (m = mons; m; m = m->next) {
+			needs = m->needs;
+			m->needs = 0;
+			if (needs & NeedArrange) {
+				arrangemon(m);
+				arranged++;
+				sync = 1;
+			}
+			if (needs & (NeedRestack | NeedBar))
+				drawbarmon(m);
+			if ((needs & NeedRestack) && restackmon(m))
+				sync = 0;
+		}
+	}
+	/* resizeclient() leaves syncing the configures to us */
+	if (sync)
+		XSync(dpy, False);
+#ifdef STATS
+	if (arranged) {
+		stats.layouts += arranged;
+		stats.requests += NextRequest(dpy) - req;
+	}
+#endif /* STATS */
+}
+
 void
 focus(Client *c)
 {
 	if (!c || !ISVISIBLE(c))
-		for (c = selmon->stack; c && !ISVISIBLE(c); c = c->snext);
+		c = selmon->vstack;
 	if (selmon->sel && selmon->sel != c)
 		unfocus(selmon->sel, 0);
 	if (c) {
@@ -972,17 +1306,14 @@ focusstack(const Arg *arg)
 	if (!selmon->sel || (selmon->sel->isfullscreen && lockfullscreen))
 		return;
 	if (arg->i > 0) {
-		for (c = selmon->sel->next; c && !ISVISIBLE(c); c = c->next);
-		if (!c)
-			for (c = selmon->clients; c && !ISVISIBLE(c); c = c->next);
+		if (!(c = selmon->sel->vnext))
+			c = selmon->vclients;
 	} else {
-		for (i = selmon->clients; i != selmon->sel; i = i->next)
-			if (ISVISIBLE(i))
-				c = i;
+		for (i = selmon->vclients; i != selmon->sel; i = i->vnext)
+			c = i;
 		if (!c)
-			for (; i; i = i->next)
-				if (ISVISIBLE(i))
-					c = i;
+			for (; i; i = i->vnext)
+				c = i;
 	}
 	if (c) {
 		focus(c);
@@ -1078,7 +1409,6 @@ gettextprop(Window w, Atom atom, char *text, unsigned int size)
 void
 grabbuttons(Client *c, int focused)
 {
-	updatenumlockmask();
 	{
 		unsigned int i, j;
 		unsigned int modifiers[] = { 0, LockMask, numlockmask, numlockmask|LockMask };
@@ -1096,30 +1426,54 @@ grabbuttons(Client *c, int focused)
 	}
 }
 
+/* Also compiles keymap from the keyboard mapping, and the button bindings,
+ * since both depend on it. */
 void
 grabkeys(void)
 {
 	updatenumlockmask();
+	updatebuttonmap();
 	{
-		unsigned int i, j, k;
+		unsigned int i, j, k, n, mask;
 		unsigned int modifiers[] = { 0, LockMask, numlockmask, numlockmask|LockMask };
 		int start, end, skip;
 		KeySym *syms;
+		BindMap symmap = { 0 };
 
 		XUngrabKey(dpy, AnyKey, AnyModifier, root);
+		bindmapinit(&keymap, 0);
 		XDisplayKeycodes(dpy, &start, &end);
 		syms = XGetKeyboardMapping(dpy, start, end - start + 1, &skip);
 		if (!syms)
 			return;
+		/* keysym to bindings, so each keycode is a lookup */
+		bindmapinit(&symmap, LENGTH(keys));
+		for (i = 0; i < LENGTH(keys); i++)
+			if (keys[i].keysym != NoSymbol)
+				bindmapput(&symmap, keys[i].keysym, i);
+		mask = (1U << symmap.bits) - 1;
+		for (n = 0, k = start; k <= end; k++)
+			for (j = bindmaphash(&symmap, syms[(k - start) * skip]); symmap.ids[j]; j = (j + 1) & mask)
+				if (symmap.ids[j] == syms[(k - start) * skip])
+					n++;
+		bindmapinit(&keymap, n);
+		/* all grabs go out in one pass, without waiting on the server */
 		for (k = start; k <= end; k++)
-			for (i = 0; i < LENGTH(keys); i++)
+			for (j = bindmaphash(&symmap, syms[(k - start) * skip]); symmap.ids[j]; j = (j + 1) & mask) {
 				/* skip modifier codes, we do that ourselves */
-				if (keys[i].keysym == syms[(k - start) * skip])
-					for (j = 0; j < LENGTH(modifiers); j++)
-						XGrabKey(dpy, k,
-							 keys[i].mod | modifiers[j],
-							 root, True,
-							 GrabModeAsync, GrabModeAsync);
+				if (symmap.ids[j] != syms[(k - start) * skip])
+					continue;
+				i = symmap.vals[j];
+				if (keys[i].func)
+					bindmapput(&keymap, k << 8 | CLEANMASK(keys[i].mod), i);
+				for (n = 0; n < LENGTH(modifiers); n++)
+					XGrabKey(dpy, k,
+						 keys[i].mod | modifiers[n],
+						 root, True,
+						 GrabModeAsync, GrabModeAsync);
+			}
+		free(symmap.ids);
+		free(symmap.vals);
 		XFree(syms);
 	}
 }
@@ -1146,17 +1500,17 @@ isuniquegeom(XineramaScreenInfo *unique, size_t n, XineramaScreenInfo *info)
 void
 keypress(XEvent *e)
 {
-	unsigned int i;
-	KeySym keysym;
+	unsigned int i, j, id, mask;
 	XKeyEvent *ev;
 
 	ev = &e->xkey;
-	keysym = XKeycodeToKeysym(dpy, (KeyCode)ev->keycode, 0);
-	for (i = 0; i < LENGTH(keys); i++)
-		if (keysym == keys[i].keysym
-		&& CLEANMASK(keys[i].mod) == CLEANMASK(ev->state)
-		&& keys[i].func)
+	id = ev->keycode << 8 | CLEANMASK(ev->state);
+	mask = (1U << keymap.bits) - 1;
+	for (j = bindmaphash(&keymap, id); keymap.ids[j]; j = (j + 1) & mask)
+		if (keymap.ids[j] == id) {
+			i = keymap.vals[j];
 			keys[i].func(&(keys[i].arg));
+		}
 }
 
 void
@@ -1209,7 +1563,7 @@ manage(Window w, XWindowAttributes *wa)
 	c->y = MAX(c->y, c->mon->wy);
 	c->bw = borderpx;
 
-	wc.border_width = c->bw;
+	wc.border_width = c->cfgbw = c->bw;
 	XConfigureWindow(dpy, w, CWBorderWidth, &wc);
 	XSetWindowBorder(dpy, w, scheme[SchemeNorm][ColBorder].pixel);
 	configure(c); /* propagates border_width, if size doesn't change */
@@ -1222,11 +1576,15 @@ manage(Window w, XWindowAttributes *wa)
 		c->isfloating = c->oldstate = trans != None || c->isfixed;
 	if (c->isfloating)
 		XRaiseWindow(dpy, c->win);
+	if (!(c->isvisible = ISVISIBLE(c) ? 1 : 0))
+		queuehide(c);
 	attach(c);
 	attachstack(c);
+	winmapput(&clientmap, c->win, c);
 	XChangeProperty(dpy, root, netatom[NetClientList], XA_WINDOW, 32, PropModeAppend,
 		(unsigned char *) &(c->win), 1);
-	XMoveResizeWindow(dpy, c->win, c->x + 2 * sw, c->y, c->w, c->h); /* some windows require this */
+	XMoveResizeWindow(dpy, c->win, c->cfgx = c->x + 2 * sw, c->cfgy = c->y,
+		c->cfgw = c->w, c->cfgh = c->h); /* some windows require this */
 	setclientstate(c, NormalState);
 	if (c->mon == selmon)
 		unfocus(selmon->sel, 0);
@@ -1242,7 +1600,8 @@ mappingnotify(XEvent *e)
 	XMappingEvent *ev = &e->xmapping;
 
 	XRefreshKeyboardMapping(ev);
-	if (ev->request == MappingKeyboard)
+	/* the numlock modifier may have moved, so recompile either way */
+	if (ev->request == MappingKeyboard || ev->request == MappingModifier)
 		grabkeys();
 }
 
@@ -1265,18 +1624,153 @@ maprequest(XEvent *e)
 		manage(ev->window, &wa);
 }
 
+void
+matcherfree(Matcher *mt)
+{
+	free(mt->fail);
+	free(mt->pat);
+	free(mt->dict);
+	free(mt->keys);
+	free(mt->next);
+	free(mt->patrules);
+	free(mt->patstart);
+	free(mt->any);
+}
+
+static unsigned int
+matcherhash(Matcher *mt, unsigned int key)
+{
+	return (key * 2654435769U) >> (32 - mt->bits);
+}
+
+static int
+matchergoto(Matcher *mt, int node, unsigned char ch)
+{
+	unsigned int key = (unsigned int)node << 8 | ch, mask = (1U << mt->bits) - 1, i;
+
+	for (i = matcherhash(mt, key); mt->next[i]; i = (i + 1) & mask)
+		if (mt->keys[i] == key)
+			return mt->next[i];
+	return 0;
+}
+
+/* Builds the automaton for n patterns, one per rule. A NULL or empty pattern
+ * matches everything. */
+void
+matcherinit(Matcher *mt, const char **pats, int n)
+{
+	int i, j, k, t, node, child, npats = 0, nnodes = 1, maxnodes = 1;
+	int *queue, *sibling, *firstchild, *rulepat;
+	unsigned char *bytes;
+	unsigned int key, mask;
+	const char *p;
+
+	for (i = 0; i < n; i++)
+		if (pats[i])
+			maxnodes += strlen(pats[i]);
+	mt->fail = ecalloc(maxnodes, sizeof(int));
+	mt->pat = ecalloc(maxnodes, sizeof(int));
+	mt->dict = ecalloc(maxnodes, sizeof(int));
+	queue = ecalloc(maxnodes, sizeof(int));
+	sibling = ecalloc(maxnodes, sizeof(int));
+	firstchild = ecalloc(maxnodes, sizeof(int));
+	bytes = ecalloc(maxnodes, 1);
+	rulepat = ecalloc(n + 1, sizeof(int));
+	for (mt->bits = 4; (1U << mt->bits) < 2U * maxnodes; mt->bits++);
+	mask = (1U << mt->bits) - 1;
+	mt->keys = ecalloc(mask + 1, sizeof(unsigned int));
+	mt->next = ecalloc(mask + 1, sizeof(int));
+	mt->any = ecalloc(RULEWORDS, sizeof(unsigned long));
+	mt->pat[0] = -1;
+
+	/* trie of the patterns, the same pattern in several rules is one node */
+	for (i = 0; i < n; i++) {
+		if (!pats[i] || !*pats[i]) {
+			mt->any[i / LONGBITS] |= 1UL << (i % LONGBITS);
+			continue;
+		}
+		for (node = 0, p = pats[i]; *p; node = child, p++) {
+			if ((child = matchergoto(mt, node, *p)))
+				continue;
+			child = nnodes++;
+			mt->pat[child] = -1;
+			bytes[child] = *p;
+			sibling[child] = firstchild[node];
+			firstchild[node] = child;
+			key = (unsigned int)node << 8 | (unsigned char)*p;
+			for (k = matcherhash(mt, key); mt->next[k]; k = (k + 1) & mask);
+			mt->keys[k] = key;
+			mt->next[k] = child;
+		}
+		if (mt->pat[node] < 0)
+			mt->pat[node] = npats++;
+	}
+
+	/* rules per pattern, in rule order */
+	mt->npats = npats;
+	mt->patstart = ecalloc(npats + 2, sizeof(int));
+	mt->patrules = ecalloc(n + 1, sizeof(int));
+	for (i = 0; i < n; i++)
+		if (pats[i] && *pats[i]) {
+			for (node = 0, p = pats[i]; *p; p++)
+				node = matchergoto(mt, node, *p);
+			rulepat[i] = mt->pat[node];
+			mt->patstart[mt->pat[node] + 2]++;
+		}
+	for (j = 2; j < npats + 2; j++)
+		mt->patstart[j] += mt->patstart[j - 1];
+	for (i = 0; i < n; i++)
+		if (pats[i] && *pats[i])
+			mt->patrules[mt->patstart[rulepat[i] + 1]++] = i;
+
+	/* fail and dictionary links, breadth first, the root's children fail to
+	 * the root */
+	for (i = j = 0, child = firstchild[0]; child; child = sibling[child])
+		queue[j++] = child;
+	for (; i < j; i++)
+		for (node = queue[i], child = firstchild[node]; child; child = sibling[child]) {
+			for (k = mt->fail[node]; !(t = matchergoto(mt, k, bytes[child])) && k; k = mt->fail[k]);
+			mt->fail[child] = t;
+			mt->dict[child] = mt->pat[t] >= 0 ? t : mt->dict[t];
+			queue[j++] = child;
+		}
+	free(queue);
+	free(sibling);
+	free(firstchild);
+	free(bytes);
+	free(rulepat);
+}
+
+/* Sets the bits of the rules whose pattern occurs in s. */
+void
+matcherscan(Matcher *mt, const char *s, unsigned long *set)
+{
+	int node, t, k;
+
+	memcpy(set, mt->any, RULEWORDS * sizeof(unsigned long));
+	if (!mt->npats)
+		return;
+	for (node = 0; *s; s++) {
+		while (node && !matchergoto(mt, node, *s))
+			node = mt->fail[node];
+		node = matchergoto(mt, node, *s);
+		for (t = mt->pat[node] >= 0 ? node : mt->dict[node]; t; t = mt->dict[t])
+			for (k = mt->patstart[mt->pat[t]]; k < mt->patstart[mt->pat[t] + 1]; k++)
+				set[mt->patrules[k] / LONGBITS] |= 1UL << (mt->patrules[k] % LONGBITS);
+	}
+}
+
 void
 monocle(Monitor *m)
 {
 	unsigned int n = 0;
 	Client *c;
 
-	for (c = m->clients; c; c = c->next)
-		if (ISVISIBLE(c))
-			n++;
+	for (c = m->vclients; c; c = c->vnext)
+		n++;
 	if (n > 0) /* override layout symbol */
 		snprintf(m->ltsymbol, sizeof m->ltsymbol, "[%d]", n);
-	for (c = nexttiled(m->clients); c; c = nexttiled(c->next))
+	for (c = nexttiled(m->vclients); c; c = nexttiled(c->vnext))
 		resize(c, m->wx, m->wy, m->ww - 2 * c->bw, m->wh - 2 * c->bw, 0);
 }
 
@@ -1319,6 +1813,7 @@ movemouse(const Arg *arg)
 	if (!getrootptr(&x, &y))
 		return;
 	do {
+		flushmons();
 		XMaskEvent(dpy, MOUSEMASK|ExposureMask|SubstructureRedirectMask, &ev);
 		switch(ev.type) {
 		case ConfigureRequest:
@@ -1357,10 +1852,11 @@ movemouse(const Arg *arg)
 	}
 }
 
+/* c is a visible client, or NULL */
 Client *
 nexttiled(Client *c)
 {
-	for (; c && (c->isfloating || !ISVISIBLE(c)); c = c->next);
+	for (; c && c->isfloating; c = c->vnext);
 	return c;
 }
 
@@ -1373,6 +1869,26 @@ pop(Client *c)
 	arrange(c->mon);
 }
 
+#ifdef STATS
+void
+printstats(void)
+{
+	time_t now = time(NULL);
+
+	if (now == stats.since)
+		return;
+	if (stats.since)
+		fprintf(stderr, "dwm: %lu bar pixels/s, %lu arranges/s, %lu layouts/s, "
+		        "%lu requests/layout\n",
+		        stats.barpixels / (now - stats.since),
+		        stats.arranges / (now - stats.since),
+		        stats.layouts / (now - stats.since),
+		        stats.layouts ? stats.requests / stats.layouts : 0);
+	stats.since = now;
+	stats.barpixels = stats.arranges = stats.layouts = stats.requests = 0;
+}
+#endif /* STATS */
+
 void
 propertynotify(XEvent *e)
 {
@@ -1421,6 +1937,24 @@ propertynotify(XEvent *e)
 	}
 }
 
+/* have the next showhide() move c off screen */
+void
+queuehide(Client *c)
+{
+	Monitor *m = c->mon;
+	Window *hiding;
+
+	if (m->nhiding == m->hidingsize) {
+		m->hidingsize = m->hidingsize ? 2 * m->hidingsize : 16;
+		hiding = ecalloc(m->hidingsize, sizeof(Window));
+		if (m->nhiding)
+			memcpy(hiding, m->hiding, m->nhiding * sizeof(Window));
+		free(m->hiding);
+		m->hiding = hiding;
+	}
+	m->hiding[m->nhiding++] = c->win;
+}
+
 void
 quit(const Arg *arg)
 {
@@ -1461,6 +1995,7 @@ removesystrayicon(Client *i)
 	for (ii = &systray->icons; *ii && *ii != i; ii = &(*ii)->next);
 	if (ii)
 		*ii = i->next;
+	winmapdel(&iconmap, i->win);
 	free(i);
 }
 
@@ -1490,12 +2025,21 @@ resizeclient(Client *c, int x, int y, int w, int h)
 	c->oldh = c->h; c->h = wc.height = h;
 	wc.border_width = c->bw;
 
-    if ((nexttiled(c->mon->clients) == c) && !(nexttiled(c->next)))
+    if ((nexttiled(c->mon->vclients) == c) && !(nexttiled(c->vnext)))
 		resetlayout(NULL);
 
+	/* layouts resize every client on every arrange, most to where they are */
+	if (x == c->cfgx && y == c->cfgy && w == c->cfgw && h == c->cfgh && c->bw == c->cfgbw)
+		return;
+	c->cfgx = x;
+	c->cfgy = y;
+	c->cfgw = w;
+	c->cfgh = h;
+	c->cfgbw = c->bw;
 	XConfigureWindow(dpy, c->win, CWX|CWY|CWWidth|CWHeight|CWBorderWidth, &wc);
 	configure(c);
-	XSync(dpy, False);
+	if (!c->isvisible) /* the next arrange hides it again */
+		queuehide(c);
 }
 
 void
@@ -1519,6 +2063,7 @@ resizemouse(const Arg *arg)
 		return;
 	XWarpPointer(dpy, None, c->win, 0, 0, 0, 0, c->w + c->bw - 1, c->h + c->bw - 1);
 	do {
+		flushmons();
 		XMaskEvent(dpy, MOUSEMASK|ExposureMask|SubstructureRedirectMask, &ev);
 		switch(ev.type) {
 		case ConfigureRequest:
@@ -1570,38 +2115,107 @@ resizerequest(XEvent *e)
 
 void
 restack(Monitor *m)
+{
+	m->needs |= NeedRestack;
+}
+
+/* Tiled clients are stacked below the bar in focus order. The order last
+ * applied is kept in m->stacked, and the longest run of clients that are still
+ * in that order is left alone: only the others are restacked, each below the
+ * client before it. Focusing a client thus costs a single request. Anything
+ * that stacks a client behind our back must unstack() it. */
+int
+restackmon(Monitor *m)
 {
 	Client *c;
 	XEvent ev;
 	XWindowChanges wc;
+	Window *wins;
+	int i, j, n, len, lo, hi, *pos, *prev, *tail;
 
-	drawbar(m);
 	if (!m->sel)
-		return;
-	if (m->sel->isfloating || !m->lt[m->sellt]->arrange)
+		return 0;
+	if (m->sel->isfloating || !m->lt[m->sellt]->arrange) {
+		unstack(m->sel);
 		XRaiseWindow(dpy, m->sel->win);
+	}
 	if (m->lt[m->sellt]->arrange) {
+		restacks++;
+		for (j = 0; j < m->nstacked; j++)
+			if ((c = wintoclient(m->stacked[j])) && c->mon == m) {
+				c->stackpos = j;
+				c->stackstamp = restacks;
+			}
+		for (n = 0, c = m->vstack; c; c = c->vsnext)
+			if (!c->isfloating)
+				n++;
+		wins = ecalloc(n + 1, sizeof(Window));
+		pos = ecalloc(3 * n + 1, sizeof(int));
+		prev = pos + n;
+		tail = prev + n;
+		for (i = 0, c = m->vstack; c; c = c->vsnext)
+			if (!c->isfloating) {
+				wins[i] = c->win;
+				pos[i++] = c->stackstamp == restacks ? c->stackpos : -1;
+			}
+		/* longest increasing subsequence of the old positions */
+		for (i = len = 0; i < n; i++) {
+			if (pos[i] < 0)
+				continue;
+			for (lo = 0, hi = len; lo < hi;)
+				if (pos[tail[(lo + hi) / 2]] < pos[i])
+					lo = (lo + hi) / 2 + 1;
+				else
+					hi = (lo + hi) / 2;
+			prev[i] = lo ? tail[lo - 1] : -1;
+			tail[lo] = i;
+			if (lo == len)
+				len++;
+		}
+		j = len ? tail[len - 1] : -1;
+		memset(tail, 0, n * sizeof(int));
+		for (; j >= 0; j = prev[j])
+			tail[j] = 1; /* stays where it is */
 		wc.stack_mode = Below;
 		wc.sibling = m->barwin;
-		for (c = m->stack; c; c = c->snext)
-			if (!c->isfloating && ISVISIBLE(c)) {
-				XConfigureWindow(dpy, c->win, CWSibling|CWStackMode, &wc);
-				wc.sibling = c->win;
-			}
+		for (i = 0; i < n; i++) {
+			if (!tail[i])
+				XConfigureWindow(dpy, wins[i], CWSibling|CWStackMode, &wc);
+			wc.sibling = wins[i];
+		}
+		free(pos);
+		free(m->stacked);
+		m->stacked = wins;
+		m->nstacked = n;
 	}
 	XSync(dpy, False);
 	while (XCheckMaskEvent(dpy, EnterWindowMask, &ev));
+	return 1;
 }
 
 void
 run(void)
 {
 	XEvent ev;
+	unsigned int handled = 0;
 	/* main event loop */
 	XSync(dpy, False);
-	while (running && !XNextEvent(dpy, &ev))
+	while (running) {
+		/* handle everything queued before arranging and redrawing, but
+		 * don't let a steady stream of events hold the work off */
+		if (!XPending(dpy) || handled >= FLUSHEVENTS) {
+			flushmons();
+			handled = 0;
+		}
+		if (XNextEvent(dpy, &ev))
+			break;
+		handled++;
 		if (handler[ev.type])
 			handler[ev.type](&ev); /* call handler */
+#ifdef STATS
+		printstats();
+#endif /* STATS */
+	}
 }
 
 void
@@ -1639,8 +2253,10 @@ sendmon(Client *c, Monitor *m)
 	unfocus(c, 1);
 	detach(c);
 	detachstack(c);
+	unstack(c);
 	c->mon = m;
 	c->tags = m->tagset[m->seltags]; /* assign tags of target monitor */
+	c->isvisible = 1;
 	attach(c);
 	attachstack(c);
 	focus(NULL);
@@ -1716,6 +2332,7 @@ setfullscreen(Client *c, int fullscreen)
 		c->bw = 0;
 		c->isfloating = 1;
 		resizeclient(c, c->mon->mx, c->mon->my, c->mon->mw, c->mon->mh);
+		unstack(c);
 		XRaiseWindow(dpy, c->win);
 	} else if (!fullscreen && c->isfullscreen){
 		XChangeProperty(dpy, c->win, netatom[NetWMState], XA_ATOM, 32,
@@ -1844,6 +2461,7 @@ setup(void)
 	XChangeWindowAttributes(dpy, root, CWEventMask|CWCursor, &wa);
 	XSelectInput(dpy, root, wa.event_mask);
 	grabkeys();
+	compilerules();
 	focus(NULL);
 }
 
@@ -1860,22 +2478,28 @@ seturgent(Client *c, int urg)
 	XFree(wmh);
 }
 
+/* Only visible clients and the ones queued by queuehide() are looked at, and
+ * only those not already where they belong are moved. Clients that stay on
+ * hidden tags are left alone. */
 void
-showhide(Client *c)
+showhide(Monitor *m)
 {
-	if (!c)
-		return;
-	if (ISVISIBLE(c)) {
-		/* show clients top down */
-		XMoveWindow(dpy, c->win, c->x, c->y);
-		if ((!c->mon->lt[c->mon->sellt]->arrange || c->isfloating) && !c->isfullscreen)
+	Client *c;
+	int i;
+
+	/* show clients top down */
+	for (c = m->vstack; c; c = c->vsnext) {
+		if (c->cfgx != c->x || c->cfgy != c->y)
+			XMoveWindow(dpy, c->win, c->cfgx = c->x, c->cfgy = c->y);
+		if ((!m->lt[m->sellt]->arrange || c->isfloating) && !c->isfullscreen)
 			resize(c, c->x, c->y, c->w, c->h, 0);
-		showhide(c->snext);
-	} else {
-		/* hide clients bottom up */
-		showhide(c->snext);
-		XMoveWindow(dpy, c->win, WIDTH(c) * -2, c->y);
 	}
+	/* hide clients bottom up, they were queued top down */
+	for (i = m->nhiding - 1; i >= 0; i--)
+		if ((c = wintoclient(m->hiding[i])) && c->mon == m && !c->isvisible
+		&& (c->cfgx != WIDTH(c) * -2 || c->cfgy != c->y))
+			XMoveWindow(dpy, c->win, c->cfgx = WIDTH(c) * -2, c->cfgy = c->y);
+	m->nhiding = 0;
 }
 
 void
@@ -1905,6 +2529,7 @@ tag(const Arg *arg)
 {
 	if (selmon->sel && arg->ui & TAGMASK) {
 		selmon->sel->tags = arg->ui & TAGMASK;
+		updatevisible(selmon);
 		focus(NULL);
 		arrange(selmon);
 	}
@@ -1924,7 +2549,7 @@ tile(Monitor *m)
 	unsigned int i, n, h, mw, my, ty;
 	Client *c;
 
-	for (n = 0, c = nexttiled(m->clients); c; c = nexttiled(c->next), n++);
+	for (n = 0, c = nexttiled(m->vclients); c; c = nexttiled(c->vnext), n++);
 	if (n == 0)
 		return;
 
@@ -1932,7 +2557,7 @@ tile(Monitor *m)
 		mw = m->nmaster ? m->ww * m->mfact : 0;
 	else
 		mw = m->ww;
-	for (i = my = ty = 0, c = nexttiled(m->clients); c; c = nexttiled(c->next), i++)
+	for (i = my = ty = 0, c = nexttiled(m->vclients); c; c = nexttiled(c->vnext), i++)
 		if (i < m->nmaster) {
 			h = (m->wh - my) / (MIN(n, m->nmaster) - i);
 			resize(c, m->wx, m->wy + my, mw - (2*c->bw), h - (2*c->bw), 0);
@@ -1990,6 +2615,7 @@ toggletag(const Arg *arg)
 	newtags = selmon->sel->tags ^ (arg->ui & TAGMASK);
 	if (newtags) {
 		selmon->sel->tags = newtags;
+		updatevisible(selmon);
 		focus(NULL);
 		arrange(selmon);
 	}
@@ -2026,6 +2652,7 @@ toggleview(const Arg *arg)
 		if (selmon->showbar != selmon->pertag->showbars[selmon->pertag->curtag])
 			togglebar(NULL);
 
+		updatevisible(selmon);
 		focus(NULL);
 		arrange(selmon);
 	}
@@ -2052,6 +2679,8 @@ unmanage(Client *c, int destroyed)
 
 	detach(c);
 	detachstack(c);
+	unstack(c);
+	winmapdel(&clientmap, c->win);
 	if (!destroyed) {
 		wc.border_width = c->oldbw;
 		XGrabServer(dpy); /* avoid race conditions */
@@ -2090,6 +2719,17 @@ unmapnotify(XEvent *e)
 	}
 }
 
+/* forget where c was stacked, so the next restack puts it in place */
+void
+unstack(Client *c)
+{
+	int i;
+
+	for (i = 0; i < c->mon->nstacked; i++)
+		if (c->mon->stacked[i] == c->win)
+			c->mon->stacked[i] = None;
+}
+
 void
 updatebars(void)
 {
@@ -2110,6 +2750,7 @@ updatebars(void)
 		m->barwin = XCreateWindow(dpy, root, m->wx, m->by, w, bh, 0, DefaultDepth(dpy, screen),
 				CopyFromParent, DefaultVisual(dpy, screen),
 				CWOverrideRedirect|CWBackPixmap|CWEventMask, &wa);
+		winmapput(&barmap, m->barwin, m);
 		XDefineCursor(dpy, m->barwin, cursor[CurNormal]->cursor);
 		if (showsystray && m == systraytomon(m))
 			XMapRaised(dpy, systray->win);
@@ -2131,6 +2772,21 @@ updatebarpos(Monitor *m)
 		m->by = -bh;
 }
 
+void
+updatebuttonmap(void)
+{
+	unsigned int i, n;
+
+	for (i = n = 0; i < LENGTH(buttons); i++)
+		if (buttons[i].func)
+			n++;
+	bindmapinit(&buttonmap, n);
+	for (i = 0; i < LENGTH(buttons); i++)
+		if (buttons[i].func)
+			bindmapput(&buttonmap, buttons[i].click << 16
+				| buttons[i].button << 8 | CLEANMASK(buttons[i].mask), i);
+}
+
 void
 updateclientlist(void)
 {
@@ -2196,6 +2852,8 @@ updategeom(void)
 				m->clients = c->next;
 				detachstack(c);
 				c->mon = mons;
+				if (!(c->isvisible = ISVISIBLE(c) ? 1 : 0))
+					queuehide(c);
 				attach(c);
 				attachstack(c);
 			}
@@ -2419,6 +3077,32 @@ updatetitle(Client *c)
 		strcpy(c->name, broken);
 }
 
+/* Rebuilds the lists of visible clients, which layouts and focus walk instead
+ * of every client on the monitor. Call it whenever the monitor's tagset or a
+ * client's tags change. */
+void
+updatevisible(Monitor *m)
+{
+	Client *c, **tc;
+
+	for (tc = &m->vclients, c = m->clients; c; c = c->next)
+		if ((c->isvisible = ISVISIBLE(c) ? 1 : 0)) {
+			*tc = c;
+			tc = &c->vnext;
+		}
+	*tc = NULL;
+	/* the old visible list still runs through the clients it drops */
+	for (c = m->vstack; c; c = c->vsnext)
+		if (!c->isvisible)
+			queuehide(c);
+	for (tc = &m->vstack, c = m->stack; c; c = c->snext)
+		if (c->isvisible) {
+			*tc = c;
+			tc = &c->vsnext;
+		}
+	*tc = NULL;
+}
+
 void
 updatewindowtype(Client *c)
 {
@@ -2484,31 +3168,113 @@ view(const Arg *arg)
 	if (selmon->showbar != selmon->pertag->showbars[selmon->pertag->curtag])
 		togglebar(NULL);
 
+	updatevisible(selmon);
 	focus(NULL);
 	arrange(selmon);
 }
 
-Client *
-wintoclient(Window w)
+static unsigned int
+winmaphash(WinMap *map, Window w)
 {
-	Client *c;
-	Monitor *m;
+	/* Fibonacci hashing, since XIDs are mostly sequential */
+	return (unsigned int)(((unsigned long long)w * 0x9E3779B97F4A7C15ULL) >> (64 - map->bits));
+}
 
-	for (m = mons; m; m = m->next)
-		for (c = m->clients; c; c = c->next)
-			if (c->win == w)
-				return c;
+static void
+winmapgrow(WinMap *map)
+{
+	WinMap old = *map;
+	unsigned int i;
+
+	map->bits = old.bits ? old.bits + 1 : 6;
+	map->wins = ecalloc(1 << map->bits, sizeof(Window));
+	map->vals = ecalloc(1 << map->bits, sizeof(void *));
+	map->n = 0;
+	for (i = 0; old.wins && i < (1U << old.bits); i++)
+		if (old.wins[i])
+			winmapput(map, old.wins[i], old.vals[i]);
+	free(old.wins);
+	free(old.vals);
+}
+
+void
+winmapdel(WinMap *map, Window w)
+{
+	unsigned int i, j, k, mask = (1U << map->bits) - 1;
+
+	if (!map->n || !w)
+		return;
+	for (i = winmaphash(map, w); map->wins[i] != w; i = (i + 1) & mask)
+		if (!map->wins[i])
+			return;
+	/* shift the following entries back instead of leaving a tombstone, so
+	 * that lookups never have to skip over deleted slots */
+	for (j = i;;) {
+		map->wins[i] = None;
+		do {
+			j = (j + 1) & mask;
+			if (!map->wins[j]) {
+				map->n--;
+				return;
+			}
+			k = winmaphash(map, map->wins[j]);
+		} while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+		map->wins[i] = map->wins[j];
+		map->vals[i] = map->vals[j];
+		i = j;
+	}
+}
+
+void
+winmapfree(WinMap *map)
+{
+	free(map->wins);
+	free(map->vals);
+	memset(map, 0, sizeof(WinMap));
+}
+
+void *
+winmapget(WinMap *map, Window w)
+{
+	unsigned int i, mask = (1U << map->bits) - 1;
+
+	if (!map->n || !w)
+		return NULL;
+	for (i = winmaphash(map, w); map->wins[i]; i = (i + 1) & mask)
+		if (map->wins[i] == w)
+			return map->vals[i];
 	return NULL;
 }
 
+void
+winmapput(WinMap *map, Window w, void *val)
+{
+	unsigned int i, mask;
+
+	if (!w)
+		return;
+	/* keep the load factor at most 1/2, so probe sequences stay short */
+	if (2 * (map->n + 1) > (1U << map->bits))
+		winmapgrow(map);
+	mask = (1U << map->bits) - 1;
+	for (i = winmaphash(map, w); map->wins[i] && map->wins[i] != w; i = (i + 1) & mask);
+	if (!map->wins[i])
+		map->n++;
+	map->wins[i] = w;
+	map->vals[i] = val;
+}
+
 Client *
-wintosystrayicon(Window w) {
-	Client *i = NULL;
+wintoclient(Window w)
+{
+	return winmapget(&clientmap, w);
+}
 
+Client *
+wintosystrayicon(Window w) {
 	if (!showsystray || !w)
-		return i;
-	for (i = systray->icons; i && i->win != w; i = i->next) ;
-	return i;
+		return NULL;
+	return winmapget(&iconmap, w);
 }
 
 Monitor *
@@ -2520,9 +3286,8 @@ wintomon(Window w)
 
 	if (w == root && getrootptr(&x, &y))
 		return recttomon(x, y, 1, 1);
-	for (m = mons; m; m = m->next)
-		if (w == m->barwin)
-			return m;
+	if ((m = winmapget(&barmap, w)))
+		return m;
 	if ((c = wintoclient(w)))
 		return c->mon;
 	return selmon;
@@ -2587,7 +3352,7 @@ zoom(const Arg *arg)
 
 	if (!selmon->lt[selmon->sellt]->arrange || !c || c->isfloating)
 		return;
-	if (c == nexttiled(selmon->clients) && !(c = nexttiled(c->next)))
+	if (c == nexttiled(selmon->vclients) && !(c = nexttiled(c->vnext)))
 		return;
 	pop(c);
 }
@@ -32,6 +32,7 @@ sudo apt install -y \
     suckless-tools \
     arandr \
     libxfixes-dev \
+    libx11-xcb-dev \
     picom
 
 # Config git
@@ -35,6 +35,7 @@ sudo apt install -y \
     libxinerama-dev \
     libxft-dev \
     libxfixes-dev \
+    libx11-xcb-dev \
     picom
 
 # Config git